@@ -0,0 +1,101 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "vcd_writer.h"
+
+namespace vcd {
+// -----------------------------
+// Declaration of a var in VCD header
+struct VCDVarInfo
+{
+    std::string  scope;  // path of the scope, joined by "."
+    std::string  name;
+    VariableType type{};
+    unsigned     size{};
+    std::string  code;   // identifier code
+};
+
+// -----------------------------
+// Callbacks of `VCDReader::parse()`, the views are valid during the call only
+class VCDHandler
+{
+public:
+    virtual ~VCDHandler() = default;
+    //! `$date`, `$version`, `$timescale`, `$comment`... and the text up to `$end`
+    virtual void header(std::string_view /*keyword*/, std::string_view /*text*/) {}
+    virtual void scope(ScopeType /*type*/, std::string_view /*name*/) {}
+    virtual void upscope() {}
+    virtual void var(const VCDVarInfo& /*var*/) {}
+    virtual void enddefinitions() {}
+    //! "#timestamp", return `false` to stop parsing
+    virtual bool timestamp(TimeStamp /*timestamp*/) { return true; }
+    //! `$dumpvars`, `$dumpall`, `$dumpon`, `$dumpoff` and their `$end`
+    virtual void command(std::string_view /*keyword*/) {}
+    //! Value change of the var(s) of *code*: the *value* is as written in file,
+    //! the state of scalar ("1") or the type and the value ("b0101", "r1.5", "sidle")
+    virtual void change(std::string_view /*code*/, std::string_view /*value*/) {}
+};
+
+// -----------------------------
+// Streaming reader of VCD file: the file is memory mapped, the tokens are
+// scanned by SIMD where available. It also seeks by the index ("name.vcd.idx"
+// written with `VCDOptions::index_bytes` or `index_span`): the nearest checkpoint
+// before a timestamp is found by binary search, the values are read from it.
+// Methods throw `VCDException` on failure
+class VCDReader
+{
+public:
+    explicit VCDReader(const std::string &filename);
+    VCDReader(VCDReader&&) = delete;
+    VCDReader(const VCDReader&) = delete;
+    VCDReader& operator=(const VCDReader&) = delete;
+    VCDReader& operator=(VCDReader&&) = delete;
+    ~VCDReader();
+
+    [[nodiscard]] const std::vector<VCDVarInfo>& vars() const { return _vars; }
+    //! index in `vars()` of var "scope.name", -1 if there is no such a var
+    [[nodiscard]] int var_index(const std::string &scope, const std::string &name) const;
+
+    //! Parse the whole file (the header too) by the callbacks of *handler*,
+    //! return the number of value changes
+    size_t parse(VCDHandler &handler) const;
+
+    //! Values of all the vars after the changes at *timestamp*, in order of `vars()`:
+    //! bits of vectors (most significant first), "x" before the first dump,
+    //! real numbers and strings as they are written
+    const std::vector<VarValue>& values_at(TimeStamp timestamp);
+
+    //! number of checkpoints in the index (0 without index)
+    [[nodiscard]] size_t index_size() const { return _index.size(); }
+    //! size of the file, in bytes
+    [[nodiscard]] size_t size() const { return _size; }
+
+private:
+    //! Return the offset of the value changes after the header
+    size_t _parse_header(VCDHandler &handler) const;
+    //! Parse the value changes from *offset*, return their number
+    size_t _parse_changes(size_t offset, VCDHandler &handler) const;
+    void _read_index(const std::string &filename);
+    void _set_value(std::string_view code, std::string_view value);
+
+    std::string _filename;
+    const char *_data{};  // contents of the file
+    size_t      _size{};
+    bool        _mapped{};
+    std::vector<char> _buffer;  // contents without memory mapping
+
+    std::vector<VCDVarInfo> _vars;
+    std::unordered_map<std::string, std::vector<size_t>> _codes;  // vars of code (aliases)
+    size_t _body{};  // offset of the value changes after the header
+    // (timestamp, offset of "#timestamp" line followed by the values) of checkpoints
+    std::vector<std::pair<TimeStamp, size_t>> _index;
+    std::vector<VarValue> _values;
+    friend class VCDValuesHandler;
+};
+
+// -----------------------------
+}
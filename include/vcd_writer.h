@@ -2,14 +2,19 @@
 
 #include <unordered_map>
 #include <unordered_set>
+#include <type_traits>
+#include <cstdint>
 #include <string>
+#include <string_view>
+#include <bitset>
+#include <algorithm>
+#include <array>
 #include <cctype>
+#include <cstddef>
 #include <memory>
 #include <set>
 #include <utility>
-#include <fmt/base.h>
-#include <fmt/core.h>
-#include <fmt/os.h>
+#include <vector>
 
 #ifdef _MSC_VER
 #pragma warning (disable : 4996)
@@ -21,6 +26,10 @@ namespace utils {
 std::string format(const char *fmt, ...);
 std::string now();
 bool validate_date(const std::string&);
+//! identifier code of the variable *id* in printable ASCII (`!`..`~`),
+//! the shortest codes are for the smallest ids
+std::string ident_code(unsigned id);
+bool ends_with(const std::string &str, const std::string &suffix);
 }
 
 // -----------------------------
@@ -43,6 +52,34 @@ enum VCDValues : char
 
 using TimeStamp = unsigned;
 using VarValue = std::string;
+// Dense index of a registered variable (the same as its `_ident`),
+// it is the cheapest way to refer a variable in `VCDWriter::change()`
+using VarId = unsigned;
+// Integer types accepted as a value of variable (except characters)
+template <typename T, typename R = bool>
+using IntValue = std::enable_if_t<std::is_integral_v<T> && !std::is_same_v<T, char>
+                               && !std::is_same_v<T, wchar_t> && !std::is_same_v<T, char16_t>
+                               && !std::is_same_v<T, char32_t>, R>;
+
+// -----------------------------
+// Packed 4-state value: 2 bits per bit of variable, 32 bits per word,
+// the codes are indexes of `VCDValues` in `STATES`
+namespace packed {
+static constexpr std::array<char, 4> STATES{ VCDValues::ZERO, VCDValues::ONE, VCDValues::UNDEF, VCDValues::HIGHV };
+static constexpr unsigned BITS_PER_WORD = 32;
+
+//! interleave 32 bits with zeros, bit *i* goes to bit *2i*
+inline uint64_t spread(uint32_t bits)
+{
+    uint64_t x = bits;
+    x = (x | (x << 16)) & 0x0000FFFF0000FFFFull;
+    x = (x | (x << 8))  & 0x00FF00FF00FF00FFull;
+    x = (x | (x << 4))  & 0x0F0F0F0F0F0F0F0Full;
+    x = (x | (x << 2))  & 0x3333333333333333ull;
+    x = (x | (x << 1))  & 0x5555555555555555ull;
+    return x;
+}
+}
 
 // -----------------------------
 class VCDException : public std::exception
@@ -67,29 +104,221 @@ public:
     explicit VCDTypeException(const std::string& message) : VCDException(message) {}
 };
 
+// -----------------------------
+class VCDArena;
+struct VCDArenaDeleter { void operator()(VCDArena *p); };
+using ArenaPtr = std::unique_ptr<VCDArena, VCDArenaDeleter>;
+
 // -----------------------------
 struct VCDScope;
-using ScopePtr = std::shared_ptr<VCDScope>;
-struct ScopePtrHash
-{ bool operator()(const ScopePtr &l, const ScopePtr &r) const; };
+class VCDScopeTree;
+struct VCDScopeTreeDeleter { void operator()(VCDScopeTree *p); };
+using ScopeTreePtr = std::unique_ptr<VCDScopeTree, VCDScopeTreeDeleter>;
 
 // -----------------------------
 class VCDVariable;
-using VarPtr = std::shared_ptr<VCDVariable>;
-struct VarPtrHash
-{ size_t operator()(const VarPtr &p) const; };
-struct VarPtrEqual
-{ bool operator()(const VarPtr &a, const VarPtr &b) const; };
+
+// Non-owning handle of a registered variable, it is valid while its writer lives.
+// The variables are allocated by the writer's arena and freed all at once
+class VarHandle
+{
+public:
+    VarHandle() = default;
+    VarHandle(std::nullptr_t) {}
+
+    [[nodiscard]] VCDVariable* get() const { return _var; }
+    VCDVariable* operator->() const { return _var; }
+    explicit operator bool() const { return _var != nullptr; }
+
+    friend bool operator==(VarHandle a, VarHandle b) { return a._var == b._var; }
+    friend bool operator!=(VarHandle a, VarHandle b) { return a._var != b._var; }
+
+private:
+    friend class VCDWriter;
+    explicit VarHandle(VCDVariable *var) : _var(var) {}
+
+    VCDVariable *_var{};
+};
+using VarPtr = VarHandle;
 
 // -----------------------------
-struct VarSearch;
-using VarSearchPtr = std::shared_ptr<VarSearch>;
+// Typed handles of variables made by `VCDWriter::*_handle()`. Their `change()`
+// paths are chosen at compile time: no virtual calls and no temporary strings,
+// the width of `VectorHandle` is known to compiler
+class ScalarHandle
+{
+public:
+    ScalarHandle() = default;
+    [[nodiscard]] VarId id() const { return _id; }
+
+private:
+    friend class VCDWriter;
+    ScalarHandle(VarId id, bool vector) : _id(id), _vector(vector) {}
+
+    VarId _id = ~0u;
+    bool  _vector{};  // 1-bit vector ("b1 !") rather than scalar ("1!")
+};
+
+template <size_t N>
+class VectorHandle
+{
+    static_assert(N > 0, "Vector of zero bits");
+public:
+    static constexpr size_t SIZE = N;
+    static constexpr size_t WORDS = (N + 63) / 64;  // of integer value
+    VectorHandle() = default;
+    [[nodiscard]] VarId id() const { return _id; }
+
+private:
+    friend class VCDWriter;
+    explicit VectorHandle(VarId id) : _id(id) {}
+
+    VarId _id = ~0u;
+};
+
+class RealHandle
+{
+public:
+    RealHandle() = default;
+    [[nodiscard]] VarId id() const { return _id; }
+
+private:
+    friend class VCDWriter;
+    explicit RealHandle(VarId id) : _id(id) {}
+
+    VarId _id = ~0u;
+};
+
+class StringHandle
+{
+public:
+    StringHandle() = default;
+    [[nodiscard]] VarId id() const { return _id; }
+
+private:
+    friend class VCDWriter;
+    explicit StringHandle(VarId id) : _id(id) {}
+
+    VarId _id = ~0u;
+};
+// Key of the search index of vars: scope and name of var
+using VarKey = std::pair<const VCDScope*, std::string_view>;
+struct VarKeyHash
+{ size_t operator()(const VarKey &k) const; };
 
 // -----------------------------
 struct VCDHeader;
 struct VCDHeaderDeleter { void operator()(VCDHeader *p); };
 using HeadPtr = std::unique_ptr<VCDHeader, VCDHeaderDeleter>;
 
+// -----------------------------
+class VCDOutput;
+struct VCDOutputDeleter { void operator()(VCDOutput *p); };
+using OutputPtr = std::unique_ptr<VCDOutput, VCDOutputDeleter>;
+
+class VCDWindow;
+struct VCDWindowDeleter { void operator()(VCDWindow *p); };
+using WindowPtr = std::unique_ptr<VCDWindow, VCDWindowDeleter>;
+
+class VCDFilter;
+struct VCDFilterDeleter { void operator()(VCDFilter *p); };
+using FilterPtr = std::unique_ptr<VCDFilter, VCDFilterDeleter>;
+
+// Policy of asynchronous output when all the buffers are in flight
+enum class Backpressure : char
+{ block,  // wait for the background thread to write a buffer
+  drop }; // drop the filled buffer, count the dropped bytes (then all the values are dumped again)
+
+// Compression of VCD output file
+enum class Compression : char
+{ none, gzip, zstd,
+  by_suffix }; // ".gz" is gzip, ".zst" is zstd, otherwise none
+
+// Format of output file
+enum class Format : char
+{ vcd, fst,
+  by_suffix }; // ".fst" is FST, otherwise VCD
+
+// Writing of uncompressed VCD file
+enum class FileIO : char
+{ stream,  // buffered writes of stdio
+  direct,  // `O_DIRECT` writes of the page-aligned buffers, bypassing the page cache
+  mmap };  // copies into a growing memory mapped region of the file
+
+// Options of VCD output
+struct VCDOptions
+{
+    bool   async = false;           // write the file (and compress) by a background thread
+    size_t buffer_size = 1u << 20;  // size of an output buffer, in bytes
+    unsigned buffers = 4;           // number of buffers in asynchronous mode (memory bound)
+    Backpressure backpressure = Backpressure::block;
+    Compression compression = Compression::by_suffix;
+    int compression_level = -1;     // default level of the compressor
+    Format format = Format::by_suffix;  // FST is compressed by itself
+    FileIO file_io = FileIO::stream;    // of uncompressed VCD only
+    // `flush()` and `close()` wait until the data are on the disk (fdatasync),
+    // otherwise they are passed to the kernel only (VCD files and the index)
+    bool sync = false;
+    // Flight recorder: only the changes of the last *window* time units and/or
+    // at most *window_bytes* of them are kept in memory, the VCD is written
+    // by `VCDWriter::dump_window()` and `close()` (0 and 0 is off)
+    TimeStamp window = 0;
+    size_t window_bytes = 0;
+    // Rotation: the file "name.vcd" is written as the complete VCD segments
+    // "name.0000.vcd", "name.0001.vcd"... A segment is started on a new timestamp
+    // after *segment_bytes* of output or *segment_span* time units, it begins with
+    // the header and `$dumpvars` of the current values. The time ranges of the
+    // closed segments are listed in "name.manifest" (0 and 0 is off)
+    size_t segment_bytes = 0;
+    TimeStamp segment_span = 0;
+    // Index of the file for seeking by `VCDReader`: every *index_bytes* of output
+    // or *index_span* time units the values are dumped by `$dumpall` and the offset
+    // of its timestamp is written to "name.vcd.idx" (uncompressed VCD file only)
+    size_t index_bytes = 0;
+    TimeStamp index_span = 0;
+    // Selective dumping: a var is matched at registration by its full name "scope.name"
+    // and by the paths of its scopes (a scope selects its subtree). A rule is a glob
+    // ('*' is any characters, '?' is one) or an ECMAScript regex after "re:".
+    // The var is dumped if it matches any of *include_vars* (or there are none)
+    // and none of *exclude_vars*, the others get no-op ids and are not declared
+    std::vector<std::string> include_vars;
+    std::vector<std::string> exclude_vars;
+    // Counters of the writer (`VCDStats`) are written as JSON into the file on `close()`
+    std::string stats_file;
+};
+
+// -----------------------------
+// Destination of VCD output, it gets large buffers of whole records
+// (an aligned sink gets the blocks regardless of records).
+// In asynchronous mode `write()` is called by the background thread, `flush()`
+// and `close()` by the caller's thread when the background one is idle.
+// Methods throw `VCDException` on failure
+class VCDSink
+{
+public:
+    virtual ~VCDSink() = default;
+    //! The buffers are page-aligned. If the sink has an alignment, the sizes
+    //! of writes are its multiples except the last write before `flush()`;
+    //! the partial block of this write starts the next write again
+    [[nodiscard]] virtual size_t alignment() const { return 1u; }
+    virtual void write(const char *data, size_t size) = 0;
+    //! Pass all the written data to the destination
+    virtual void flush() = 0;
+    //! Flush and finish the output, no more writes follow
+    virtual void close() = 0;
+};
+using SinkPtr = std::unique_ptr<VCDSink>;
+
+// File sink, may compress the output (if supported by the build)
+SinkPtr makeVCDSink(const std::string &filename,
+                    Compression compression = Compression::by_suffix,
+                    int compression_level = -1,
+                    bool sync = false);
+// File sink of the format and compression given by *options*
+SinkPtr makeVCDSink(const std::string &filename, const VCDOptions &options);
+// FST file sink, translates the VCD records (if supported by the build)
+SinkPtr makeFSTSink(const std::string &filename);
+
 // -----------------------------
 HeadPtr makeVCDHeader(TimeScale     timescale_quan = TimeScale::ONE,
                       TimeScaleUnit timescale_unit = TimeScaleUnit::ns,
@@ -97,6 +326,121 @@ HeadPtr makeVCDHeader(TimeScale     timescale_quan = TimeScale::ONE,
                       const std::string& comment = "",
                       const std::string& version = "");
 
+// -----------------------------
+class VCDWriter;
+
+// Recorder of value changes made by one thread of a parallel simulation.
+// Each thread records into its own lock-free buffer, the changes are merged
+// in time order into VCD stream by `VCDWriter::commit()`, which may run
+// concurrently in another thread. Timestamps of a producer must not decrease.
+class VCDProducer
+{
+public:
+    VCDProducer(VCDProducer&&) = delete;
+    VCDProducer(const VCDProducer&) = delete;
+    VCDProducer& operator=(const VCDProducer&) = delete;
+    VCDProducer& operator=(VCDProducer&&) = delete;
+    ~VCDProducer();
+
+    // The value is validated and packed in the calling thread
+    void change(VarId id, TimeStamp timestamp, const VarValue &value);
+
+    template <typename T>
+    IntValue<T, void> change(VarId id, TimeStamp timestamp, T value)
+    {
+        if constexpr (std::is_signed_v<T>)
+            _change_signed(id, timestamp, int64_t(value));
+        else
+        {
+            const auto word = static_cast<uint64_t>(value);
+            change(id, timestamp, &word, 1u);
+        }
+    }
+
+    void change(VarId id, TimeStamp timestamp, const uint64_t *words, size_t n_words);
+
+private:
+    friend class VCDWriter;
+    explicit VCDProducer(const VCDWriter &writer) : _writer(writer) {}
+
+    struct Chunk;
+    //! The registered var *id* (`nullptr` if it is dropped by filters), the order is checked
+    const VCDVariable* _var(VarId id, TimeStamp timestamp) const;
+    //! Append the record of `_packed` value and publish it
+    void _push(VarId id, TimeStamp timestamp);
+    void _change_signed(VarId id, TimeStamp timestamp, int64_t value);
+    //! Append a record, publish it for the consumer
+    uint64_t* _append(VarId, TimeStamp, unsigned n_words, unsigned n_chars);
+    //! Consumer side: the next record or `nullptr`
+    const uint64_t* _peek();
+    void _pop();
+
+    const VCDWriter &_writer;
+    TimeStamp _timestamp{};
+    // producer side
+    Chunk *_tail{};
+    size_t _used{};
+    std::vector<uint64_t> _packed;
+    // consumer side
+    Chunk *_head{};
+    size_t _read{};
+};
+
+// -----------------------------
+// A row of the signal table of `VCDWriter::register_vars()`
+struct VarSpec
+{
+    std::string  scope;
+    std::string  name;
+    VariableType type = VariableType::integer;  // `VCDWriter::var_def_type`
+    unsigned     size = 0;
+    VarValue     init = { VCDValues::UNDEF };
+};
+
+// -----------------------------
+// Decimation of the value changes of a var (`VCDWriter::set_sampling()`), the policies
+// are combined. The suppressed changes are not formatted, but the values are tracked:
+// `$dumpall`, the segments and `dump_on(var)` have the current ones
+struct Sampling
+{
+    TimeStamp period = 0;     // at most one change per *period* time units
+    unsigned  every = 0;      // only each *every*-th change
+    double    threshold = 0.; // of real var: only the moves by more than *threshold* from the written value
+};
+
+// -----------------------------
+// Counters of the writer itself (`VCDWriter::stats()`). They are collected if the library
+// is built with `VCDWRITER_WITH_STATS` (CMake option, `WITH_STATS=1` for Make), otherwise
+// they stay zeros. The changes of the vars dropped by the filters are not counted.
+// The times are in nanoseconds and do not overlap
+struct VCDStats
+{
+#ifdef VCDWRITER_WITH_STATS
+    static constexpr bool enabled = true;
+#else
+    static constexpr bool enabled = false;
+#endif
+    size_t changes = 0;     // given: `change()` calls, values of batches, committed changes
+    size_t unchanged = 0;   // the same values as before (`false` returned)
+    size_t suppressed = 0;  // new values not written: sampled out, dumped off, kept by the window
+    size_t records = 0;     // value change records written
+    // output bytes by kind: value change records, declarations of all the segments,
+    // `$dumpvars`, `$dumpall`, `$dumpoff`, `$dumpon` and dumping of vars,
+    // the rest is timestamps and the flight recorder window
+    size_t scalar_bytes = 0;
+    size_t vector_bytes = 0;
+    size_t real_bytes = 0;
+    size_t string_bytes = 0;
+    size_t header_bytes = 0;
+    size_t dump_bytes = 0;
+    size_t other_bytes = 0;
+    size_t peak_buffered_bytes = 0;  // not written to the sink yet
+    uint64_t header_ns = 0;  // emission of the header
+    uint64_t format_ns = 0;  // formatting into the buffer (estimated by every 64th record)
+    uint64_t flush_ns = 0;   // writing of the buffers (or waiting for the background thread)
+    std::vector<size_t> var_changes;  // new values by VarId
+};
+
 // -----------------------------
 // Writer of a Value Change Dump file
 // A VCD file captures time-ordered changes to the value of variables
@@ -104,12 +448,24 @@ class VCDWriter
 {
 public:
     VCDWriter(std::string filename, HeadPtr &header, unsigned init_timestamp = 0u);
+    VCDWriter(std::string filename, HeadPtr &header, const VCDOptions &options, unsigned init_timestamp = 0u);
+    // Write VCD into the user's sink
+    VCDWriter(SinkPtr sink, HeadPtr &header, const VCDOptions &options = {}, unsigned init_timestamp = 0u);
+private:
+    VCDWriter(SinkPtr sink, HeadPtr &header, const VCDOptions &options, unsigned init_timestamp, std::string filename);
+public:
     VCDWriter(VCDWriter&&) = delete;
     VCDWriter(const VCDWriter&) = delete;
     VCDWriter& operator=(const VCDWriter&) = delete;
     VCDWriter& operator=(VCDWriter&&) = delete;
 
-    virtual ~VCDWriter() { close(nullptr); }
+    virtual ~VCDWriter()
+    {
+        try
+        { close(nullptr); }
+        catch (const VCDException&)
+        {} // no exceptions from destructor
+    }
 
     // Register a VCD variable and return its mark to change value further.
     // Remember, all VCD variables must be registered prior to any value changes.
@@ -121,6 +477,10 @@ public:
                         const VarValue &init = {VCDValues::UNDEF}, // Initial value (optional)
                         bool duplicate_names_check = true);        // speed-up (optimisation)
 
+    // Register the whole table of variables at once, the fast way for large designs.
+    // Ids follow the order of *specs*, nothing is registered if any spec is invalid
+    std::vector<VarId> register_vars(const std::vector<VarSpec> &specs, bool duplicate_names_check = true);
+
     // Change variable's value in VCD stream.
     // Call this method, for all variables changed on this *timestamp*.
     // It is okay to call it multiple times with the same *timestamp*, 
@@ -128,78 +488,359 @@ public:
     // Return:  *true* if new_value is dumped into VCD file,
     //         *false* if new_value is not changed from priveios *timestamp* for a given var
     bool change(VarPtr var, TimeStamp timestamp, const VarValue &value)
-    { return _change(std::move(var), timestamp, value, false); }
+    { return _change(var_id(var), timestamp, value); }
+
+    // Fast path: no hash lookups and no `shared_ptr` copies
+    bool change(VarId id, TimeStamp timestamp, const VarValue &value)
+    { return _change(id, timestamp, value); }
 
     bool change(const std::string &scope, const std::string &name, TimeStamp timestamp, const VarValue &value);
 
+    // Change value by an integer without building a binary string.
+    // The *value* must fit into the variable's size, a negative one is written
+    // as its two's complement of the size (or converted to a real)
+    template <typename T>
+    IntValue<T> change(VarPtr var, TimeStamp timestamp, T value)
+    { return change(var_id(var), timestamp, value); }
+
+    template <typename T>
+    IntValue<T> change(VarId id, TimeStamp timestamp, T value)
+    {
+        if constexpr (std::is_signed_v<T>)
+            return _change(id, timestamp, int64_t(value));
+        const auto word = static_cast<uint64_t>(value);
+        return _change(id, timestamp, &word, 1u);
+    }
+
+    template <size_t N>
+    bool change(VarPtr var, TimeStamp timestamp, const std::bitset<N> &value)
+    { return change(var_id(var), timestamp, value); }
+
+    template <size_t N>
+    bool change(VarId id, TimeStamp timestamp, const std::bitset<N> &value)
+    {
+        std::array<uint64_t, (N + 63) / 64> words{};
+        if constexpr (N <= 64)
+            words[0] = value.to_ullong();
+        else
+            for (size_t i = 0; i < N; ++i)
+                words[i / 64] |= uint64_t(value[i]) << (i % 64);
+        return _change(id, timestamp, words.data(), words.size());
+    }
+
+    // Change value of a wide bus, *words[0]* holds the least significant bits
+    bool change(VarPtr var, TimeStamp timestamp, const uint64_t *words, size_t n_words)
+    { return _change(var_id(var), timestamp, words, n_words); }
+
+    bool change(VarId id, TimeStamp timestamp, const uint64_t *words, size_t n_words)
+    { return _change(id, timestamp, words, n_words); }
+
+    // Typed change paths (see `ScalarHandle`). Scalar is one of `VCDValues`
+    // (any case) or an integer `0` or `1`
+    bool change(ScalarHandle var, TimeStamp timestamp, char value);
+
+    template <typename T>
+    IntValue<T> change(ScalarHandle var, TimeStamp timestamp, T value)
+    {
+        // -1 is one bit of ones
+        if (static_cast<uint64_t>(value) > 1u && !(std::is_signed_v<T> && value == T(-1)))
+            _throw_not_fits(var.id(), 1u);
+        return _change_scalar(var, timestamp, unsigned(value != 0));
+    }
+
+    template <size_t N, typename T>
+    IntValue<T> change(VectorHandle<N> var, TimeStamp timestamp, T value)
+    {
+        if constexpr (std::is_signed_v<T>)
+            if (value < 0)
+            {
+                // two's complement of N bits, the sign bit fits them
+                if constexpr (N < 64)
+                    if (int64_t(value) < -(int64_t(1) << (N - 1)))
+                        _throw_not_fits(var.id(), unsigned(N));
+                std::array<uint64_t, VectorHandle<N>::WORDS> words;
+                words.fill(~uint64_t(0));
+                words[0] = uint64_t(int64_t(value));
+                if constexpr (N % 64 != 0)
+                    words.back() &= (uint64_t(1) << (N % 64)) - 1;
+                return _change_vector(var, timestamp, words.data(), words.size());
+            }
+        const auto word = static_cast<uint64_t>(value);
+        return _change_vector(var, timestamp, &word, 1u);
+    }
+
+    template <size_t N>
+    bool change(VectorHandle<N> var, TimeStamp timestamp, const std::bitset<N> &value)
+    {
+        std::array<uint64_t, VectorHandle<N>::WORDS> words{};
+        if constexpr (N <= 64)
+            words[0] = value.to_ullong();
+        else
+            for (size_t i = 0; i < N; ++i)
+                words[i / 64] |= uint64_t(value[i]) << (i % 64);
+        return _change_vector(var, timestamp, words.data(), words.size());
+    }
+
+    // *words[0]* holds the least significant bits
+    template <size_t N>
+    bool change(VectorHandle<N> var, TimeStamp timestamp, const std::array<uint64_t, VectorHandle<N>::WORDS> &words)
+    { return _change_vector(var, timestamp, words.data(), words.size()); }
+
+    bool change(RealHandle var, TimeStamp timestamp, double value);
+    bool change(StringHandle var, TimeStamp timestamp, std::string_view value);
+
+    // Change *n* vars at once: the phase and the *timestamp* are checked once and
+    // all the records are formatted in one loop. *values[i]* is an integer value
+    // of var *ids[i]*, the vars are scalars or vectors up to 64 bits. Nothing is
+    // changed if any value is invalid. Return the number of changed values
+    size_t change_batch(TimeStamp timestamp, const VarId *ids, const uint64_t *values, size_t n);
+    // The same with signed values, a negative one is written as its two's complement of the size
+    size_t change_batch(TimeStamp timestamp, const VarId *ids, const int64_t *values, size_t n);
+
+    size_t change_batch(TimeStamp timestamp, const std::vector<VarId> &ids, const std::vector<uint64_t> &values)
+    {
+        if (ids.size() != values.size())
+            throw VCDTypeException{ "Different numbers of vars and values in batch" };
+        return change_batch(timestamp, ids.data(), values.data(), ids.size());
+    }
+
+    // The same with the 4-state values of any width packed as `packed::STATES` codes
+    // (2 bits per bit, 32 bits per word), var *ids[i]* takes `(size + 31) / 32` words
+    size_t change_batch_packed(TimeStamp timestamp, const VarId *ids, const uint64_t *values, size_t n);
+
     // Suspend dumping to VCD file
     void dump_off(TimeStamp timestamp)
     {
-        if (_dumping && !_registering && _vars_prevs.size())
+        if (_window && _dumping && !_registering)
+            _window_dump_mark(DUMP_OFF, timestamp);
+        else if (_dumping && !_registering && _vars_list.size())
             _dump_off(timestamp);
         _dumping = false;
     }
     // Resume dumping to VCD file
-    void dump_on(TimeStamp timestamp)
-    {
-        if (!_dumping && !_registering && _vars_prevs.size())
-            _ofile.print("#{:d}\n", timestamp);
-        _dump_values("$dumpon");
-        _dumping = true;
-    }
+    void dump_on(TimeStamp timestamp);
+
+    // Suspend or resume dumping of one var or of all the vars of the scope subtree.
+    // Only the affected vars are written: "x" when turned off, the current value
+    // when turned on; their values are tracked but not written while they are off
+    void dump_off(VarPtr var, TimeStamp timestamp) { _dump_var(var_id(var), false, timestamp); }
+    void dump_on(VarPtr var, TimeStamp timestamp) { _dump_var(var_id(var), true, timestamp); }
+    void dump_off(const std::string &scope, TimeStamp timestamp) { _dump_scope(scope, false, timestamp); }
+    void dump_on(const std::string &scope, TimeStamp timestamp) { _dump_scope(scope, true, timestamp); }
+
+    // Decimate the changes of the var or of the vars of the scope subtree
+    // (the threshold applies to its real vars), `Sampling{}` turns it off
+    void set_sampling(VarPtr var, const Sampling &sampling);
+    void set_sampling(const std::string &scope, const Sampling &sampling);
+
+    // Write the flight recorder window into a new complete VCD: the values at
+    // the window start in `$dumpvars` and the kept changes. The recording goes on
+    void dump_window(const std::string &filename);
+    void dump_window(SinkPtr sink);
 
     // Flush any buffered VCD data to output file.
     // If the VCD header has not already been written, calling `flush()` will force
     // the header to be written thus disallowing any further variable registrations.
-    void flush(const TimeStamp *timestamp = nullptr)
-    {
-        if (_closed)
-            throw VCDPhaseException{ "Cannot flush() after close()" };
-        if (_registering)
-            _finalize_registration();
-        if (timestamp != nullptr && *timestamp > _timestamp)
-            _ofile.print("#{:d}\n", *timestamp);
-        _ofile.flush();
-    }
+    // In asynchronous mode it waits for the background thread to write all the data.
+    void flush(const TimeStamp *timestamp = nullptr);
     // Close VCD writer. Any buffered VCD data is flushed to the output file.
     // After `close()`, NO variable registration or value changes will be accepted.
-    // Note, the output file-stream will be closed in destructor of `VCDWriter`
-    void close(const TimeStamp *timestamp = nullptr)
-    {
-        if (_closed)
-            return;
-        flush(timestamp);
-        _closed = true;
-    }
-
-    //! VCD viewer applications may display different scope types differently
+    void close(const TimeStamp *timestamp = nullptr);
+
+    // Create a recorder of value changes for a thread. Variables registration
+    // is finished. Create all the producers before starting the threads.
+    VCDProducer& producer();
+    // Merge the changes recorded by producers up to *timestamp* (inclusive) into
+    // VCD stream in time order, return the number of merged changes.
+    // `close()` merges all the rest changes
+    size_t commit(TimeStamp timestamp);
+
+    //! Bytes dropped by asynchronous output with `Backpressure::drop` policy
+    [[nodiscard]] size_t dropped_bytes() const;
+    //! Counters of the writer, zeros unless it is built with `VCDWRITER_WITH_STATS`
+    [[nodiscard]] VCDStats stats() const;
+
+    //! VCD viewer applications may display different scope types differently,
+    //! the *scope* may be a parent of the registered ones
     void set_scope_type(std::string& scope, ScopeType);
 
     void set_scope_default_type(ScopeType type)
     { _scope_def_type = type; }
 
+    //! Separator of the scope path components, it applies to the scopes
+    //! registered and looked up after the call
     void set_scope_sep(const std::string& scope_sep)
     {
         if (scope_sep.size() == 0 || scope_sep == _scope_sep)
             return;
         _scope_sep = scope_sep;
     }
+    //! Hint the relative frequency of changes of the var (before registration is finished),
+    //! the most frequently changing vars get the shortest identifier codes
+    void set_var_frequency(VarPtr var, unsigned frequency);
     //! get VCD Variable (if it is registered var() != NULL)
     VarPtr var(const std::string &scope, const std::string &name) const;
+    //! get dense index of the registered VCD Variable
+    VarId var_id(VarPtr var) const;
+    //! `true` if the var is dropped by the filters of `VCDOptions`,
+    //! its changes cost a check of id and are never dumped
+    [[nodiscard]] bool filtered(VarPtr var) const { return _filtered(var_id(var)); }
+
+    //! typed handles, they throw `VCDTypeException` if the var is of another type:
+    //! 1-bit 4-state var (not event)
+    ScalarHandle scalar_handle(VarPtr var) const;
+    //! bit vector var of *N* bits
+    template <size_t N>
+    VectorHandle<N> vector_handle(VarPtr var) const
+    { return VectorHandle<N>(_vector_id(var, unsigned(N))); }
+    RealHandle real_handle(VarPtr var) const;
+    StringHandle string_handle(VarPtr var) const;
 
     static const VariableType var_def_type = VariableType::integer;
 
 protected:
-    bool _change(VarPtr, TimeStamp, const VarValue&, bool);
+    //! `true` for the ids of vars dropped by the filters (not the dense ones)
+    [[nodiscard]] bool _filtered(VarId id) const { return (id ^ FILTERED_ID) < _filtered_vars.size(); }
+    [[nodiscard]] VCDVariable* _variable(VarId id) const
+    { return _filtered(id) ? _filtered_vars[id ^ FILTERED_ID] : _vars_list[id]; }
+    std::vector<VarId> _register_vars(const std::vector<VarSpec> &specs, bool duplicate_names_check);
+    //! `register_vars()` of the vars split by the filters
+    std::vector<VarId> _register_filtered(const std::vector<VarSpec> &specs, bool duplicate_names_check);
+    //! make the var dropped by the filters (the scope gets no vars)
+    VCDVariable* _make_filtered(const std::string &scope, const std::string &name, VariableType type,
+                                unsigned size, const VarValue &init, unsigned index);
+    bool _change(VarId, TimeStamp, const VarValue&);
+    bool _change(VarId, TimeStamp, const uint64_t*, size_t);
+    bool _change(VarId, TimeStamp, int64_t);
+    //! Check the phase and the timestamp, emit the timestamp if it is a new one
+    const VCDVariable& _prepare_change(VarId, TimeStamp);
+    //! Emit the timestamp if it is a new one
+    void _set_timestamp(TimeStamp);
+    [[nodiscard]] bool _segmented() const { return _options.segment_bytes || _options.segment_span; }
+    //! Close the segment, start the next one at *timestamp*
+    void _rotate(TimeStamp timestamp);
+    //! Dump all the values after a dropped buffer of output
+    void _resync();
+    //! Close the output, list the segment in manifest
+    void _close_segment();
+    //! Write the timestamp with the checkpoint of values, list it in the index
+    void _write_checkpoint(TimeStamp timestamp);
+    //! `true` if the change of var *id* goes to output, the flight recorder keeps it instead
+    bool _dump_change(VarId id, const uint64_t *value)
+    {
+        if constexpr (VCDStats::enabled)
+            _stats_change(id);
+        if (_registering)
+            return false;
+        const uint32_t mode = _vars_modes.empty() ? 0u : _vars_modes[id];
+        // the sampler counts only the changes to be written
+        if (!_window && (!_dumping || (mode & VAR_OFF)))
+            return false;
+        if ((mode >> 1) && !_sample((mode >> 1) - 1, value))
+            return false;
+        if (_window)
+        {
+            _window_change(id, value);
+            return false;
+        }
+        return true;
+    }
+    //! `true` if the sampler lets the change go to output
+    bool _sample(uint32_t sampler, const uint64_t *value);
+    // Instrumentation (`VCDStats`), the calls are compiled out without `VCDWRITER_WITH_STATS`
+    void _stats_change(VarId id)
+    {
+        if (id >= _stats.var_changes.size())
+            _stats.var_changes.resize(_vars_list.size());
+        ++_stats.var_changes[id];
+    }
+    //! output bytes and times before writing
+    struct StatsMark { size_t bytes; uint64_t ns; uint64_t io_ns; };
+    [[nodiscard]] StatsMark _stats_mark() const;
+    //! the same before a value change record, only one of `STATS_SAMPLE` records is timed
+    [[nodiscard]] StatsMark _stats_record_mark() const;
+    //! count the output since the *mark* into the counters (I/O time excluded)
+    void _stats_add(size_t &bytes, uint64_t &ns, const StatsMark &mark) const;
+    //! count the value change record of var *id* written since the *mark*
+    void _stats_record(VarId id, const StatsMark &mark);
+    //! keep the counters of the output before it is replaced
+    void _stats_output();
+    void _write_stats() const;
+    void _set_sampling(VarId id, const Sampling &sampling);
+    //! vars of the scope subtree
+    std::vector<VarId> _scope_vars(const std::string &scope) const;
+    //! turn dumping of the var on or off, write its value or "x"
+    void _dump_var(VarId id, bool on, TimeStamp timestamp);
+    void _dump_scope(const std::string &scope, bool on, TimeStamp timestamp);
+    //! check the phase and the timestamp of dumping of the vars
+    void _check_dump_vars(TimeStamp timestamp);
+    void _set_var_dump(VarId id, bool on);
+    //! Keep the change in the window, drop the oldest ones out of it
+    void _window_change(VarId id, const uint64_t *value);
+    void _window_dump_mark(VarId mark, TimeStamp);
+    void _window_evict();
+    void _dump_window(SinkPtr sink, const TimeStamp *timestamp);
+    //! Check the phase and the timestamp of batch, `false` if it is empty
+    bool _check_batch(TimeStamp, size_t n);
+    const VCDVariable& _batch_var(VarId) const;
+    //! Compare the packed value with the previous one, format the record into output
+    bool _batch_change(VarId, const uint64_t *value);
+    //! Compare the `_packed` value with the previous one, dump it if changed
+    bool _update_value(VarId, const VCDVariable&);
+    bool _update_string(VarId, const VCDVariable&, std::string_view);
+    //! `_prepare_change()` of a typed handle, return the previous value of *n_words*
+    uint64_t* _prepare_typed(VarId, TimeStamp, size_t n_words);
+    //! dump value change record of typed handle (the var's code is appended)
+    void _emit(VarId, std::string_view record);
+    bool _change_scalar(ScalarHandle, TimeStamp, unsigned code);
+    template <size_t N>
+    bool _change_vector(VectorHandle<N>, TimeStamp, const uint64_t *words, size_t n_words);
+    [[noreturn]] void _throw_not_fits(VarId, unsigned bits) const;
+    VarId _vector_id(VarPtr var, unsigned size) const;
+    //! Value change record of the previous value
+    void _value_record(VarId, VarValue &record) const;
     void _dump_off(TimeStamp);
     void _dump_values(const char *keyword);
-    void _scope_declaration(const std::string& scope, ScopeType type, size_t sub_beg, size_t sub_end = std::string::npos);
+    //! Records of the current values of all the vars (or "x" if *undef*, and of the vars
+    //! turned off) in order of ids, formatted in place by chunks of output
+    void _write_values(bool undef);
+    //! a var in the snapshot table, see `_dump_slots`
+    struct DumpSlot
+    {
+        static constexpr uint8_t EVENT = 0xFF;  // no value
+        std::array<char, 6> code;
+        uint8_t  code_size;
+        uint8_t  kind;  // of `VCDVariable`
+        unsigned size;
+    };
+    //! the most bytes of a record of the var, format it at *p* and return its end
+    [[nodiscard]] size_t _value_bytes(VarId, const DumpSlot&) const;
+    char* _format_value(VarId, const DumpSlot&, bool undef, char *p) const;
+    void _scope_declaration(std::string_view scope_name, ScopeType type);
     //! Dump VCD header into file
     void _write_header();
+    //! Dump the declarations of the scope, its vars and the nested scopes
+    void _write_scope(VCDScope &scope);
+    //! Header, the current timestamp and the values
+    void _write_start();
     //! Turn to dumping phase, no more variables regestration allowed
     void _finalize_registration();
+    void _assign_codes();
+    //! allocate the var in the arena
+    VCDVariable* _make_var(std::string_view name, VariableType type, unsigned size,
+                           const VCDScope *scope, unsigned id);
+    //! add the vars registered by `register_vars()` to the search index
+    void _index_vars() const;
 
 private:
+    // marks of dumping in the flight recorder window
+    static constexpr VarId DUMP_OFF = ~VarId(0);
+    static constexpr VarId DUMP_ON = ~VarId(1);
+    // ids of the vars dropped by the filters are indexes of `_filtered_vars` with this bit
+    static constexpr VarId FILTERED_ID = VarId(1) << 31;
+    // the clock costs more than formatting of a record
+    static constexpr size_t STATS_SAMPLE = 64;
+
     TimeStamp _timestamp;
     HeadPtr _header;
 
@@ -207,10 +848,23 @@ private:
     std::string _scope_sep;
     ScopeType   _scope_def_type{};
     std::string _filename;
-    fmt::ostream _ofile;
-
-    std::set<ScopePtr, ScopePtrHash> _scopes;
-    std::unordered_set<VarPtr, VarPtrHash, VarPtrEqual> _vars;
+    VCDOptions  _options;
+    OutputPtr   _ofile;
+    // rotation of the output
+    unsigned  _segment{};  // number of the current segment
+    TimeStamp _segment_start{};
+    // index of the output
+    SinkPtr   _index;
+    size_t    _index_offset{};  // of the last checkpoint
+    TimeStamp _index_timestamp{};
+    WindowPtr   _window;  // of flight recorder
+    FilterPtr   _filter;  // of selective dumping
+
+    ArenaPtr     _arena;  // owns the vars and the scopes
+    ScopeTreePtr _scopes;
+    // search index of vars by scope and name (built lazily after `register_vars()`)
+    mutable std::unordered_map<VarKey, VarId, VarKeyHash> _vars;
+    mutable size_t _vars_indexed{};
 
     // check changes of vars' values
     // state
@@ -219,11 +873,87 @@ private:
     bool _registering{};
     // gen var idents (internal names)
     unsigned   _next_var_id{};
-    VarSearchPtr _search;
 
-    std::unordered_map<VarPtr, VarValue> _vars_prevs;
+    // registered vars indexed by VarId
+    std::vector<VCDVariable*> _vars_list;
+    std::vector<VCDVariable*> _filtered_vars;  // dropped by the filters, not declared
+    // modes of vars indexed by VarId (empty until any is set): `VAR_OFF` if it is turned
+    // off by `dump_off(var)` or `dump_off(scope)`, above it 1 + index of its sampler
+    std::vector<uint32_t> _vars_modes;
+    static constexpr uint32_t VAR_OFF = 1u;
+    // state of the decimation of a var
+    struct Sampler
+    {
+        Sampling  policy;
+        unsigned  changes{};  // since the written one
+        bool      written{};
+        TimeStamp last{};     // of the written change
+        double    last_real{};
+    };
+    std::vector<Sampler> _samplers;
+    std::vector<unsigned> _vars_freqs;  // hints of change frequencies
+    // previous values of vars packed in 4-state form (2 bits per bit),
+    // a value of var *id* is in [_vars_prevs_offs[id], _vars_prevs_offs[id+1])
+    std::vector<uint64_t> _vars_prevs;
+    std::vector<size_t>   _vars_prevs_offs{ 0u };
+    // previous values of string vars, indexed by their packed values
+    std::vector<VarValue> _strings_prevs;
+    // the vars in order of ids as they are written by `$dumpvars`, `$dumpall`, `$dumpon`
+    // and `$dumpoff` (made when registering is finished): the snapshots of a million vars
+    // read this table and the values, not the vars
+    std::vector<DumpSlot> _dump_slots;
+    // reusable buffers of packed value and value change record
+    // (at least a word: events have no stored value, but they are packed)
+    std::vector<uint64_t> _packed = std::vector<uint64_t>(1u);
+    VarValue _record;
+
+    std::vector<std::unique_ptr<VCDProducer>> _producers;
+    VarValue _commit_value;
+
+    // counters of `stats()`, the ones of the closed segments too
+    VCDStats _stats;
+    size_t   _stats_bytes{};
+    friend class VCDProducer;
 };
 
+// -----------------------------
+template <size_t N>
+bool VCDWriter::_change_vector(VectorHandle<N> var, TimeStamp timestamp, const uint64_t *words, size_t n_words)
+{
+    constexpr size_t PACKED = (N + packed::BITS_PER_WORD - 1) / packed::BITS_PER_WORD;
+    if (_filtered(var.id()))
+        return false;
+    for (size_t w = N / 64; w < n_words; ++w)
+        if ((w == N / 64) ? (words[w] >> (N % 64)) : words[w])
+            _throw_not_fits(var.id(), unsigned(N));
+
+    std::array<uint64_t, PACKED> value;
+    for (size_t j = 0; j < PACKED; ++j)
+    {
+        const size_t w = j / 2;
+        value[j] = packed::spread((w < n_words) ? uint32_t(words[w] >> (32 * (j % 2))) : 0u);
+    }
+
+    uint64_t *prev = _prepare_typed(var.id(), timestamp, PACKED);
+    if (std::equal(value.begin(), value.end(), prev))
+        return false;
+    std::copy(value.begin(), value.end(), prev);
+    if (_dump_change(var.id(), prev))
+    {
+        // the most significant bit goes first
+        std::array<char, N + 2> record;
+        record[0] = 'b';
+        for (size_t i = 0; i < N; ++i)
+        {
+            const size_t bit = N - 1 - i;
+            record[i + 1] = packed::STATES[(value[bit / packed::BITS_PER_WORD] >> (2 * (bit % packed::BITS_PER_WORD))) & 3u];
+        }
+        record[N + 1] = ' ';
+        _emit(var.id(), std::string_view(record.data(), record.size()));
+    }
+    return true;
+}
+
 // -----------------------------
 using WriterPtr = std::shared_ptr<VCDWriter>;
 
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace vcd {
+// -----------------------------
+// Bump allocator of the registration phase objects: vars, scopes and names.
+// The objects are never destroyed one by one, so they must not own any memory
+// outside of the arena; all of them are freed with the arena by a few chunks.
+class VCDArena final
+{
+public:
+    VCDArena() = default;
+    VCDArena(VCDArena&&) = delete;
+    VCDArena(const VCDArena&) = delete;
+    VCDArena& operator=(const VCDArena&) = delete;
+    VCDArena& operator=(VCDArena&&) = delete;
+    ~VCDArena() = default;
+
+    void* allocate(size_t size, size_t align)
+    {
+        auto p = (reinterpret_cast<uintptr_t>(_cur) + align - 1) & ~uintptr_t(align - 1);
+        if (!_cur || p + size > reinterpret_cast<uintptr_t>(_end))
+        {
+            _grow(size + align);
+            p = (reinterpret_cast<uintptr_t>(_cur) + align - 1) & ~uintptr_t(align - 1);
+        }
+        _cur = reinterpret_cast<char*>(p + size);
+        return reinterpret_cast<void*>(p);
+    }
+
+    template <typename T, typename... Args>
+    T* make(Args&&... args)
+    { return new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...); }
+
+    //! copy of *s* terminated by zero (to be printed as C-string)
+    std::string_view copy(std::string_view s)
+    {
+        auto *p = static_cast<char*>(allocate(s.size() + 1, 1));
+        std::memcpy(p, s.data(), s.size());
+        p[s.size()] = '\0';
+        return { p, s.size() };
+    }
+
+    //! allocated bytes (all the chunks)
+    [[nodiscard]] size_t capacity() const { return _capacity; }
+
+private:
+    static constexpr size_t MIN_CHUNK = 1u << 16;
+    static constexpr size_t MAX_CHUNK = 1u << 24;
+
+    void _grow(size_t need)
+    {
+        // chunks grow with the arena, there are a few of them for millions of vars
+        const size_t size = std::max(need, std::clamp(_capacity, MIN_CHUNK, MAX_CHUNK));
+        _chunks.emplace_back(new char[size]);
+        _cur = _chunks.back().get();
+        _end = _cur + size;
+        _capacity += size;
+    }
+
+    std::vector<std::unique_ptr<char[]>> _chunks;
+    char  *_cur{};
+    char  *_end{};
+    size_t _capacity{};
+};
+
+// -----------------------------
+}
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <regex>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "vcd_writer.h"
+
+namespace vcd {
+// -----------------------------
+// Selective dumping: the rules of `VCDOptions::include_vars` and `exclude_vars`
+// are matched once per var at registration, never on value changes
+class VCDFilter final
+{
+public:
+    VCDFilter(const std::vector<std::string> &include, const std::vector<std::string> &exclude) :
+        _include(_compile(include)), _exclude(_compile(exclude))
+    {}
+
+    //! `true` if the var goes to output: it matches any include rule (or there
+    //! are none) and no exclude rule, by its full name or by a path of its scopes
+    [[nodiscard]] bool dumped(std::string_view scope, std::string_view name, std::string_view sep) const
+    {
+        const std::string full = std::string(scope).append(sep).append(name);
+        return (_include.empty() || _matches(_include, scope, full, sep)) && !_matches(_exclude, scope, full, sep);
+    }
+
+private:
+    struct Rule
+    {
+        std::string glob;
+        std::regex  regex;
+        bool is_regex{};
+
+        [[nodiscard]] bool matches(std::string_view path) const
+        { return is_regex ? std::regex_match(path.begin(), path.end(), regex) : glob_match(glob, path); }
+    };
+
+    static std::vector<Rule> _compile(const std::vector<std::string> &patterns)
+    {
+        std::vector<Rule> rules(patterns.size());
+        for (size_t i = 0; i < patterns.size(); ++i)
+        {
+            const std::string &p = patterns[i];
+            if (p.empty())
+                throw VCDTypeException{ "Empty filter of vars" };
+            if (p.compare(0, 3, "re:") != 0)
+            {
+                rules[i].glob = p;
+                continue;
+            }
+            try
+            { rules[i].regex = std::regex(p.substr(3), std::regex::ECMAScript | std::regex::optimize); }
+            catch (const std::regex_error &e)
+            { throw VCDTypeException{ utils::format("Invalid filter of vars '%s': %s", p.c_str(), e.what()) }; }
+            rules[i].is_regex = true;
+        }
+        return rules;
+    }
+
+    //! any rule matches the full name or the path of a scope (that is its subtree)
+    static bool _matches(const std::vector<Rule> &rules, std::string_view scope, std::string_view full, std::string_view sep)
+    {
+        for (const Rule &rule : rules)
+        {
+            if (rule.matches(full))
+                return true;
+            for (size_t end = scope.find(sep); ; end = scope.find(sep, end + sep.size()))
+            {
+                if (rule.matches(scope.substr(0, end)))
+                    return true;
+                if (end == std::string_view::npos)
+                    break;
+            }
+        }
+        return false;
+    }
+
+    //! '*' is any characters (the separators too), '?' is one character
+    static bool glob_match(std::string_view glob, std::string_view str)
+    {
+        size_t g = 0, s = 0, star = std::string_view::npos, mark = 0;
+        while (s < str.size())
+        {
+            if (g < glob.size() && (glob[g] == '?' || glob[g] == str[s]))
+            { ++g; ++s; }
+            else if (g < glob.size() && glob[g] == '*')
+            { star = g++; mark = s; }
+            else if (star != std::string_view::npos)
+            { g = star + 1; s = ++mark; }
+            else
+                return false;
+        }
+        while (g < glob.size() && glob[g] == '*')
+            ++g;
+        return g == glob.size();
+    }
+
+    const std::vector<Rule> _include;
+    const std::vector<Rule> _exclude;
+};
+
+// -----------------------------
+}
@@ -0,0 +1,309 @@
+#include "vcd_writer.h"
+#ifdef VCDWRITER_WITH_FST
+#include <algorithm>
+#include <cstdlib>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include <fstapi.h>
+#endif
+
+
+namespace vcd {
+using namespace utils;
+
+#ifdef VCDWRITER_WITH_FST
+// -----------------------------
+// FST (GTKWave's Fast Signal Trace) output. It takes the VCD records and
+// translates them to the calls of fstapi, that compresses the value changes
+// by blocks. In asynchronous mode all the work is done by the background thread.
+class VCDFstSink final : public VCDSink
+{
+public:
+    explicit VCDFstSink(const std::string &filename)
+    {
+        _ctx = fstWriterCreate(filename.c_str(), 1);
+        if (!_ctx)
+            throw VCDException{ format("Cannot open file '%s'", filename.c_str()) };
+        fstWriterSetPackType(_ctx, FST_WR_PT_LZ4);
+    }
+    ~VCDFstSink() override
+    {
+        if (_ctx)
+            fstWriterClose(_ctx);
+    }
+
+    void write(const char *data, size_t size) override
+    {
+        std::string_view text(data, size);
+        // a record split by the previous write
+        if (!_rest.empty())
+        {
+            const size_t n = text.find('\n');
+            _rest.append(text.substr(0, n));
+            if (n == std::string_view::npos)
+                return;
+            _line(_rest);
+            _rest.clear();
+            text.remove_prefix(n + 1);
+        }
+        for (size_t n = text.find('\n'); n != std::string_view::npos; n = text.find('\n'))
+        {
+            _line(text.substr(0, n));
+            text.remove_prefix(n + 1);
+        }
+        _rest.assign(text);
+    }
+    void flush() override
+    {
+        fstWriterFlushContext(_ctx);
+    }
+    void close() override
+    {
+        if (!_ctx)
+            return;
+        if (!_rest.empty())
+            _line(_rest);
+        _rest.clear();
+        fstWriterClose(_ctx);
+        _ctx = nullptr;
+    }
+
+private:
+    struct Var
+    {
+        fstHandle  handle;
+        uint32_t   size;
+        fstVarType type;
+    };
+
+    void _line(std::string_view line);
+    void _definition(std::string_view text);
+    void _value(std::string_view ident, std::string_view value);
+    const Var& _var(std::string_view ident);
+
+    void *_ctx{};
+    std::string _rest;  // incomplete line
+    std::string _decl;  // incomplete definition
+    bool _definitions{ true };
+    std::unordered_map<std::string, Var> _vars;
+    std::string _ident;
+    std::string _value_buf;
+};
+
+// -----------------------------
+static std::string_view trim(std::string_view s)
+{
+    const auto beg = s.find_first_not_of(" \t\n");
+    if (beg == std::string_view::npos)
+        return {};
+    return s.substr(beg, s.find_last_not_of(" \t\n") - beg + 1);
+}
+
+// -----------------------------
+// Cut the first word of *s*
+static std::string_view next_word(std::string_view &s)
+{
+    s = trim(s);
+    const auto n = std::min(s.find_first_of(" \t\n"), s.size());
+    const auto word = s.substr(0, n);
+    s.remove_prefix(n);
+    return word;
+}
+
+// -----------------------------
+void VCDFstSink::_line(std::string_view line)
+{
+    if (_definitions)
+    {
+        // header values may take several lines
+        if (!_decl.empty())
+            _decl.push_back('\n');
+        _decl.append(line);
+        const std::string_view decl = trim(_decl);
+        if (decl.size() >= 4 && decl.substr(decl.size() - 4) == "$end")
+        {
+            _definition(_decl);
+            _decl.clear();
+        }
+        return;
+    }
+    if (line.empty())
+        return;
+
+    switch (line[0])
+    {
+    case '#':
+        fstWriterEmitTimeChange(_ctx, std::strtoull(std::string(line.substr(1)).c_str(), nullptr, 10));
+        break;
+    case '$':
+        if (line == "$dumpoff")
+            fstWriterEmitDumpActive(_ctx, 0);
+        else if (line == "$dumpon")
+            fstWriterEmitDumpActive(_ctx, 1);
+        // $dumpvars, $dumpall, $end are just the value changes
+        break;
+    case 'b': case 'B':
+    case 'r': case 'R':
+    case 's': case 'S':
+    {
+        // string values may have spaces
+        const auto n = line.rfind(' ');
+        if (n == std::string_view::npos)
+            throw VCDException{ format("Invalid VCD record '%s'", std::string(line).c_str()) };
+        _value(line.substr(n + 1), line.substr(0, n));
+        break;
+    }
+    default:
+        _value(line.substr(1), line.substr(0, 1));
+        break;
+    }
+}
+
+// -----------------------------
+const VCDFstSink::Var& VCDFstSink::_var(std::string_view ident)
+{
+    _ident.assign(ident);
+    auto it = _vars.find(_ident);
+    if (it == _vars.end())
+        throw VCDException{ format("Undeclared VCD identifier '%s'", _ident.c_str()) };
+    return it->second;
+}
+
+// -----------------------------
+void VCDFstSink::_value(std::string_view ident, std::string_view value)
+{
+    const Var &var = _var(ident);
+    switch (value[0])
+    {
+    case 'r': case 'R':
+    {
+        const double real = std::strtod(std::string(value.substr(1)).c_str(), nullptr);
+        fstWriterEmitValueChange(_ctx, var.handle, &real);
+        return;
+    }
+    case 's': case 'S':
+        value.remove_prefix(1);
+        fstWriterEmitVariableLengthValueChange(_ctx, var.handle, value.data(), uint32_t(value.size()));
+        return;
+    case 'b': case 'B':
+        value.remove_prefix(1);
+        break;
+    default:
+        break;
+    }
+    if (var.type == FST_VT_GEN_STRING)
+        return; // the unknown state of string ($dumpoff) has no FST value
+    // fstapi reads exactly *size* states, extend them as VCD does
+    if (value.size() < var.size)
+    {
+        const char pad = (value.empty() || value[0] == VCDValues::ONE) ? char(VCDValues::ZERO) : value[0];
+        _value_buf.assign(var.size - value.size(), pad);
+        _value_buf.append(value);
+        value = _value_buf;
+    }
+    fstWriterEmitValueChange(_ctx, var.handle, value.data());
+}
+
+// -----------------------------
+void VCDFstSink::_definition(std::string_view text)
+{
+    text = trim(text);
+    text.remove_suffix(4); // $end
+    const std::string_view kw = next_word(text);
+    text = trim(text);
+
+    if (kw == "$timescale")
+    {
+        // "1 ns", "10 ps", "100ms"
+        static const std::pair<std::string_view, int> UNITS[] = {
+            { "fs", -15 }, { "ps", -12 }, { "ns", -9 }, { "us", -6 }, { "ms", -3 }, { "s", 0 }
+        };
+        const std::string value(text);
+        char *unit = nullptr;
+        unsigned long quan = std::strtoul(value.c_str(), &unit, 10);
+        int exponent = 0;
+        for (; quan >= 10; quan /= 10)
+            ++exponent;
+        const std::string_view unit_name = trim(unit);
+        for (const auto &u : UNITS)
+            if (unit_name == u.first)
+            {
+                exponent += u.second;
+                break;
+            }
+        fstWriterSetTimescale(_ctx, exponent);
+    }
+    else if (kw == "$date")
+        fstWriterSetDate(_ctx, std::string(text).c_str());
+    else if (kw == "$version")
+        fstWriterSetVersion(_ctx, std::string(text).c_str());
+    else if (kw == "$comment")
+        fstWriterSetComment(_ctx, std::string(text).c_str());
+    else if (kw == "$scope")
+    {
+        static const std::pair<std::string_view, fstScopeType> SCOPE_TYPES[] = {
+            { "begin", FST_ST_VCD_BEGIN }, { "fork", FST_ST_VCD_FORK }, { "function", FST_ST_VCD_FUNCTION },
+            { "module", FST_ST_VCD_MODULE }, { "task", FST_ST_VCD_TASK }
+        };
+        const std::string_view type = next_word(text);
+        fstScopeType scope_type = FST_ST_VCD_MODULE;
+        for (const auto &t : SCOPE_TYPES)
+            if (type == t.first)
+                scope_type = t.second;
+        fstWriterSetScope(_ctx, scope_type, std::string(trim(text)).c_str(), nullptr);
+    }
+    else if (kw == "$upscope")
+        fstWriterSetUpscope(_ctx);
+    else if (kw == "$var")
+    {
+        static const std::pair<std::string_view, fstVarType> VAR_TYPES[] = {
+            { "wire", FST_VT_VCD_WIRE }, { "reg", FST_VT_VCD_REG }, { "string", FST_VT_GEN_STRING },
+            { "parameter", FST_VT_VCD_PARAMETER }, { "integer", FST_VT_VCD_INTEGER }, { "real", FST_VT_VCD_REAL },
+            { "realtime", FST_VT_VCD_INTEGER }, { "time", FST_VT_VCD_TIME }, { "event", FST_VT_VCD_EVENT },
+            { "supply0", FST_VT_VCD_SUPPLY0 }, { "supply1", FST_VT_VCD_SUPPLY1 }, { "tri", FST_VT_VCD_TRI },
+            { "triand", FST_VT_VCD_TRIAND }, { "trior", FST_VT_VCD_TRIOR }, { "trireg", FST_VT_VCD_TRIREG },
+            { "tri0", FST_VT_VCD_TRI0 }, { "tri1", FST_VT_VCD_TRI1 }, { "wand", FST_VT_VCD_WAND },
+            { "wor", FST_VT_VCD_WOR }
+        };
+        // realtime vars are written as bit vectors (a binary value of *size* bits),
+        // so they are declared as integers, FST realtime is a double
+        const std::string_view type = next_word(text);
+        const std::string size = std::string(next_word(text));
+        const std::string ident = std::string(next_word(text));
+        const std::string name = std::string(trim(text));
+
+        fstVarType var_type = FST_VT_VCD_WIRE;
+        for (const auto &t : VAR_TYPES)
+            if (type == t.first)
+                var_type = t.second;
+        uint32_t var_size = uint32_t(std::strtoul(size.c_str(), nullptr, 10));
+        if (var_type == FST_VT_VCD_REAL)
+            var_size = 64;
+        else if (var_type == FST_VT_GEN_STRING)
+            var_size = 0;
+
+        auto it = _vars.find(ident);
+        const fstHandle alias = (it != _vars.end()) ? it->second.handle : 0;
+        const fstHandle handle = fstWriterCreateVar(_ctx, var_type, FST_VD_IMPLICIT, var_size, name.c_str(), alias);
+        if (it == _vars.end())
+            _vars.emplace(ident, Var{ handle, var_size, var_type });
+    }
+    else if (kw == "$enddefinitions")
+        _definitions = false;
+}
+#endif // VCDWRITER_WITH_FST
+
+// -----------------------------
+SinkPtr makeFSTSink(const std::string &filename)
+{
+#ifdef VCDWRITER_WITH_FST
+    return SinkPtr{ new VCDFstSink(filename) };
+#else
+    (void)filename;
+    throw VCDTypeException{ "FST output is not supported by the build" };
+#endif
+}
+
+// -----------------------------
+}
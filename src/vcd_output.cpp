@@ -0,0 +1,205 @@
+#include "vcd_output.h"
+
+
+namespace vcd {
+using namespace utils;
+
+// -----------------------------
+VCDOutput::VCDOutput(SinkPtr sink, const VCDOptions &options) :
+    _sink(std::move(sink)),
+    _align(_sink ? _sink->alignment() : 1u),
+    _buf_size(options.buffer_size),
+    _policy(options.backpressure),
+    _async(options.async)
+{
+    if (!_buf_size)
+        throw VCDTypeException{ "Invalid output buffer size 0" };
+    if (_async && options.buffers < 2)
+        throw VCDTypeException{ format("Invalid number of output buffers %u, at least 2", options.buffers) };
+    if (!_sink)
+        throw VCDTypeException{ "Invalid output sink" };
+    if (!_align || (_align & (_align - 1)) || _align > VCDBuffer::PAGE)
+        throw VCDTypeException{ format("Invalid output sink alignment %zu", _align) };
+
+    // a record more than the rest of buffer is still placed without reallocation
+    _buf = VCDBuffer(_buf_size + _buf_size / 8);
+    if (_async)
+    {
+        _free.reserve(options.buffers - 1);
+        for (unsigned i = 1; i < options.buffers; ++i)
+            _free.emplace_back(_buf_size + _buf_size / 8);
+        _thread = std::thread(&VCDOutput::_run, this);
+    }
+}
+
+// -----------------------------
+VCDOutput::~VCDOutput()
+{
+    try
+    { close(); }
+    catch (const VCDException&)
+    {} // no exceptions from destructor
+}
+
+// -----------------------------
+void VCDOutput::_check_error()
+{
+    if (_error)
+        std::rethrow_exception(_error);
+}
+
+// -----------------------------
+void VCDOutput::_submit(Backpressure policy, bool last)
+{
+    // the partial block of aligned sink goes to the next buffer, it is also
+    // written before flush (the sink writes it again with the next buffer)
+    const size_t tail = _buf.size() % _align;
+    const size_t size = last ? _buf.size() : _buf.size() - tail;
+    if (!_async)
+    {
+        _peak_bytes = std::max(_peak_bytes, _buf.size());
+        if (size)
+            _sink->write(_buf.data(), size);
+        _submitted += _buf.size() - tail;
+        _buf.erase_front(_buf.size() - tail);
+        _carried = tail;
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(_mutex);
+    _check_error();
+    _peak_bytes = std::max(_peak_bytes, _buf.size() + _in_flight);
+    if (_free.empty())
+    {
+        if (policy == Backpressure::drop)
+        {
+            _drop();
+            return;
+        }
+        _cv_free.wait(lock, [this] { return !_free.empty() || _error; });
+        _check_error();
+    }
+    VCDBuffer next = std::move(_free.back());
+    _free.pop_back();
+    next.append(_buf.data() + _buf.size() - tail, tail);
+    _submitted += _buf.size() - tail;
+    _carried = tail;
+    _buf.truncate(size);
+    _in_flight += size;
+    _full.push_back(std::move(_buf));
+    _buf = std::move(next);
+    lock.unlock();
+    _cv_full.notify_one();
+}
+
+// -----------------------------
+void VCDOutput::_drop()
+{
+    // the sink has got the beginning of the carried record (the partial block
+    // of aligned sink), it is kept up to the end of record
+    size_t keep = 0;
+    if (_carried)
+    {
+        const auto *nl = static_cast<const char*>(std::memchr(_buf.data() + _carried - 1, '\n',
+                                                              _buf.size() - _carried + 1));
+        keep = nl ? size_t(nl - _buf.data()) + 1 : _buf.size();
+    }
+    _dropped_bytes += _buf.size() - keep;
+    _buf.truncate(keep);
+    // the records to come are of the last timestamp, not of a dropped one
+    if (_has_timestamp)
+        _put_timestamp(_last_timestamp);
+    _lost = true;
+}
+
+// -----------------------------
+void VCDOutput::_run()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (true)
+    {
+        _cv_full.wait(lock, [this] { return !_full.empty() || _stop; });
+        if (_full.empty())
+            break;
+
+        VCDBuffer buf = std::move(_full.front());
+        _full.pop_front();
+        _busy = true;
+        lock.unlock();
+
+        std::exception_ptr error;
+        try
+        { _sink->write(buf.data(), buf.size()); }
+        catch (...)
+        { error = std::current_exception(); }
+        const size_t size = buf.size();
+        buf.clear();
+
+        lock.lock();
+        _in_flight -= size;
+        if (error && !_error)
+            _error = error;
+        _free.push_back(std::move(buf));
+        _busy = false;
+        _cv_free.notify_all();
+    }
+}
+
+// -----------------------------
+void VCDOutput::flush()
+{
+    if (!_sink)
+        return;
+    const uint64_t start = VCDStats::enabled ? clock_ns() : 0u;
+    if (!_buf.empty())
+        _submit(Backpressure::block, true);
+    if (_async)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _cv_free.wait(lock, [this] { return (_full.empty() && !_busy) || _error; });
+        _check_error();
+    }
+    _sink->flush();
+    if constexpr (VCDStats::enabled)
+        _io_ns += clock_ns() - start;
+}
+
+// -----------------------------
+void VCDOutput::close()
+{
+    if (!_sink)
+        return;
+
+    std::exception_ptr error;
+    try
+    { flush(); }
+    catch (const VCDException&)
+    { error = std::current_exception(); }
+
+    if (_thread.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stop = true;
+        }
+        _cv_full.notify_one();
+        _thread.join();
+    }
+    const uint64_t start = VCDStats::enabled ? clock_ns() : 0u;
+    try
+    { _sink->close(); }
+    catch (const VCDException&)
+    {
+        if (!error)
+            error = std::current_exception();
+    }
+    _sink.reset();
+    if constexpr (VCDStats::enabled)
+        _io_ns += clock_ns() - start;
+
+    if (error)
+        std::rethrow_exception(error);
+}
+
+// -----------------------------
+}
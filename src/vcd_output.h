@@ -0,0 +1,282 @@
+#pragma once
+
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <new>
+#include <exception>
+#include <iterator>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <fmt/base.h>
+#include <fmt/core.h>
+#include "vcd_writer.h"
+
+namespace vcd {
+// -----------------------------
+//! monotonic time of the counters of `VCDStats`
+inline uint64_t clock_ns()
+{
+    return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+// -----------------------------
+// Page-aligned output buffer, it is filled in place and passed to the sink
+// (or between the threads) without copies
+class VCDBuffer final
+{
+public:
+    using value_type = char;
+    static constexpr size_t PAGE = 4096;
+
+    explicit VCDBuffer(size_t capacity = 0) { _grow(capacity); }
+    VCDBuffer(VCDBuffer &&other) noexcept :
+        _data(std::move(other._data)), _size(std::exchange(other._size, 0u)), _capacity(std::exchange(other._capacity, 0u))
+    {}
+    VCDBuffer& operator=(VCDBuffer &&other) noexcept
+    {
+        _data = std::move(other._data);
+        _size = std::exchange(other._size, 0u);
+        _capacity = std::exchange(other._capacity, 0u);
+        return *this;
+    }
+    VCDBuffer(const VCDBuffer&) = delete;
+    VCDBuffer& operator=(const VCDBuffer&) = delete;
+    ~VCDBuffer() = default;
+
+    [[nodiscard]] const char* data() const { return _data.get(); }
+    [[nodiscard]] size_t size() const { return _size; }
+    [[nodiscard]] bool empty() const { return !_size; }
+    void clear() { _size = 0; }
+    //! keep the first *size* bytes
+    void truncate(size_t size) { _size = std::min(_size, size); }
+    //! move the bytes after the first *n* ones to the beginning
+    void erase_front(size_t n)
+    {
+        std::memmove(_data.get(), _data.get() + n, _size - n);
+        _size -= n;
+    }
+
+    //! pointer to *n* free bytes at the end, then `commit()` the used ones
+    char* reserve(size_t n)
+    {
+        if (_size + n > _capacity)
+            _grow(std::max(_size + n, 2 * _capacity));
+        return _data.get() + _size;
+    }
+    void commit(const char *end) { _size = size_t(end - _data.get()); }
+
+    void append(const char *data, size_t size)
+    {
+        std::memcpy(reserve(size), data, size);
+        _size += size;
+    }
+    void push_back(char c) { *reserve(1) = c; ++_size; }
+
+private:
+    struct Free
+    { void operator()(char *p) const { ::operator delete[](p, std::align_val_t(PAGE)); } };
+
+    void _grow(size_t capacity)
+    {
+        capacity = (capacity + PAGE - 1) & ~(PAGE - 1);
+        if (!capacity)
+            return;
+        std::unique_ptr<char[], Free> data(static_cast<char*>(::operator new[](capacity, std::align_val_t(PAGE))));
+        if (_size)
+            std::memcpy(data.get(), _data.get(), _size);
+        _data = std::move(data);
+        _capacity = capacity;
+    }
+
+    std::unique_ptr<char[], Free> _data;
+    size_t _size{};
+    size_t _capacity{};
+};
+
+// -----------------------------
+// Buffered output of VCD records into a sink. In asynchronous mode
+// full buffers are written (and compressed) by a background thread,
+// so the caller is blocked only if all `VCDOptions::buffers` are in flight.
+class VCDOutput final
+{
+public:
+    VCDOutput(SinkPtr sink, const VCDOptions &options);
+    VCDOutput(VCDOutput&&) = delete;
+    VCDOutput(const VCDOutput&) = delete;
+    VCDOutput& operator=(const VCDOutput&) = delete;
+    VCDOutput& operator=(VCDOutput&&) = delete;
+    ~VCDOutput();
+
+    template <typename... T>
+    void print(fmt::format_string<T...> fmt, T&&... args)
+    {
+        fmt::format_to(std::back_inserter(_buf), fmt, std::forward<T>(args)...);
+        _check_full();
+    }
+
+    void write(std::string_view data)
+    {
+        _buf.append(data.data(), data.size());
+        _check_full();
+    }
+
+    // Records of the fixed shapes are formatted by hand right into the buffer
+
+    //! "#<timestamp>\n"
+    void timestamp(TimeStamp timestamp)
+    {
+        _put_timestamp(timestamp);
+        _last_timestamp = timestamp;
+        _has_timestamp = true;
+        _check_full();
+    }
+    //! "<value><code>\n", *value* is "0", "b0101 " etc.
+    void record(std::string_view value, std::string_view code)
+    {
+        char *p = _buf.reserve(value.size() + code.size() + 1);
+        p = _copy(p, value);
+        p = _copy(p, code);
+        *p++ = '\n';
+        _buf.commit(p);
+        _check_full();
+    }
+    //! "s<value> <code>\n"
+    void string_record(std::string_view value, std::string_view code)
+    {
+        char *p = _buf.reserve(value.size() + code.size() + 3);
+        *p++ = 's';
+        p = _copy(p, value);
+        *p++ = ' ';
+        p = _copy(p, code);
+        *p++ = '\n';
+        _buf.commit(p);
+        _check_full();
+    }
+    //! "r<value> <code>\n", the same as "r%.16g "
+    void real_record(double value, std::string_view code)
+    {
+        char *p = _buf.reserve(MAX_REAL + code.size() + 3);
+        *p++ = 'r';
+        p = std::to_chars(p, p + MAX_REAL, value, std::chars_format::general, 16).ptr;
+        *p++ = ' ';
+        p = _copy(p, code);
+        *p++ = '\n';
+        _buf.commit(p);
+        _check_full();
+    }
+
+    //! Pointer to *n* bytes to format a record in place, then `commit()` its end
+    char* reserve(size_t n) { return _buf.reserve(n); }
+    void commit(const char *end)
+    {
+        _buf.commit(end);
+        _check_full();
+    }
+
+    //! Return when all buffered data is written to the sink
+    void flush();
+    //! Flush and close the sink, no more output is accepted
+    void close();
+
+    [[nodiscard]] size_t dropped_bytes() const { return _dropped_bytes; }
+    //! `true` once after a buffer is dropped: the output goes on with the last
+    //! timestamp again, but the dropped changes have to be dumped by the writer
+    [[nodiscard]] bool resync() { return std::exchange(_lost, false); }
+    //! all the output bytes (including the buffered ones, not the dropped ones)
+    [[nodiscard]] size_t bytes() const { return _submitted + _buf.size(); }
+    //! time of writing the buffers (with `VCDWRITER_WITH_STATS`), the most bytes not written yet
+    [[nodiscard]] uint64_t io_ns() const { return _io_ns; }
+    [[nodiscard]] size_t peak_bytes() const { return _peak_bytes; }
+
+private:
+    static constexpr size_t MAX_DIGITS = 20;  // of 64-bit integer
+    static constexpr size_t MAX_REAL = 24;    // "-1.234567890123456e-308"
+
+    static char* _copy(char *p, std::string_view s)
+    {
+        std::memcpy(p, s.data(), s.size());
+        return p + s.size();
+    }
+    void _put_timestamp(TimeStamp timestamp)
+    {
+        char *p = _buf.reserve(MAX_DIGITS + 2);
+        *p++ = '#';
+        p = std::to_chars(p, p + MAX_DIGITS, timestamp).ptr;
+        *p++ = '\n';
+        _buf.commit(p);
+    }
+    void _check_full()
+    {
+        if (_buf.size() < _buf_size)
+            return;
+        if constexpr (VCDStats::enabled)
+        {
+            const uint64_t start = clock_ns();
+            _submit(_policy, false);
+            _io_ns += clock_ns() - start;
+        }
+        else
+            _submit(_policy, false);
+    }
+    //! Pass the filled buffer to writing, the partial block of aligned sink
+    //! is kept unless it is the *last* one before flush
+    void _submit(Backpressure policy, bool last);
+    //! Drop the filled buffer but the bytes the sink has got a part of
+    void _drop();
+    //! Background thread loop
+    void _run();
+    void _check_error();
+
+    SinkPtr     _sink;
+    size_t      _align;  // of the sink writes
+    size_t      _buf_size;
+    VCDBuffer   _buf;  // being filled
+    Backpressure _policy;
+    size_t _dropped_bytes{};
+    size_t _submitted{};
+    size_t _carried{};  // bytes at the front of buffer the sink has got a part of
+    TimeStamp _last_timestamp{};
+    bool _has_timestamp{};
+    bool _lost{};  // a buffer is dropped
+    uint64_t _io_ns{};
+    size_t _peak_bytes{};
+    size_t _in_flight{};  // bytes of the full buffers
+
+    // asynchronous mode
+    bool _async;
+    std::thread _thread;
+    std::mutex  _mutex;
+    std::condition_variable _cv_full;  // a buffer to write or stop
+    std::condition_variable _cv_free;  // a buffer is written
+    std::deque<VCDBuffer>  _full;
+    std::vector<VCDBuffer> _free;
+    bool _busy{};
+    bool _stop{};
+    std::exception_ptr _error;
+};
+
+// -----------------------------
+// Sink writing into an output (the flight recorder window into the writer's output)
+class VCDOutputSink final : public VCDSink
+{
+public:
+    explicit VCDOutputSink(VCDOutput &output) : _output(output) {}
+    void write(const char *data, size_t size) override { _output.write({ data, size }); }
+    void flush() override {}
+    void close() override {}
+
+private:
+    VCDOutput &_output;
+};
+
+// -----------------------------
+}
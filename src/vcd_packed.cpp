@@ -0,0 +1,238 @@
+#include <cstring>
+#include "vcd_packed.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__SSE2__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define VCD_PACKED_SSE2 1
+#include <emmintrin.h>
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#define VCD_TARGET_AVX2
+#else
+#define VCD_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+
+namespace vcd::packed {
+// -----------------------------
+// Bit *i* of packed value is the character *chars[n - 1 - i]*,
+// the kernels go from the least significant bits by blocks
+// and leave the rest (most significant) to the scalar tails.
+
+// -----------------------------
+static bool pack_tail(const char *chars, size_t n, size_t i, uint64_t *packed)
+{
+    for (; i < n; ++i)
+    {
+        const int c = code(chars[n - 1 - i]);
+        if (c < 0)
+            return false;
+        packed[i / BITS_PER_WORD] |= uint64_t(c) << (2 * (i % BITS_PER_WORD));
+    }
+    return true;
+}
+
+// -----------------------------
+static void render_tail(const uint64_t *packed, size_t n, size_t i, char *chars)
+{
+    for (; i < n; ++i)
+        chars[n - 1 - i] = state(packed, unsigned(i));
+}
+
+// -----------------------------
+static bool pack_scalar(const char *chars, size_t n, uint64_t *packed)
+{ return pack_tail(chars, n, 0u, packed); }
+
+static void render_scalar(const uint64_t *packed, size_t n, char *chars)
+{ render_tail(packed, n, 0u, chars); }
+
+#ifdef VCD_PACKED_SSE2
+// -----------------------------
+static uint32_t reverse16(uint32_t x)
+{
+    x = ((x & 0x5555u) << 1) | ((x >> 1) & 0x5555u);
+    x = ((x & 0x3333u) << 2) | ((x >> 2) & 0x3333u);
+    x = ((x & 0x0F0Fu) << 4) | ((x >> 4) & 0x0F0Fu);
+    x = ((x & 0x00FFu) << 8) | ((x >> 8) & 0x00FFu);
+    return x;
+}
+
+static uint32_t reverse32(uint32_t x)
+{ return (reverse16(x & 0xFFFFu) << 16) | reverse16(x >> 16); }
+
+// byte *j* of mask selects bit *(7 - j % 8)* of a byte
+static constexpr uint64_t SELECT_REVERSED = 0x0102040810204080ull;
+static constexpr uint64_t BROADCAST = 0x0101010101010101ull;
+
+// -----------------------------
+static bool pack_sse2(const char *chars, size_t n, uint64_t *packed)
+{
+    const __m128i c0 = _mm_set1_epi8(VCDValues::ZERO);
+    const __m128i c1 = _mm_set1_epi8(VCDValues::ONE);
+    const __m128i cx = _mm_set1_epi8(VCDValues::UNDEF);
+    const __m128i cz = _mm_set1_epi8(VCDValues::HIGHV);
+    const __m128i lower = _mm_set1_epi8(0x20);
+
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        const __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(chars + n - i - 16));
+        const __m128i l = _mm_or_si128(c, lower);
+        const __m128i is1 = _mm_cmpeq_epi8(c, c1);
+        const __m128i isx = _mm_cmpeq_epi8(l, cx);
+        const __m128i isz = _mm_cmpeq_epi8(l, cz);
+        const __m128i valid = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(c, c0), is1), _mm_or_si128(isx, isz));
+        if (_mm_movemask_epi8(valid) != 0xFFFF)
+            return false;
+        // byte j holds the bit (i + 15 - j)
+        const uint32_t lo = reverse16(uint32_t(_mm_movemask_epi8(_mm_or_si128(is1, isz))));
+        const uint32_t hi = reverse16(uint32_t(_mm_movemask_epi8(_mm_or_si128(isx, isz))));
+        packed[i / BITS_PER_WORD] |= (spread(lo) | (spread(hi) << 1)) << (2 * (i % BITS_PER_WORD));
+    }
+    return pack_tail(chars, n, i, packed);
+}
+
+// -----------------------------
+static void render_sse2(const uint64_t *packed, size_t n, char *chars)
+{
+    const __m128i select = _mm_set1_epi64x(int64_t(SELECT_REVERSED));
+    const __m128i one = _mm_set1_epi8(1);
+    const __m128i x_one = _mm_set1_epi8(VCDValues::UNDEF - VCDValues::ZERO);
+    const __m128i zero = _mm_set1_epi8(VCDValues::ZERO);
+
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        const uint64_t codes = packed[i / BITS_PER_WORD] >> (2 * (i % BITS_PER_WORD));
+        const uint32_t lo = unspread(codes), hi = unspread(codes >> 1);
+        // byte j gets the bit (i + 15 - j)
+        const __m128i vlo = _mm_set_epi64x(int64_t(BROADCAST * (lo & 0xFFu)), int64_t(BROADCAST * ((lo >> 8) & 0xFFu)));
+        const __m128i vhi = _mm_set_epi64x(int64_t(BROADCAST * (hi & 0xFFu)), int64_t(BROADCAST * ((hi >> 8) & 0xFFu)));
+        const __m128i b0 = _mm_cmpeq_epi8(_mm_and_si128(vlo, select), select);
+        const __m128i b1 = _mm_cmpeq_epi8(_mm_and_si128(vhi, select), select);
+        // '0' + b0 + ('x' - '0') * b1 + b0 * b1 (as 'z' == 'x' + 2)
+        __m128i c = _mm_add_epi8(zero, _mm_and_si128(b0, one));
+        c = _mm_add_epi8(c, _mm_and_si128(b1, x_one));
+        c = _mm_add_epi8(c, _mm_and_si128(_mm_and_si128(b0, b1), one));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(chars + n - i - 16), c);
+    }
+    render_tail(packed, n, i, chars);
+}
+
+// -----------------------------
+VCD_TARGET_AVX2 static bool pack_avx2(const char *chars, size_t n, uint64_t *packed)
+{
+    const __m256i c0 = _mm256_set1_epi8(VCDValues::ZERO);
+    const __m256i c1 = _mm256_set1_epi8(VCDValues::ONE);
+    const __m256i cx = _mm256_set1_epi8(VCDValues::UNDEF);
+    const __m256i cz = _mm256_set1_epi8(VCDValues::HIGHV);
+    const __m256i lower = _mm256_set1_epi8(0x20);
+
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32)
+    {
+        const __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(chars + n - i - 32));
+        const __m256i l = _mm256_or_si256(c, lower);
+        const __m256i is1 = _mm256_cmpeq_epi8(c, c1);
+        const __m256i isx = _mm256_cmpeq_epi8(l, cx);
+        const __m256i isz = _mm256_cmpeq_epi8(l, cz);
+        const __m256i valid = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(c, c0), is1),
+                                              _mm256_or_si256(isx, isz));
+        if (uint32_t(_mm256_movemask_epi8(valid)) != 0xFFFFFFFFu)
+            return false;
+        // byte j holds the bit (i + 31 - j)
+        const uint32_t lo = reverse32(uint32_t(_mm256_movemask_epi8(_mm256_or_si256(is1, isz))));
+        const uint32_t hi = reverse32(uint32_t(_mm256_movemask_epi8(_mm256_or_si256(isx, isz))));
+        packed[i / BITS_PER_WORD] = spread(lo) | (spread(hi) << 1);
+    }
+    return pack_tail(chars, n, i, packed);
+}
+
+// -----------------------------
+VCD_TARGET_AVX2 static void render_avx2(const uint64_t *packed, size_t n, char *chars)
+{
+    const __m256i select = _mm256_set1_epi64x(int64_t(SELECT_REVERSED));
+    const __m256i one = _mm256_set1_epi8(1);
+    const __m256i x_one = _mm256_set1_epi8(VCDValues::UNDEF - VCDValues::ZERO);
+    const __m256i zero = _mm256_set1_epi8(VCDValues::ZERO);
+
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32)
+    {
+        const uint64_t codes = packed[i / BITS_PER_WORD];
+        const uint32_t lo = unspread(codes), hi = unspread(codes >> 1);
+        // byte j gets the bit (i + 31 - j)
+        const __m256i vlo = _mm256_set_epi64x(int64_t(BROADCAST * (lo & 0xFFu)),         int64_t(BROADCAST * ((lo >> 8) & 0xFFu)),
+                                              int64_t(BROADCAST * ((lo >> 16) & 0xFFu)), int64_t(BROADCAST * (lo >> 24)));
+        const __m256i vhi = _mm256_set_epi64x(int64_t(BROADCAST * (hi & 0xFFu)),         int64_t(BROADCAST * ((hi >> 8) & 0xFFu)),
+                                              int64_t(BROADCAST * ((hi >> 16) & 0xFFu)), int64_t(BROADCAST * (hi >> 24)));
+        const __m256i b0 = _mm256_cmpeq_epi8(_mm256_and_si256(vlo, select), select);
+        const __m256i b1 = _mm256_cmpeq_epi8(_mm256_and_si256(vhi, select), select);
+        __m256i c = _mm256_add_epi8(zero, _mm256_and_si256(b0, one));
+        c = _mm256_add_epi8(c, _mm256_and_si256(b1, x_one));
+        c = _mm256_add_epi8(c, _mm256_and_si256(_mm256_and_si256(b0, b1), one));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(chars + n - i - 32), c);
+    }
+    // 16-bits block is still possible
+    render_sse2(packed + i / BITS_PER_WORD, n - i, chars);
+}
+
+// -----------------------------
+static bool cpu_has_avx2()
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+    std::array<int, 4> regs{};
+    __cpuid(regs.data(), 0);
+    if (regs[0] < 7)
+        return false;
+    __cpuid(regs.data(), 1);
+    const bool osxsave = (regs[2] & (1 << 27)) != 0;
+    if (!osxsave || (_xgetbv(0) & 0x6) != 0x6)
+        return false;
+    __cpuidex(regs.data(), 7, 0);
+    return (regs[1] & (1 << 5)) != 0;
+#else
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif // VCD_PACKED_SSE2
+
+// -----------------------------
+Isa best_isa()
+{
+#ifdef VCD_PACKED_SSE2
+    static const Isa isa = cpu_has_avx2() ? Isa::avx2 : Isa::sse2;
+    return isa;
+#else
+    return Isa::scalar;
+#endif
+}
+
+// -----------------------------
+const Kernels& kernels(Isa isa)
+{
+    static const std::array<Kernels, int(Isa::_count_)> KERNELS{
+        Kernels{ pack_scalar, render_scalar },
+#ifdef VCD_PACKED_SSE2
+        Kernels{ pack_sse2, render_sse2 },
+        Kernels{ pack_avx2, render_avx2 },
+#else
+        Kernels{ pack_scalar, render_scalar },
+        Kernels{ pack_scalar, render_scalar },
+#endif
+    };
+    if (isa >= Isa::_count_ || isa > best_isa())
+        isa = Isa::scalar;
+    return KERNELS[int(isa)];
+}
+
+// -----------------------------
+const Kernels& kernels()
+{
+    static const Kernels &best = kernels(best_isa());
+    return best;
+}
+
+// -----------------------------
+}
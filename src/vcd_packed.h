@@ -0,0 +1,67 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include "vcd_writer.h"
+
+// -----------------------------
+// Packed 4-state value (`STATES`, `BITS_PER_WORD` and `spread()` are
+// in vcd_writer.h for the typed handles)
+namespace vcd::packed {
+// -----------------------------
+static constexpr uint64_t ALL_UNDEF = 0xAAAAAAAAAAAAAAAAull;
+
+//! 4-state code of character or -1 if it is not one of `VCDValues`
+inline int code(char c)
+{
+    switch (c)
+    {
+    case VCDValues::ZERO:  return 0;
+    case VCDValues::ONE:   return 1;
+    case VCDValues::UNDEF: case 'X': return 2;
+    case VCDValues::HIGHV: case 'Z': return 3;
+    default: return -1;
+    }
+}
+
+//! inverse of `spread()`, bit *2i* goes to bit *i*
+inline uint32_t unspread(uint64_t x)
+{
+    x &= 0x5555555555555555ull;
+    x = (x | (x >> 1))  & 0x3333333333333333ull;
+    x = (x | (x >> 2))  & 0x0F0F0F0F0F0F0F0Full;
+    x = (x | (x >> 4))  & 0x00FF00FF00FF00FFull;
+    x = (x | (x >> 8))  & 0x0000FFFF0000FFFFull;
+    x = (x | (x >> 16)) & 0x00000000FFFFFFFFull;
+    return uint32_t(x);
+}
+
+inline unsigned words(unsigned bits)
+{ return (bits + BITS_PER_WORD - 1) / BITS_PER_WORD; }
+
+inline char state(const uint64_t *packed, unsigned i)
+{ return STATES[(packed[i / BITS_PER_WORD] >> (2 * (i % BITS_PER_WORD))) & 3u]; }
+
+// -----------------------------
+// Instruction sets of the kernels, the best one is selected at runtime
+enum class Isa : char { scalar, sse2, avx2, _count_ };
+
+struct Kernels
+{
+    //! pack *n* characters (the most significant goes first) into zeroed *packed*,
+    //! return `false` if any character is not one of `VCDValues` (any case)
+    bool (*pack)(const char *chars, size_t n, uint64_t *packed);
+    //! render *n* packed codes into characters (the most significant goes first)
+    void (*render)(const uint64_t *packed, size_t n, char *chars);
+};
+
+//! the best instruction set supported by CPU
+Isa best_isa();
+//! kernels of the instruction set (scalar ones if it is not supported)
+const Kernels& kernels(Isa isa);
+//! kernels of the best instruction set
+const Kernels& kernels();
+
+// -----------------------------
+}
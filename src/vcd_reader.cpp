@@ -0,0 +1,347 @@
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include "vcd_reader.h"
+#if defined(__SSE2__) && defined(__GNUC__)
+#include <emmintrin.h>
+#define VCDREADER_SSE2
+#endif
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define VCDREADER_MMAP
+#endif
+
+
+namespace vcd {
+using namespace utils;
+
+// -----------------------------
+// Whitespace is any byte up to ' ', the tokens are printable ASCII
+static bool is_space(char c) { return static_cast<unsigned char>(c) <= ' '; }
+
+// -----------------------------
+//! first non-space of [p, end)
+static const char* skip_spaces(const char *p, const char *end)
+{
+#ifdef VCDREADER_SSE2
+    const __m128i space = _mm_set1_epi8(' ');
+    for (; p + 16 <= end; p += 16)
+    {
+        // the bytes above ' ' differ from their max with ' '
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        const unsigned mask = ~unsigned(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(v, space), space))) & 0xFFFFu;
+        if (mask)
+            return p + __builtin_ctz(mask);
+    }
+#endif
+    while (p < end && is_space(*p))
+        ++p;
+    return p;
+}
+
+// -----------------------------
+//! end of the token starting at *p*
+static const char* token_end(const char *p, const char *end)
+{
+#ifdef VCDREADER_SSE2
+    const __m128i space = _mm_set1_epi8(' ');
+    for (; p + 16 <= end; p += 16)
+    {
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        const auto mask = unsigned(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(v, space), space)));
+        if (mask)
+            return p + __builtin_ctz(mask);
+    }
+#endif
+    while (p < end && !is_space(*p))
+        ++p;
+    return p;
+}
+
+// -----------------------------
+// Tokens of the contents
+class VCDTokens
+{
+public:
+    VCDTokens(const char *data, size_t size, size_t offset) : _beg(data), _p(data + offset), _end(data + size) {}
+
+    //! the next token, empty at the end
+    std::string_view next()
+    {
+        const char *p = skip_spaces(_p, _end);
+        _p = token_end(p, _end);
+        return { p, size_t(_p - p) };
+    }
+    //! the text up to `$end` (trimmed), `$end` is skipped
+    std::string_view text_to_end()
+    {
+        const char *p = skip_spaces(_p, _end);
+        const char *q = p;
+        for (std::string_view token = next(); !token.empty() && token != "$end"; token = next())
+            q = _p;
+        return { p, size_t(q - p) };
+    }
+    [[nodiscard]] size_t offset() const { return size_t(_p - _beg); }
+
+private:
+    const char *_beg;
+    const char *_p;
+    const char *_end;
+};
+
+// -----------------------------
+static const std::array<std::string_view, 19> VAR_TYPES = {
+    "wire", "reg", "string", "parameter", "integer", "real", "realtime", "time", "event",
+    "supply0", "supply1", "tri", "triand", "trior", "trireg", "tri0", "tri1", "wand", "wor"
+};
+static const std::array<std::string_view, 5> SCOPE_TYPES = { "begin", "fork", "function", "module", "task" };
+
+// -----------------------------
+template <size_t N>
+static int find_name(const std::array<std::string_view, N> &names, std::string_view name)
+{
+    auto it = std::find(names.begin(), names.end(), name);
+    return (it == names.end()) ? -1 : int(it - names.begin());
+}
+
+// -----------------------------
+// Collects the vars of the header
+class VCDVarsHandler final : public VCDHandler
+{
+public:
+    explicit VCDVarsHandler(std::vector<VCDVarInfo> &vars) : _vars(vars) {}
+    void var(const VCDVarInfo &var) override { _vars.push_back(var); }
+
+private:
+    std::vector<VCDVarInfo> &_vars;
+};
+
+// -----------------------------
+// Applies the value changes up to the timestamp to the reader's values
+class VCDValuesHandler final : public VCDHandler
+{
+public:
+    VCDValuesHandler(VCDReader &reader, TimeStamp until) : _reader(reader), _until(until) {}
+    bool timestamp(TimeStamp timestamp) override { return timestamp <= _until; }
+    void change(std::string_view code, std::string_view value) override { _reader._set_value(code, value); }
+
+private:
+    VCDReader &_reader;
+    TimeStamp _until;
+};
+
+// -----------------------------
+VCDReader::VCDReader(const std::string &filename) :
+    _filename(filename)
+{
+#ifdef VCDREADER_MMAP
+    const int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw VCDException{ format("Cannot open file '%s': %s", filename.c_str(), std::strerror(errno)) };
+    struct stat st{};
+    if (::fstat(fd, &st) == 0 && st.st_size > 0)
+    {
+        void *p = ::mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED)
+        {
+            ::madvise(p, size_t(st.st_size), MADV_SEQUENTIAL);
+            _data = static_cast<const char*>(p);
+            _size = size_t(st.st_size);
+            _mapped = true;
+        }
+    }
+    ::close(fd);
+#endif
+    if (!_mapped)
+    {
+        std::ifstream file(filename, std::ios::binary);
+        if (!file.is_open())
+            throw VCDException{ format("Cannot open file '%s'", filename.c_str()) };
+        _buffer.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        _data = _buffer.data();
+        _size = _buffer.size();
+    }
+
+    VCDVarsHandler handler(_vars);
+    _body = _parse_header(handler);
+    for (size_t i = 0; i < _vars.size(); ++i)
+        _codes[_vars[i].code].push_back(i);
+    _values.assign(_vars.size(), VarValue(1, VCDValues::UNDEF));
+    _read_index(filename + ".idx");
+}
+
+// -----------------------------
+VCDReader::~VCDReader()
+{
+#ifdef VCDREADER_MMAP
+    if (_mapped)
+        ::munmap(const_cast<char*>(_data), _size);
+#endif
+}
+
+// -----------------------------
+size_t VCDReader::_parse_header(VCDHandler &handler) const
+{
+    std::vector<std::string_view> scopes;
+    VCDTokens tokens(_data, _size, 0u);
+    VCDVarInfo var;
+    for (std::string_view token = tokens.next(); !token.empty(); token = tokens.next())
+    {
+        if (token == "$scope")
+        {
+            const int type = find_name(SCOPE_TYPES, tokens.next());
+            const std::string_view name = tokens.next();
+            if (type < 0 || tokens.next() != "$end")
+                throw VCDException{ format("Invalid VCD file '%s': scope '%s'", _filename.c_str(), std::string(name).c_str()) };
+            scopes.push_back(name);
+            handler.scope(ScopeType(type), name);
+        }
+        else if (token == "$upscope")
+        {
+            tokens.next();
+            if (!scopes.empty())
+                scopes.pop_back();
+            handler.upscope();
+        }
+        else if (token == "$var")
+        {
+            const int type = find_name(VAR_TYPES, tokens.next());
+            var.size = unsigned(std::strtoul(std::string(tokens.next()).c_str(), nullptr, 10));
+            var.code = tokens.next();
+            var.name = tokens.next();
+            if (type < 0)
+                throw VCDException{ format("Invalid VCD file '%s': type of var '%s'", _filename.c_str(), var.name.c_str()) };
+            var.type = VariableType(type);
+            // the rest is a bit range of the name
+            for (token = tokens.next(); !token.empty() && token != "$end"; token = tokens.next())
+                var.name += token;
+            var.scope.clear();
+            for (const auto &s : scopes)
+                (var.scope.empty() ? var.scope : var.scope.append(".")).append(s);
+            handler.var(var);
+        }
+        else if (token == "$enddefinitions")
+        {
+            tokens.next();
+            handler.enddefinitions();
+            return tokens.offset();
+        }
+        else if (token[0] == '$')
+            handler.header(token, tokens.text_to_end());
+    }
+    throw VCDException{ format("Invalid VCD file '%s': no $enddefinitions", _filename.c_str()) };
+}
+
+// -----------------------------
+size_t VCDReader::_parse_changes(size_t offset, VCDHandler &handler) const
+{
+    size_t n_changes = 0;
+    VCDTokens tokens(_data, _size, offset);
+    for (std::string_view token = tokens.next(); !token.empty(); token = tokens.next())
+    {
+        switch (token[0])
+        {
+        case '#':
+            if (!handler.timestamp(TimeStamp(std::strtoull(std::string(token.substr(1)).c_str(), nullptr, 10))))
+                return n_changes;
+            break;
+        case '$':
+            if (token == "$comment")
+                tokens.text_to_end();
+            else
+                handler.command(token);
+            break;
+        case 'b': case 'B': case 'r': case 'R': case 's': case 'S':
+            handler.change(tokens.next(), token);
+            ++n_changes;
+            break;
+        default:
+            // scalar: the state and the code
+            handler.change(token.substr(1), token.substr(0, 1));
+            ++n_changes;
+            break;
+        }
+    }
+    return n_changes;
+}
+
+// -----------------------------
+size_t VCDReader::parse(VCDHandler &handler) const
+{
+    return _parse_changes(_parse_header(handler), handler);
+}
+
+// -----------------------------
+void VCDReader::_read_index(const std::string &filename)
+{
+    std::ifstream file(filename);
+    if (!file.is_open())
+        return;
+    std::string magic;
+    unsigned version = 0;
+    if (!(file >> magic >> version) || magic != "vcd-index" || version != 1)
+        throw VCDException{ format("Invalid index file '%s'", filename.c_str()) };
+
+    TimeStamp timestamp = 0;
+    size_t offset = 0;
+    while (file >> timestamp >> offset)
+    {
+        if ((!_index.empty() && timestamp < _index.back().first) || offset > _size)
+            throw VCDException{ format("Invalid index file '%s' at '%u'", filename.c_str(), timestamp) };
+        _index.emplace_back(timestamp, offset);
+    }
+}
+
+// -----------------------------
+int VCDReader::var_index(const std::string &scope, const std::string &name) const
+{
+    for (size_t i = 0; i < _vars.size(); ++i)
+        if (_vars[i].scope == scope && _vars[i].name == name)
+            return int(i);
+    return -1;
+}
+
+// -----------------------------
+const std::vector<VarValue>& VCDReader::values_at(TimeStamp timestamp)
+{
+    // the last checkpoint not after the timestamp
+    auto it = std::upper_bound(_index.begin(), _index.end(), timestamp,
+                               [](TimeStamp ts, const auto &entry) { return ts < entry.first; });
+    _values.assign(_vars.size(), VarValue(1, VCDValues::UNDEF));
+    VCDValuesHandler handler(*this, timestamp);
+    _parse_changes((it == _index.begin()) ? _body : std::prev(it)->second, handler);
+    return _values;
+}
+
+// -----------------------------
+void VCDReader::_set_value(std::string_view code, std::string_view value)
+{
+    auto it = _codes.find(std::string(code));
+    if (it == _codes.end())
+        throw VCDException{ format("Invalid VCD file '%s': unknown code '%s'", _filename.c_str(), std::string(code).c_str()) };
+    // without the type of record
+    if (value.size() > 1 || std::strchr("bBrRsS", value[0]))
+        value.remove_prefix(1);
+    for (size_t i : it->second)
+    {
+        const VCDVarInfo &var = _vars[i];
+        VarValue &v = _values[i];
+        v = value;
+        if (var.type == VariableType::real || var.type == VariableType::string)
+            continue;
+        std::transform(v.begin(), v.end(), v.begin(), [](char c) { return char(std::tolower(c)); });
+        // the left-truncated vector is extended by 0 or by its x, z
+        if (v.size() < var.size)
+            v.insert(0, var.size - v.size(), (v.empty() || v[0] == '1') ? '0' : v[0]);
+    }
+}
+
+// -----------------------------
+}
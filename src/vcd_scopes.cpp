@@ -0,0 +1,80 @@
+#include <functional>
+#include "vcd_scopes.h"
+
+
+namespace vcd {
+
+// -----------------------------
+void VCDScopeTreeDeleter::operator()(VCDScopeTree *p) { delete p; }
+
+// -----------------------------
+size_t VCDScopeTree::EdgeHash::operator()(const Edge &e) const
+{
+    std::hash<const void*> h;
+    return (h(e.first) ^ (h(e.second) << 1));
+}
+
+// -----------------------------
+const char* VCDScopeTree::_interned(std::string_view comp) const
+{
+    auto it = _index.find(comp);
+    return (it != _index.end()) ? it->data() : nullptr;
+}
+
+// -----------------------------
+VCDScope* VCDScopeTree::_child(const VCDScope *parent, std::string_view comp) const
+{
+    const char *name = _interned(comp);
+    if (!name)
+        return nullptr;
+    auto it = _edges.find(Edge{ parent, name });
+    return (it != _edges.end()) ? it->second : nullptr;
+}
+
+// -----------------------------
+VCDScope* VCDScopeTree::find(std::string_view path, std::string_view sep) const
+{
+    const VCDScope *scope = &_root;
+    for (size_t beg = 0;;)
+    {
+        const size_t n = path.find(sep, beg);
+        scope = _child(scope, path.substr(beg, n - beg));
+        if (!scope || n == std::string_view::npos)
+            break;
+        beg = n + sep.size();
+    }
+    return const_cast<VCDScope*>(scope);
+}
+
+// -----------------------------
+VCDScope* VCDScopeTree::get(std::string_view path, std::string_view sep, ScopeType type)
+{
+    VCDScope *scope = &_root;
+    for (size_t beg = 0;;)
+    {
+        const size_t n = path.find(sep, beg);
+        const std::string_view comp = path.substr(beg, n - beg);
+        VCDScope *child = _child(scope, comp);
+        if (!child)
+        {
+            const char *name = _interned(comp);
+            if (!name)
+            {
+                name = _arena.copy(comp).data();
+                _index.insert(std::string_view(name, comp.size()));
+            }
+            child = _arena.make<VCDScope>(std::string_view(name, comp.size()), type, scope);
+            _edges.emplace(Edge{ scope, name }, child);
+            child->next = scope->children;
+            scope->children = child;
+        }
+        scope = child;
+        if (n == std::string_view::npos)
+            break;
+        beg = n + sep.size();
+    }
+    return scope;
+}
+
+// -----------------------------
+}
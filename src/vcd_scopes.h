@@ -0,0 +1,70 @@
+#pragma once
+
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include "vcd_writer.h"
+#include "vcd_arena.h"
+
+namespace vcd {
+// -----------------------------
+// A node of the scope hierarchy, it keeps only its own path component.
+// Scopes live in the arena, the lists of children and vars are intrusive
+struct VCDScope final
+{
+    std::string_view name;    // path component, interned by `VCDScopeTree`
+    ScopeType   type;
+    VCDScope   *parent;
+    bool has_vars{};          // there are vars in the subtree
+    VCDScope   *children{};   // the first child
+    VCDScope   *next{};       // the next sibling
+    VCDVariable *vars{};      // the first var, in order of registration
+    VCDVariable *last_var{};
+
+    VCDScope(std::string_view name, ScopeType type, VCDScope *parent) :
+        name(name), type(type), parent(parent) {}
+
+    //! append *var* to the list, mark the scope and its parents having vars
+    void add_var(VCDVariable *var);
+};
+
+// -----------------------------
+// Trie of scopes by path components. Each distinct component is stored once,
+// a scope is found by its path in O(depth) hash lookups without allocations
+class VCDScopeTree final
+{
+public:
+    explicit VCDScopeTree(VCDArena &arena) : _arena(arena), _root("", ScopeType::module, nullptr) {}
+    VCDScopeTree(VCDScopeTree&&) = delete;
+    VCDScopeTree(const VCDScopeTree&) = delete;
+    VCDScopeTree& operator=(const VCDScopeTree&) = delete;
+    VCDScopeTree& operator=(VCDScopeTree&&) = delete;
+    ~VCDScopeTree() = default;
+
+    //! scope of the *path* split by *sep*, `nullptr` if there is no such a scope
+    [[nodiscard]] VCDScope* find(std::string_view path, std::string_view sep) const;
+    //! scope of the *path*, the missing ones are made of *type*
+    VCDScope* get(std::string_view path, std::string_view sep, ScopeType type);
+    //! the top-level scopes are its children, it has no name
+    [[nodiscard]] VCDScope& root() { return _root; }
+
+    [[nodiscard]] size_t size() const { return _edges.size(); }
+
+private:
+    using Edge = std::pair<const VCDScope*, const char*>;  // parent and interned name
+    struct EdgeHash
+    { size_t operator()(const Edge &e) const; };
+
+    //! interned *comp* or `nullptr` if it is not interned
+    [[nodiscard]] const char* _interned(std::string_view comp) const;
+    VCDScope* _child(const VCDScope *parent, std::string_view comp) const;
+
+    VCDArena &_arena;  // storage of the scopes and the interned components
+    VCDScope  _root;
+    std::unordered_set<std::string_view> _index;  // of interned components
+    std::unordered_map<Edge, VCDScope*, EdgeHash> _edges;
+};
+
+// -----------------------------
+}
@@ -0,0 +1,494 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <new>
+#include <string>
+#include <utility>
+#include <vector>
+#include "vcd_writer.h"
+#ifdef VCDWRITER_WITH_ZLIB
+#include <zlib.h>
+#endif
+#ifdef VCDWRITER_WITH_ZSTD
+#include <zstd.h>
+#endif
+#if defined(__unix__) || defined(__APPLE__)
+#define VCDWRITER_POSIX_IO
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#elif defined(_WIN32)
+#include <io.h>
+#endif
+
+
+namespace vcd {
+using namespace utils;
+
+// -----------------------------
+// Wait until the written data of file are on the disk, not only in the kernel
+static void sync_file(int fd, const std::string &filename)
+{
+#if defined(__linux__)
+    const int res = ::fdatasync(fd);
+#elif defined(VCDWRITER_POSIX_IO)
+    const int res = ::fsync(fd);
+#elif defined(_WIN32)
+    const int res = ::_commit(fd);
+#else
+    (void)fd;
+    const int res = 0;
+#endif
+    if (res != 0)
+        throw VCDException{ format("Cannot sync file '%s': %s", filename.c_str(), std::strerror(errno)) };
+}
+
+// -----------------------------
+// Plain file, the buffers are large enough to bypass stdio buffering
+class VCDFileSink final : public VCDSink
+{
+public:
+    explicit VCDFileSink(std::string filename, bool sync = false) : _filename(std::move(filename)), _sync(sync)
+    {
+        _file = std::fopen(_filename.c_str(), "wb");
+        if (!_file)
+            throw VCDException{ format("Cannot open file '%s': %s", _filename.c_str(), std::strerror(errno)) };
+        std::setvbuf(_file, nullptr, _IONBF, 0);
+    }
+    ~VCDFileSink() override
+    {
+        if (_file)
+            std::fclose(_file);
+    }
+
+    void write(const char *data, size_t size) override
+    {
+        if (std::fwrite(data, 1, size, _file) != size)
+            throw VCDException{ format("Cannot write file '%s': %s", _filename.c_str(), std::strerror(errno)) };
+    }
+    void flush() override
+    {
+        if (std::fflush(_file) != 0)
+            throw VCDException{ format("Cannot flush file '%s': %s", _filename.c_str(), std::strerror(errno)) };
+        if (_sync)
+            sync_file(_fd(), _filename);
+    }
+    void close() override
+    {
+        if (!_file)
+            return;
+        if (_sync)
+            flush();
+        const int res = std::fclose(_file);
+        _file = nullptr;
+        if (res != 0)
+            throw VCDException{ format("Cannot close file '%s': %s", _filename.c_str(), std::strerror(errno)) };
+    }
+
+private:
+    int _fd() const
+    {
+#ifdef _WIN32
+        return ::_fileno(_file);
+#else
+        return ::fileno(_file);
+#endif
+    }
+
+    std::string _filename;
+    std::FILE  *_file{};
+    bool        _sync{};  // of `flush()` and `close()`
+};
+
+#ifdef VCDWRITER_POSIX_IO
+// -----------------------------
+// File descriptor of the sinks below, the file is truncated to the written size on close
+class VCDFileDesc final
+{
+public:
+    VCDFileDesc(std::string filename, int flags, bool sync) : _filename(std::move(filename)), _sync(sync)
+    {
+        _fd = ::open(_filename.c_str(), O_RDWR | O_CREAT | O_TRUNC | flags, 0644);
+#ifdef O_DIRECT
+        // the file system does not support O_DIRECT (tmpfs), the same aligned writes
+        if (_fd < 0 && errno == EINVAL && (flags & O_DIRECT))
+            _fd = ::open(_filename.c_str(), O_RDWR | O_CREAT | O_TRUNC | (flags & ~O_DIRECT), 0644);
+#endif
+        if (_fd < 0)
+            throw VCDException{ format("Cannot open file '%s': %s", _filename.c_str(), std::strerror(errno)) };
+    }
+    VCDFileDesc(VCDFileDesc&&) = delete;
+    VCDFileDesc(const VCDFileDesc&) = delete;
+    VCDFileDesc& operator=(const VCDFileDesc&) = delete;
+    VCDFileDesc& operator=(VCDFileDesc&&) = delete;
+    ~VCDFileDesc()
+    {
+        if (_fd >= 0)
+            ::close(_fd);
+    }
+
+    [[nodiscard]] int fd() const { return _fd; }
+    [[nodiscard]] bool is_open() const { return _fd >= 0; }
+
+    void pwrite(const char *data, size_t size, off_t offset)
+    {
+        while (size)
+        {
+            const ssize_t n = ::pwrite(_fd, data, size, offset);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                throw VCDException{ format("Cannot write file '%s': %s", _filename.c_str(), std::strerror(errno)) };
+            data += n;
+            size -= size_t(n);
+            offset += n;
+        }
+    }
+    void truncate(off_t size)
+    {
+        if (::ftruncate(_fd, size) != 0)
+            throw VCDException{ format("Cannot resize file '%s': %s", _filename.c_str(), std::strerror(errno)) };
+    }
+    //! Wait for the data on the disk if the file is synchronous
+    void sync()
+    {
+        if (_sync)
+            sync_file(_fd, _filename);
+    }
+    void close(off_t size)
+    {
+        if (_fd < 0)
+            return;
+        truncate(size);
+        sync();
+        if (::close(std::exchange(_fd, -1)) != 0)
+            throw VCDException{ format("Cannot close file '%s': %s", _filename.c_str(), std::strerror(errno)) };
+    }
+
+private:
+    std::string _filename;
+    int  _fd{ -1 };
+    bool _sync{};  // of `sync()` and `close()`
+};
+
+#ifdef O_DIRECT
+// -----------------------------
+// Writes bypassing the page cache: the page-aligned buffers go straight to
+// the disk, only the partial block at the end is padded and written again
+class VCDDirectSink final : public VCDSink
+{
+public:
+    VCDDirectSink(const std::string &filename, bool sync) : _file(filename, O_DIRECT, sync) {}
+
+    [[nodiscard]] size_t alignment() const override { return BLOCK; }
+
+    void write(const char *data, size_t size) override
+    {
+        const size_t aligned = size & ~(BLOCK - 1);
+        if (aligned)
+            _file.pwrite(data, aligned, _offset);
+        _offset += off_t(aligned);
+        _tail = size - aligned;
+        if (_tail)
+        {
+            // O_DIRECT writes whole blocks, the file is truncated then
+            std::memcpy(_block.get(), data + aligned, _tail);
+            std::memset(_block.get() + _tail, 0, BLOCK - _tail);
+            _file.pwrite(_block.get(), BLOCK, _offset);
+        }
+    }
+    void flush() override
+    {
+        if (_tail)
+            _file.truncate(_offset + off_t(_tail));
+        // the size of file and the cache of disk
+        _file.sync();
+    }
+    void close() override
+    {
+        _file.close(_offset + off_t(_tail));
+    }
+
+private:
+    static constexpr size_t BLOCK = 4096;
+
+    struct Free
+    { void operator()(char *p) const { ::operator delete[](p, std::align_val_t(BLOCK)); } };
+
+    VCDFileDesc _file;
+    off_t  _offset{};  // of the partial block
+    size_t _tail{};    // written bytes of the partial block
+    std::unique_ptr<char[], Free> _block{ static_cast<char*>(::operator new[](BLOCK, std::align_val_t(BLOCK))) };
+};
+#endif // O_DIRECT
+
+// -----------------------------
+// Copies into a memory mapped window of the file, the file grows by windows
+// and the data are written back by the kernel without write calls
+class VCDMmapSink final : public VCDSink
+{
+public:
+    VCDMmapSink(const std::string &filename, bool sync) : _file(filename, 0, sync) {}
+    ~VCDMmapSink() override { _unmap(); }
+
+    void write(const char *data, size_t size) override
+    {
+        while (size)
+        {
+            if (_pos == WINDOW || !_window)
+                _map();
+            const size_t n = std::min(size, WINDOW - _pos);
+            std::memcpy(_window + _pos, data, n);
+            _pos += n;
+            data += n;
+            size -= n;
+        }
+    }
+    void flush() override
+    {
+        // the readers of file see no zeros of the unused window
+        if (_window)
+        {
+            _unmap();
+            _file.truncate(_offset + off_t(_pos));
+        }
+        // the unmapped pages stay in the page cache of file
+        _file.sync();
+    }
+    void close() override
+    {
+        _unmap();
+        _file.close(_offset + off_t(_pos));
+    }
+
+private:
+    static constexpr size_t WINDOW = 64u << 20;
+
+    void _map()
+    {
+        // the next window starts at the page of the current position
+        const size_t page = size_t(::sysconf(_SC_PAGESIZE));
+        const size_t skip = _pos - _pos % page;
+        _unmap();
+        _offset += off_t(skip);
+        _pos -= skip;
+        _file.truncate(_offset + off_t(WINDOW));
+        void *p = ::mmap(nullptr, WINDOW, PROT_READ | PROT_WRITE, MAP_SHARED, _file.fd(), _offset);
+        if (p == MAP_FAILED)
+            throw VCDException{ format("Cannot map file: %s", std::strerror(errno)) };
+        _window = static_cast<char*>(p);
+    }
+    void _unmap()
+    {
+        if (_window)
+            ::munmap(_window, WINDOW);
+        _window = nullptr;
+    }
+
+    VCDFileDesc _file;
+    char  *_window{};
+    off_t  _offset{};  // of the window in the file
+    size_t _pos{};     // in the window
+};
+#endif // VCDWRITER_POSIX_IO
+
+#ifdef VCDWRITER_WITH_ZLIB
+// -----------------------------
+// Streaming gzip compression (zlib deflate with gzip wrapper)
+class VCDGzipSink final : public VCDSink
+{
+public:
+    VCDGzipSink(const std::string &filename, int level, bool sync) : _file(filename, sync), _out(OUT_SIZE)
+    {
+        if (level < 0)
+            level = Z_DEFAULT_COMPRESSION;
+        // 16 + max window bits is gzip format
+        if (deflateInit2(&_zs, level, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            throw VCDException{ format("Cannot init gzip compression of '%s'", filename.c_str()) };
+        _init = true;
+    }
+    ~VCDGzipSink() override
+    {
+        if (_init)
+            deflateEnd(&_zs);
+    }
+
+    void write(const char *data, size_t size) override
+    {
+        while (size)
+        {
+            const auto n = uInt(std::min<size_t>(size, std::numeric_limits<uInt>::max()));
+            _zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+            _zs.avail_in = n;
+            _deflate(Z_NO_FLUSH);
+            data += n;
+            size -= n;
+        }
+    }
+    void flush() override
+    {
+        _deflate(Z_SYNC_FLUSH);
+        _file.flush();
+    }
+    void close() override
+    {
+        if (!_init)
+            return;
+        _deflate(Z_FINISH);
+        deflateEnd(&_zs);
+        _init = false;
+        _file.close();
+    }
+
+private:
+    static constexpr size_t OUT_SIZE = 1u << 18;
+
+    void _deflate(int mode)
+    {
+        int res = Z_OK;
+        do
+        {
+            _zs.next_out = reinterpret_cast<Bytef*>(_out.data());
+            _zs.avail_out = uInt(_out.size());
+            res = deflate(&_zs, mode);
+            if (res == Z_STREAM_ERROR)
+                throw VCDException{ "gzip compression failed" };
+            _file.write(_out.data(), _out.size() - _zs.avail_out);
+        } while (_zs.avail_out == 0 || (mode == Z_FINISH && res != Z_STREAM_END));
+    }
+
+    VCDFileSink _file;
+    z_stream _zs{};
+    bool _init{};
+    std::vector<char> _out;
+};
+#endif // VCDWRITER_WITH_ZLIB
+
+#ifdef VCDWRITER_WITH_ZSTD
+// -----------------------------
+// Streaming zstd compression
+class VCDZstdSink final : public VCDSink
+{
+public:
+    VCDZstdSink(const std::string &filename, int level, bool sync) : _file(filename, sync), _out(ZSTD_CStreamOutSize())
+    {
+        _ctx = ZSTD_createCCtx();
+        if (!_ctx)
+            throw VCDException{ format("Cannot init zstd compression of '%s'", filename.c_str()) };
+        if (level >= 0)
+            ZSTD_CCtx_setParameter(_ctx, ZSTD_c_compressionLevel, level);
+    }
+    ~VCDZstdSink() override
+    {
+        ZSTD_freeCCtx(_ctx);
+    }
+
+    void write(const char *data, size_t size) override
+    {
+        ZSTD_inBuffer in{ data, size, 0 };
+        while (in.pos < in.size)
+            _compress(in, ZSTD_e_continue);
+    }
+    void flush() override
+    {
+        ZSTD_inBuffer in{ nullptr, 0, 0 };
+        while (_compress(in, ZSTD_e_flush))
+        {}
+        _file.flush();
+    }
+    void close() override
+    {
+        if (_closed)
+            return;
+        ZSTD_inBuffer in{ nullptr, 0, 0 };
+        while (_compress(in, ZSTD_e_end))
+        {}
+        _closed = true;
+        _file.close();
+    }
+
+private:
+    //! Return the number of bytes left in internal buffers
+    size_t _compress(ZSTD_inBuffer &in, ZSTD_EndDirective mode)
+    {
+        ZSTD_outBuffer out{ _out.data(), _out.size(), 0 };
+        const size_t left = ZSTD_compressStream2(_ctx, &out, &in, mode);
+        if (ZSTD_isError(left))
+            throw VCDException{ format("zstd compression failed: %s", ZSTD_getErrorName(left)) };
+        _file.write(_out.data(), out.pos);
+        return left;
+    }
+
+    VCDFileSink _file;
+    ZSTD_CCtx *_ctx{};
+    bool _closed{};
+    std::vector<char> _out;
+};
+#endif // VCDWRITER_WITH_ZSTD
+
+// -----------------------------
+SinkPtr makeVCDSink(const std::string &filename, Compression compression, int compression_level, bool sync)
+{
+    if (compression == Compression::by_suffix)
+    {
+        if (ends_with(filename, ".gz"))
+            compression = Compression::gzip;
+        else if (ends_with(filename, ".zst"))
+            compression = Compression::zstd;
+        else
+            compression = Compression::none;
+    }
+
+    switch (compression)
+    {
+    case Compression::gzip:
+#ifdef VCDWRITER_WITH_ZLIB
+        return SinkPtr{ new VCDGzipSink(filename, compression_level, sync) };
+#else
+        (void)compression_level;
+        throw VCDTypeException{ "gzip compression is not supported by the build" };
+#endif
+    case Compression::zstd:
+#ifdef VCDWRITER_WITH_ZSTD
+        return SinkPtr{ new VCDZstdSink(filename, compression_level, sync) };
+#else
+        (void)compression_level;
+        throw VCDTypeException{ "zstd compression is not supported by the build" };
+#endif
+    default:
+        return SinkPtr{ new VCDFileSink(filename, sync) };
+    }
+}
+
+// -----------------------------
+SinkPtr makeVCDSink(const std::string &filename, const VCDOptions &options)
+{
+    Format fmt = options.format;
+    if (fmt == Format::by_suffix)
+        fmt = ends_with(filename, ".fst") ? Format::fst : Format::vcd;
+    if (fmt == Format::fst)
+        return makeFSTSink(filename);
+    if (options.file_io == FileIO::stream)
+        return makeVCDSink(filename, options.compression, options.compression_level, options.sync);
+
+    const bool compressed = (options.compression == Compression::by_suffix) ?
+                            (ends_with(filename, ".gz") || ends_with(filename, ".zst")) :
+                            (options.compression != Compression::none);
+    if (compressed)
+        throw VCDTypeException{ "Direct and mapped file output is not compressed" };
+#ifdef VCDWRITER_POSIX_IO
+    if (options.file_io == FileIO::mmap)
+        return SinkPtr{ new VCDMmapSink(filename, options.sync) };
+#ifdef O_DIRECT
+    return SinkPtr{ new VCDDirectSink(filename, options.sync) };
+#endif
+#endif
+    throw VCDTypeException{ "Direct or mapped file output is not supported by the platform" };
+}
+
+// -----------------------------
+}
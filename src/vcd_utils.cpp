@@ -58,6 +58,22 @@ bool validate_date([[maybe_unused]]const std::string &date)
     return true;
 }
 
+// -----------------------------
+// Bijective base-94: 94 codes of 1 character, 94^2 of 2 characters, ...
+std::string ident_code(unsigned id)
+{
+    constexpr unsigned FIRST = '!', BASE = '~' - '!' + 1;
+    std::string code;
+    while (true)
+    {
+        code.push_back(static_cast<char>(FIRST + id % BASE));
+        if (id < BASE)
+            break;
+        id = id / BASE - 1;
+    }
+    return code;
+}
+
 // -----------------------------
 void replace_new_lines(std::string &str, const std::string &sub)
 {
@@ -79,6 +95,12 @@ void replace_new_lines(std::string &str, const std::string &sub)
     }
 }
 
+// -----------------------------
+bool ends_with(const std::string &str, const std::string &suffix)
+{
+    return (str.size() >= suffix.size()) && (str.compare(str.size() - suffix.size(), suffix.size(), suffix) == 0);
+}
+
 // -----------------------------
 }
 
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <string_view>
+#include <vector>
+#include "vcd_writer.h"
+
+namespace vcd {
+// -----------------------------
+// Flight recorder: the value changes of the last time window are kept
+// in memory, the older ones are folded into the state at the window start.
+// The entries are the same records as of `VCDProducer`:
+//   [timestamp | id << 32, n_words | n_chars << 32, packed words..., chars...]
+class VCDWindow final
+{
+public:
+    VCDWindow(TimeStamp span, size_t max_bytes) : span(span), max_bytes(max_bytes) {}
+
+    const TimeStamp span;    // of the window, 0 is unlimited
+    const size_t max_bytes;  // of the entries, 0 is unlimited
+
+    std::deque<uint64_t> entries;
+    // state at the window start
+    TimeStamp start{};
+    bool dumping{};
+    std::vector<uint64_t> prevs;
+    std::vector<VarValue> strings;
+
+    void push(TimeStamp timestamp, VarId id, const uint64_t *words, uint32_t n_words, std::string_view chars)
+    {
+        entries.push_back(timestamp | (uint64_t(id) << 32));
+        entries.push_back(n_words | (uint64_t(chars.size()) << 32));
+        entries.insert(entries.end(), words, words + n_words);
+        for (size_t i = 0; i < chars.size(); i += sizeof(uint64_t))
+        {
+            uint64_t word = 0;
+            std::memcpy(&word, chars.data() + i, std::min(sizeof(uint64_t), chars.size() - i));
+            entries.push_back(word);
+        }
+    }
+
+    [[nodiscard]] size_t bytes() const { return entries.size() * sizeof(uint64_t); }
+
+    //! length in words of the entry at *pos*
+    [[nodiscard]] size_t length(size_t pos) const
+    {
+        const auto n_words = uint32_t(entries[pos + 1]);
+        const auto n_chars = uint32_t(entries[pos + 1] >> 32);
+        return 2 + n_words + (n_chars + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+    }
+
+    //! chars of the entry at *pos* into *chars*
+    void chars(size_t pos, VarValue &chars) const
+    {
+        const auto n_words = uint32_t(entries[pos + 1]);
+        chars.resize(uint32_t(entries[pos + 1] >> 32));
+        for (size_t i = 0; i < chars.size(); i += sizeof(uint64_t))
+        {
+            const uint64_t word = entries[pos + 2 + n_words + i / sizeof(uint64_t)];
+            std::memcpy(&chars[i], &word, std::min(sizeof(uint64_t), chars.size() - i));
+        }
+    }
+};
+
+// -----------------------------
+}
@@ -1,12 +1,27 @@
 #include <string>
 #include <cstdlib>
 #include <cstring>
+#include <cstdio>
 #include <cassert>
+#include <cmath>
+#include <cerrno>
 #include <algorithm>
 #include <array>
-#include <list>
+#include <atomic>
+#include <functional>
+#include <limits>
+#include <mutex>
+#include <numeric>
+#include <queue>
+#include <thread>
 #include <utility>
 #include "vcd_writer.h"
+#include "vcd_packed.h"
+#include "vcd_output.h"
+#include "vcd_arena.h"
+#include "vcd_scopes.h"
+#include "vcd_window.h"
+#include "vcd_filter.h"
 
 
 // -----------------------------
@@ -67,23 +82,6 @@ HeadPtr makeVCDHeader(TimeScale timescale_quan, TimeScaleUnit timescale_unit, co
 // -----------------------------
 void VCDHeaderDeleter::operator()(VCDHeader *p) { delete p; }
 
-// -----------------------------
-struct VCDScope final
-{
-    std::string name;
-    ScopeType   type;
-    std::list<VarPtr> vars;
-
-    VCDScope(std::string_view name, ScopeType type) : 
-        name(name), type(type) {}
-};
-
-// -----------------------------
-bool ScopePtrHash::operator()(const ScopePtr &l, const ScopePtr &r) const
-{
-    return (l->name < r->name);
-}
-
 // -----------------------------
 // VCD variable details needed to call :meth:`VCDWriter.change()`.
 class VCDVariable
@@ -96,17 +94,24 @@ private:
     VCDVariable(VCDVariable&&) = default;
 
 protected:
-    VCDVariable(std::string name, VariableType type, unsigned size, ScopePtr scope, unsigned next_var_id);
+    enum class Kind : char { scalar, vector, real, string };
+    VCDVariable(std::string_view name, VariableType type, unsigned size, const VCDScope *scope, unsigned next_var_id, Kind kind);
 
 public:
     VCDVariable(const VCDVariable&) = delete;
     VCDVariable& operator=(const VCDVariable&) = delete;
 
-    unsigned    _ident;  // internal ID used in VCD output stream
+    // the vars live in the writer's arena and are never destroyed,
+    // so the members must not own memory
+    unsigned    _ident;  // internal ID (dense index of the variable)
+    std::array<char, 6> _code;  // identifier code used in VCD output stream
+    uint8_t _code_size;
     VariableType _type;  // VCD variable type, one of `VariableTypes`
-    std::string  _name;  // human-readable name
+    Kind         _kind;  // class of the variable (without virtual calls)
+    std::string_view _name;  // human-readable name (zero terminated, in the arena)
     unsigned     _size;  // size of variable, in bits
-    ScopePtr    _scope;  // pointer to scope string
+    const VCDScope *_scope;  // scope of the variable
+    VCDVariable    *_next{};  // the next var of the scope
 
     //! string representation of variable types
     static const std::array<std::string, 20> VAR_TYPES;
@@ -114,14 +119,29 @@ public:
 public:
     virtual ~VCDVariable() = default;
 
+    //! identifier code used in VCD output stream
+    [[nodiscard]] std::string_view code() const { return { _code.data(), _code_size }; }
+    void set_code(unsigned id);
     //! string representation of variable declartion in VCD
     [[nodiscard]] std::string declartion() const;
+    //! number of 64-bit words of the packed value
+    [[nodiscard]] virtual unsigned packed_words() const { return packed::words(_size); }
+    //! validate the *value* and pack it into `packed_words()`
+    virtual void pack(const VarValue &value, uint64_t *packed) const = 0;
+    //! pack the integer value (*words[0]* holds the least significant bits)
+    virtual void pack(const uint64_t *words, size_t n_words, uint64_t *packed) const = 0;
+    //! pack the signed integer value as its two's complement of `_size` bits
+    virtual void pack(int64_t value, uint64_t *packed) const;
     //! string representation of value change record in VCD
-    [[nodiscard]] virtual VarValue change_record(const VarValue &value) const = 0;
+    virtual void change_record(const uint64_t *packed, VarValue &record) const = 0;
+    //! value change record of the unknown state (`nullptr` if there is no such a state)
+    [[nodiscard]] virtual const char* undef_record() const { return "x"; }
+
+protected:
+    //! check the integer value has no bits set above *bits*
+    void check_fits(const uint64_t *words, size_t n_words, unsigned bits) const;
 
     friend class VCDWriter;
-    friend struct VarPtrHash;
-    friend struct VarPtrEqual;
 };
 
 // -----------------------------
@@ -131,16 +151,21 @@ const std::array<std::string, 20> VCDVariable::VAR_TYPES = {
 };
 
 // -----------------------------
-size_t VarPtrHash::operator()(const VarPtr &p) const
+void VCDScope::add_var(VCDVariable *var)
 {
-    std::hash<std::string> h;
-    return (h(p->_name) ^ (h(p->_scope->name) << 1));
+    if (last_var)
+        last_var->_next = var;
+    else
+        vars = var;
+    last_var = var;
+    for (VCDScope *s = this; s && !s->has_vars; s = s->parent)
+        s->has_vars = true;
 }
 
 // -----------------------------
-bool VarPtrEqual::operator()(const VarPtr &a, const VarPtr &b) const
+size_t VarKeyHash::operator()(const VarKey &k) const
 {
-    return (a->_name == b->_name) && (a->_scope->name == b->_scope->name);
+    return (std::hash<std::string_view>{}(k.second) ^ (std::hash<const void*>{}(k.first) << 1));
 }
 
 // -----------------------------
@@ -148,32 +173,50 @@ bool VarPtrEqual::operator()(const VarPtr &a, const VarPtr &b) const
 // `VCDValues`. An empty *value* is the same as `VCDValues::UNDEF`
 struct VCDScalarVariable : public VCDVariable
 {
-    VCDScalarVariable(const std::string &name, VariableType type, unsigned size, ScopePtr scope, unsigned next_var_id) :
-        VCDVariable(name, type, size, std::move(scope), next_var_id)
+    VCDScalarVariable(std::string_view name, VariableType type, unsigned size, const VCDScope *scope, unsigned next_var_id) :
+        VCDVariable(name, type, size, scope, next_var_id, Kind::scalar)
     {}
-    [[nodiscard]] VarValue change_record(const VarValue &value) const override
+    void pack(const VarValue &value, uint64_t *packed) const override
     {
-        char c = (value.size())? char(tolower(value[0])) : char(VCDValues::UNDEF);
-        if (value.size() != 1 || (c != VCDValues::ONE   && c != VCDValues::ZERO
-                               && c != VCDValues::UNDEF && c != VCDValues::HIGHV))
-            throw VCDTypeException{ format("Invalid scalar value '%c'", c) };
-        return {c};
+        const int code = (value.size() == 1) ? packed::code(value[0]) : -1;
+        if (code < 0)
+            throw VCDTypeException{ format("Invalid scalar value '%s'", value.c_str()) };
+        packed[0] = uint64_t(code);
     }
+    void pack(const uint64_t *words, size_t n_words, uint64_t *packed) const override
+    {
+        check_fits(words, n_words, 1u);
+        packed[0] = (n_words) ? words[0] : 0u;
+    }
+    void change_record(const uint64_t *packed, VarValue &record) const override
+    { record.assign(1u, packed::state(packed, 0)); }
 };
 
 // -----------------------------
 // String variable as known by GTKWave. Any `string` (character-chain) 
 // can be displayed as a change.This type is only supported by GTKWave.
+// The packed value is an index of the string kept aside by `VCDWriter`.
 struct VCDStringVariable : public VCDVariable
 {
-    VCDStringVariable(const std::string &name, VariableType type, unsigned size, ScopePtr scope, unsigned next_var_id) :
-        VCDVariable(name, type, size, std::move(scope), next_var_id)
+    VCDStringVariable(std::string_view name, VariableType type, unsigned size, const VCDScope *scope, unsigned next_var_id) :
+        VCDVariable(name, type, size, scope, next_var_id, Kind::string)
     {}
-    [[nodiscard]]VarValue change_record(const VarValue &value) const override
+    [[nodiscard]] unsigned packed_words() const override { return 1u; }
+    void pack(const VarValue &value, uint64_t*) const override
     {
         if (value.find(' ') != std::string::npos)
             throw VCDTypeException{ format("Invalid string value '%s'", value.c_str()) };
-        return format("s%s ", value.c_str());
+    }
+    void pack(const uint64_t*, size_t, uint64_t*) const override
+    { throw VCDTypeException{ format("Invalid integer value of string var '%s'", _name.data()) }; }
+    void change_record(const uint64_t*, VarValue&) const override
+    { throw VCDTypeException{ format("String var '%s' has no packed value", _name.data()) }; }
+
+    static void change_record(const VarValue &value, VarValue &record)
+    {
+        record.assign(1u, 's');
+        record.append(value);
+        record.push_back(' ');
     }
 };
 
@@ -182,10 +225,39 @@ struct VCDStringVariable : public VCDVariable
 // be numeric and can't be `VCDValues::UNDEF` or `VCDValues::HIGHV` states
 struct VCDRealVariable : public VCDVariable
 {
-    VCDRealVariable(const std::string &name, VariableType type, unsigned size, ScopePtr scope, unsigned next_var_id) :
-        VCDVariable(name, type, size, std::move(scope), next_var_id) {}
-    [[nodiscard]]std::string change_record(const VarValue &value) const override
-    { return format("r%.16g ", stod(value)); }
+    VCDRealVariable(std::string_view name, VariableType type, unsigned size, const VCDScope *scope, unsigned next_var_id) :
+        VCDVariable(name, type, size, scope, next_var_id, Kind::real) {}
+    [[nodiscard]] unsigned packed_words() const override { return 1u; }
+    void pack(const VarValue &value, uint64_t *packed) const override
+    {
+        double real = 0.;
+        try
+        { real = stod(value); }
+        catch (const std::logic_error&)  // invalid or out of range
+        { throw VCDTypeException{ format("Invalid real value '%s'", value.c_str()) }; }
+        std::memcpy(packed, &real, sizeof(real));
+    }
+    void pack(const uint64_t *words, size_t n_words, uint64_t *packed) const override
+    {
+        check_fits(words, n_words, 64u);
+        const double real = double(n_words ? words[0] : 0u);
+        std::memcpy(packed, &real, sizeof(real));
+    }
+    void pack(int64_t value, uint64_t *packed) const override
+    {
+        const double real = double(value);
+        std::memcpy(packed, &real, sizeof(real));
+    }
+    void change_record(const uint64_t *packed, VarValue &record) const override
+    {
+        double real = 0.;
+        std::memcpy(&real, packed, sizeof(real));
+        std::array<char, 32> buf{};
+        const int n = std::snprintf(buf.data(), buf.size(), "r%.16g ", real);
+        record.assign(buf.data(), size_t(n));
+    }
+    // real variables cannot have "z" or "x" state
+    [[nodiscard]] const char* undef_record() const override { return nullptr; }
 };
 
 // -----------------------------
@@ -193,403 +265,1994 @@ struct VCDRealVariable : public VCDVariable
 // variable types, including integer, register, wire, etc.
 struct VCDVectorVariable : public VCDVariable
 {
-    VCDVectorVariable(const std::string &name, VariableType type, unsigned size, ScopePtr scope, unsigned next_var_id) :
-        VCDVariable(name, type, size, std::move(scope), next_var_id) {}
-    [[nodiscard]]std::string change_record(const VarValue &value) const override;
+    VCDVectorVariable(std::string_view name, VariableType type, unsigned size, const VCDScope *scope, unsigned next_var_id) :
+        VCDVariable(name, type, size, scope, next_var_id, Kind::vector) {}
+    void pack(const VarValue &value, uint64_t *packed) const override;
+    void pack(const uint64_t *words, size_t n_words, uint64_t *packed) const override;
+    void pack(int64_t value, uint64_t *packed) const override;
+    void change_record(const uint64_t *packed, VarValue &record) const override;
+    [[nodiscard]] const char* undef_record() const override { return "bx "; }
 };
 
 // -----------------------------
-struct VarSearch final
+VCDWriter::VCDWriter(std::string filename, HeadPtr &header, unsigned init_timestamp) :
+    VCDWriter(std::move(filename), header, VCDOptions{}, init_timestamp)
+{}
+
+// -----------------------------
+// File of the segment *part* (or the manifest): "dir/name.vcd.gz" -> "dir/name.<part>.vcd.gz"
+static std::string segment_name(const std::string &filename, const std::string &part, bool manifest = false)
 {
-    VCDScope vcd_scope = { "", ScopeType::module };
-    ScopePtr ptr_scope = { &vcd_scope, [](VCDScope*) {} };
-    VCDScalarVariable vcd_var = { "", VCDWriter::var_def_type, 0, ptr_scope, 0 };
-    VarPtr ptr_var = { &vcd_var, [](VCDScalarVariable*) {} };
+    const size_t base = filename.find_last_of("/\\");
+    size_t dot = filename.find('.', (base == std::string::npos) ? 0 : base + 1);
+    if (dot == std::string::npos)
+        dot = filename.size();
+    return filename.substr(0, dot) + "." + part + (manifest ? std::string{} : filename.substr(dot));
+}
 
-    VarSearch() = delete;
-    VarSearch(ScopeType scope_def_type) : vcd_scope("", scope_def_type) {}
-};
+// -----------------------------
+static std::string segment_name(const std::string &filename, unsigned segment)
+{
+    std::array<char, 16> part{};
+    std::snprintf(part.data(), part.size(), "%04u", segment);
+    return segment_name(filename, part.data());
+}
 
 // -----------------------------
-VCDWriter::VCDWriter(std::string filename, HeadPtr &header, unsigned init_timestamp) :
+VCDWriter::VCDWriter(std::string filename, HeadPtr &header, const VCDOptions &options, unsigned init_timestamp) :
+    VCDWriter(makeVCDSink((options.segment_bytes || options.segment_span) ? segment_name(filename, 0u) : filename, options),
+              header, options, init_timestamp, filename)
+{}
+
+// -----------------------------
+VCDWriter::VCDWriter(SinkPtr sink, HeadPtr &header, const VCDOptions &options, unsigned init_timestamp) :
+    VCDWriter(std::move(sink), header, options, init_timestamp, std::string{})
+{}
+
+// -----------------------------
+VCDWriter::VCDWriter(SinkPtr sink, HeadPtr &header, const VCDOptions &options, unsigned init_timestamp, std::string filename) :
     _timestamp(init_timestamp),
     _header((header) ? std::move(header) : makeVCDHeader()),
     _scope_sep("."),
     _scope_def_type(ScopeType::module),
     _filename(std::move(filename)),
+    _options(options),
+    _ofile(new VCDOutput(std::move(sink), options)),
+    _arena(new VCDArena()),
+    _scopes(new VCDScopeTree(*_arena)),
     _dumping(true),
-    _registering(true),
-    _search(std::make_shared<VarSearch>(_scope_def_type)),
-    _ofile(fmt::output_file(_filename))
+    _registering(true)
 {
     if (!_header)
         throw VCDTypeException{ "Invalid pointer to header" };
-    
+    if (options.window || options.window_bytes)
+        _window.reset(new VCDWindow(options.window, options.window_bytes));
+    if (!options.include_vars.empty() || !options.exclude_vars.empty())
+        _filter.reset(new VCDFilter(options.include_vars, options.exclude_vars));
+    if (_segmented() && _filename.empty())
+        throw VCDTypeException{ "Rotation of output needs a file name" };
+    if (_segmented() && _window)
+        throw VCDTypeException{ "Rotation of output with flight recorder window" };
+    if (options.index_bytes || options.index_span)
+    {
+        if (_filename.empty() || _segmented() || _window)
+            throw VCDTypeException{ "Index of output needs a single file" };
+        const bool compressed = (options.compression == Compression::by_suffix) ?
+                                (ends_with(_filename, ".gz") || ends_with(_filename, ".zst") || ends_with(_filename, ".fst")) :
+                                (options.compression != Compression::none || options.format == Format::fst);
+        if (compressed)
+            throw VCDTypeException{ "Index of compressed output" };
+        // the offsets of index may point into a dropped buffer
+        if (options.async && options.backpressure == Backpressure::drop)
+            throw VCDTypeException{ "Index of output with dropped buffers" };
+        _index = makeVCDSink(_filename + ".idx", Compression::none, -1, options.sync);
+        _index->write("vcd-index 1\n", 12u);
+    }
+    if (_segmented())
+    {
+        // the manifest is empty until a segment is closed
+        const std::string manifest = segment_name(_filename, "manifest", true);
+        std::FILE *file = std::fopen(manifest.c_str(), "wb");
+        if (!file)
+            throw VCDException{ format("Cannot open file '%s': %s", manifest.c_str(), std::strerror(errno)) };
+        std::fclose(file);
+        _segment_start = _timestamp;
+    }
 }
 
 // -----------------------------
-VarPtr VCDWriter::register_var(const std::string &scope, const std::string &name, VariableType type,
-                               unsigned size, const VarValue &init, bool duplicate_names_check)
-{
-    VarPtr pvar;
-    if (_closed)
-        throw VCDPhaseException{ "Cannot register after close()" };
-    if (!_registering)
-        throw VCDPhaseException{ format("Cannot register new var '%s', registering finished", name.c_str()) };
+void VCDOutputDeleter::operator()(VCDOutput *p) { delete p; }
 
-    if (scope.size() == 0 || name.size() == 0)
-        throw VCDTypeException{ format("Empty scope '%s' or name '%s'", scope.c_str(), name.c_str()) };
+// -----------------------------
+void VCDArenaDeleter::operator()(VCDArena *p) { delete p; }
 
-    _search->vcd_scope.name = scope;
-    auto cur_scope = _scopes.find(_search->ptr_scope);
-    if (cur_scope == _scopes.end())
-    {
-        auto res = _scopes.insert(std::make_shared<VCDScope>(scope, _scope_def_type));
-        if (!res.second)
-            throw VCDPhaseException{ format("Cannot insert scope '%s'", scope.c_str()) };
-        cur_scope = res.first;
-    }
+// -----------------------------
+void VCDWindowDeleter::operator()(VCDWindow *p) { delete p; }
 
-    auto sz = [&size](unsigned def) { return (size ? size : def);  };
+// -----------------------------
+void VCDFilterDeleter::operator()(VCDFilter *p) { delete p; }
 
-    VarValue init_value(init);
-    switch (type)
+// -----------------------------
+void VCDWriter::dump_on(TimeStamp timestamp)
+{
+    if (_window)
     {
-        case VariableType::integer:   
-        case VariableType::realtime:
-            if (sz(64) == 1)
-                pvar = VarPtr(new VCDScalarVariable(name, type, 1, *cur_scope, _next_var_id));
-            else
-                pvar = VarPtr(new VCDVectorVariable(name, type, sz(64), *cur_scope, _next_var_id));
-            break;
+        if (!_registering)
+            _window_dump_mark(DUMP_ON, timestamp);
+        _dumping = true;
+        return;
+    }
+    if (!_dumping && !_registering && _vars_list.size())
+        _ofile->timestamp(timestamp);
+    _dump_values("$dumpon");
+    _dumping = true;
+}
 
-        case VariableType::real:
-            pvar = VarPtr(new VCDRealVariable(name, type, sz(64), *cur_scope, _next_var_id));
-            if (init_value.size() == 1 && init_value[0] == VCDValues::UNDEF)
-                init_value = "0.0";
-            break;
+// -----------------------------
+void VCDWriter::_check_dump_vars(TimeStamp timestamp)
+{
+    if (_closed)
+        throw VCDPhaseException{ "Cannot change dumping of vars after close()" };
+    if (_window)
+        throw VCDTypeException{ "Dumping of vars with flight recorder window" };
+    if (timestamp < _timestamp)
+        throw VCDPhaseException{ format("Out of order dumping of vars at '%u'", timestamp) };
+    _set_timestamp(timestamp);
+    _vars_modes.resize(_vars_list.size());
+}
 
-        case VariableType::string:
-            pvar = VarPtr(new VCDStringVariable(name, type, sz(1), *cur_scope, _next_var_id));
-            break;
+// -----------------------------
+void VCDWriter::_dump_var(VarId id, bool on, TimeStamp timestamp)
+{
+    _check_dump_vars(timestamp);
+    if (!_filtered(id))
+        _set_var_dump(id, on);
+}
 
-        case VariableType::event:
-            pvar = VarPtr(new VCDScalarVariable(name, type, 1, *cur_scope, _next_var_id));
-            break;
+// -----------------------------
+std::vector<VarId> VCDWriter::_scope_vars(const std::string &scope) const
+{
+    const VCDScope *s = _scopes->find(scope, _scope_sep);
+    if (!s || !s->has_vars)
+        throw VCDPhaseException{ format("Such scope '%s' does not exist", scope.c_str()) };
+    // only the subtree is walked
+    std::vector<VarId> ids;
+    std::vector<const VCDScope*> stack{ s };
+    while (!stack.empty())
+    {
+        const VCDScope *cur = stack.back();
+        stack.pop_back();
+        for (const VCDVariable *var = cur->vars; var; var = var->_next)
+            ids.push_back(var->_ident);
+        for (const VCDScope *child = cur->children; child; child = child->next)
+            if (child->has_vars)
+                stack.push_back(child);
+    }
+    return ids;
+}
 
-        default:
-            if (!size)
-                throw VCDTypeException{ format("Must supply size for type '%s' of var '%s'",
-                                               VCDVariable::VAR_TYPES[(int)type].c_str(), name.c_str()) };
+// -----------------------------
+void VCDWriter::_dump_scope(const std::string &scope, bool on, TimeStamp timestamp)
+{
+    const std::vector<VarId> ids = _scope_vars(scope);
+    _check_dump_vars(timestamp);
+    for (VarId id : ids)
+        _set_var_dump(id, on);
+}
 
-            pvar = VarPtr(new VCDVectorVariable(name, type, size, *cur_scope, _next_var_id));
-            if (init_value.size() == 1 && init_value[0] == VCDValues::UNDEF)
-                init_value = std::string(size, VCDValues::UNDEF);
-            break;
-    }     
-    if (type != VariableType::event)
-        _change(pvar, _timestamp, init_value, true);
-    
-    if (duplicate_names_check && _vars.find(pvar) != _vars.end())
-        throw VCDTypeException{ format("Duplicate var '%s' in scope '%s'", name.c_str(), scope.c_str()) };
+// -----------------------------
+void VCDWriter::_set_var_dump(VarId id, bool on)
+{
+    if (bool(_vars_modes[id] & VAR_OFF) != on)
+        return;
+    _vars_modes[id] ^= VAR_OFF;
 
-    _vars.insert(pvar);
-    (**cur_scope).vars.push_back(pvar);
-    // Only alter state after change_func() succeeds
-    _next_var_id++;
-    return pvar;
+    const VCDVariable &var = *_vars_list[id];
+    // otherwise it is written by `$dumpvars`, events have no value
+    if (_registering || !_dumping || var._type == VariableType::event)
+        return;
+    const StatsMark mark = _stats_mark();
+    if (on)
+    {
+        _value_record(id, _record);
+        _ofile->record(_record, var.code());
+    }
+    else if (const char *undef = var.undef_record())
+        _ofile->record(undef, var.code());
+    _stats_add(_stats.dump_bytes, _stats.format_ns, mark);
 }
 
 // -----------------------------
-bool VCDWriter::_change(VarPtr var, TimeStamp timestamp, const VarValue &value, bool reg)
+void VCDWriter::set_sampling(VarPtr var, const Sampling &sampling)
 {
-    if (timestamp < _timestamp)
-        throw VCDPhaseException{ format("Out of order value change var '%s'", var->_name.c_str()) };
-    else if (_closed)
-        throw VCDPhaseException{ "Cannot change value after close()" };
-
-    if (!var)
-        throw VCDTypeException{ "Invalid VCDVariable" };
+    const VarId id = var_id(var);
+    if (sampling.threshold != 0. && var->_type != VariableType::real)
+        throw VCDTypeException{ format("Threshold of sampling of not real var '%s'", var->_name.data()) };
+    if (!_filtered(id))
+        _set_sampling(id, sampling);
+}
 
-    if (timestamp > _timestamp)
+// -----------------------------
+void VCDWriter::set_sampling(const std::string &scope, const Sampling &sampling)
+{
+    for (VarId id : _scope_vars(scope))
     {
-        if (_registering)
-            _finalize_registration();
-        if (_dumping)
-            _ofile.print("#{:d}\n", timestamp);
-        _timestamp = timestamp;
+        Sampling s = sampling;
+        if (_vars_list[id]->_type != VariableType::real)
+            s.threshold = 0.;
+        _set_sampling(id, s);
     }
+}
 
-    VarValue change_value = var->change_record(value);
-    // if value changed
-    auto it = _vars_prevs.find(var);
-    if (it != _vars_prevs.end())
+// -----------------------------
+void VCDWriter::_set_sampling(VarId id, const Sampling &sampling)
+{
+    if (_closed)
+        throw VCDPhaseException{ "Cannot set sampling after close()" };
+    if (sampling.threshold < 0.)
+        throw VCDTypeException{ format("Negative threshold of sampling '%g'", sampling.threshold) };
+    _vars_modes.resize(_vars_list.size());
+    uint32_t &mode = _vars_modes[id];
+    // the slot of var is kept by the reset (an empty policy passes all the changes)
+    // and reused by the next setting
+    if (mode >> 1)
+        _samplers[(mode >> 1) - 1] = Sampler{ sampling };
+    else if (sampling.period || sampling.every || sampling.threshold != 0.)
     {
-        if (it->second == change_value)
-            return false;
-        it->second = change_value;
+        _samplers.push_back(Sampler{ sampling });
+        mode |= uint32_t(_samplers.size()) << 1;
     }
-    else
+}
+
+// -----------------------------
+bool VCDWriter::_sample(uint32_t sampler, const uint64_t *value)
+{
+    Sampler &s = _samplers[sampler];
+    // the cheap checks first, the suppressed change costs a counter
+    if (s.policy.every && ++s.changes < s.policy.every)
+        return false;
+    if (s.policy.period && s.written && _timestamp - s.last < s.policy.period)
+        return false;
+    if (s.policy.threshold != 0.)
     {
-        if (!reg)
-            throw VCDTypeException{ format("VCDVariable '%s' do not registered", var->_name.c_str()) };
-        else
-            _vars_prevs.emplace(var, change_value);
+        double real = 0.;
+        std::memcpy(&real, value, sizeof(real));
+        if (s.written && std::abs(real - s.last_real) <= s.policy.threshold)
+            return false;
+        s.last_real = real;
     }
-    // dump it into file
-    if (_dumping && !_registering)
-        _ofile.print("{:s}{:x}\n", change_value.c_str(), var->_ident);
+    s.changes = 0;
+    s.written = true;
+    s.last = _timestamp;
     return true;
 }
 
 // -----------------------------
-bool VCDWriter::change(const std::string &scope, const std::string &name, TimeStamp timestamp, const VarValue &value)
+void VCDWriter::flush(const TimeStamp *timestamp)
 {
-    return _change(var(scope, name), timestamp, value, false);
+    if (_closed)
+        throw VCDPhaseException{ "Cannot flush() after close()" };
+    if (_registering)
+        _finalize_registration();
+    else
+        _resync();
+    if (timestamp != nullptr && *timestamp > _timestamp && !_window)
+        _ofile->timestamp(*timestamp);
+    _ofile->flush();
+    if (_index)
+        _index->flush();
 }
 
 // -----------------------------
-VarPtr VCDWriter::var(const std::string &scope, const std::string &name) const
+void VCDWriter::close(const TimeStamp *timestamp)
 {
-    // The _search is a speed optimisation
-    _search->vcd_scope.name = scope;
-    _search->vcd_var._name = name;
-    auto it_var = _vars.find(_search->ptr_var);
-    if (it_var == _vars.end())
-        throw VCDPhaseException{ format("The var '%s' in scope '%s' does not exist", name.c_str(), scope.c_str()) };
-    return *it_var;
+    if (_closed)
+        return;
+    if (!_producers.empty())
+        commit(std::numeric_limits<TimeStamp>::max());
+    flush(timestamp);
+    if (_window)
+        _dump_window(SinkPtr{ new VCDOutputSink(*_ofile) }, timestamp);
+    if (_segmented())
+    {
+        // the last segment is listed like the others
+        if (timestamp && *timestamp > _timestamp)
+            _timestamp = *timestamp;
+        _close_segment();
+    }
+    _ofile->close();
+    if (_index)
+        _index->close();
+    _closed = true;
+    if (!_options.stats_file.empty())
+        _write_stats();
 }
 
 // -----------------------------
-void VCDWriter::set_scope_type(std::string &scope, ScopeType scope_type)
+void VCDWriter::dump_window(const std::string &filename)
 {
-    // The _search is a speed optimisation
-    _search->vcd_scope.name = scope;
-    auto it = _scopes.find(_search->ptr_scope);
-    if (it == _scopes.end())
-        throw VCDPhaseException{ format("Such scope '%s' does not exist", scope.c_str()) };
-    (**it).type = scope_type;
+    dump_window(makeVCDSink(filename));
 }
 
-
 // -----------------------------
-void VCDWriter::_dump_off(TimeStamp timestamp)
+void VCDWriter::dump_window(SinkPtr sink)
 {
-    _ofile.print("#{:d}\n", timestamp);
-    _ofile.print("$dumpoff\n");
-    for (const auto &p : _vars_prevs)
-    {
-        const auto ident = p.first->_ident;
-        const char *value = p.second.c_str();
+    if (!_window)
+        throw VCDPhaseException{ "Cannot dump_window() without flight recorder window" };
+    if (_closed)
+        throw VCDPhaseException{ "Cannot dump_window() after close()" };
+    _dump_window(std::move(sink), nullptr);
+}
 
-        if (value[0] == 'r')
-        {} // real variables cannot have "z" or "x" state
-        else if (value[0] == 'b')
-        { _ofile.print("bx {:x}\n", ident); }
-        //else if (value[0] == 's')
-        //{ _ofile.print("sx %x\n", ident); }
-        else
-        { _ofile.print("x{:x}\n", ident); }
-    }
-    _ofile.print("$end\n");
+// -----------------------------
+void VCDWriter::_window_change(VarId id, const uint64_t *value)
+{
+    const VCDVariable &var = *_vars_list[id];
+    if (var._type == VariableType::string)
+        _window->push(_timestamp, id, nullptr, 0u, _strings_prevs[_vars_prevs[_vars_prevs_offs[id]]]);
+    else
+        _window->push(_timestamp, id, value, uint32_t(_vars_prevs_offs[id + 1] - _vars_prevs_offs[id]), {});
+    _window_evict();
 }
 
 // -----------------------------
-void VCDWriter::_dump_values(const char *keyword)
+void VCDWriter::_window_dump_mark(VarId mark, TimeStamp timestamp)
 {
-    _ofile.print("{:s}\n", keyword);
-    if(!_dumping)
-        return;
-    // TODO : events should be excluded
-    for (const auto &p : _vars_prevs)
-    {
-        const auto ident = p.first->_ident;
-        const char *value = p.second.c_str();
-        _ofile.print("{:s}{:x}\n", value, ident);
-    }
-    _ofile.print("$end\n");
+    _window->push(timestamp, mark, nullptr, 0u, {});
+    _window_evict();
 }
 
 // -----------------------------
-void VCDWriter::_scope_declaration(const std::string &scope, ScopeType type, size_t sub_beg, size_t sub_end)
+void VCDWriter::_window_evict()
 {
-    const std::array<std::string, 5> SCOPE_TYPES = { "begin", "fork", "function", "module", "task" };
+    VCDWindow &w = *_window;
+    const bool by_time = w.span && _timestamp > w.span;
+    const TimeStamp start = by_time ? _timestamp - w.span : 0u;
+    while (!w.entries.empty())
+    {
+        const auto ts = TimeStamp(w.entries[0]);
+        const bool old = by_time && ts < start;
+        if (!old && !(w.max_bytes && w.bytes() > w.max_bytes))
+            break;
 
-    auto scope_name = scope.substr(sub_beg, sub_end - sub_beg);
-    auto scope_type = SCOPE_TYPES[int(type)].c_str();
-    _ofile.print("$scope {:s} {:s} $end\n", scope_type, scope_name.c_str());
+        // fold the oldest change into the state at the window start
+        const auto id = VarId(w.entries[0] >> 32);
+        if (id == DUMP_OFF || id == DUMP_ON)
+            w.dumping = (id == DUMP_ON);
+        else if (_vars_list[id]->_type == VariableType::string)
+            w.chars(0, w.strings[w.prevs[_vars_prevs_offs[id]]]);
+        else if (_vars_list[id]->_type != VariableType::event)
+            std::copy_n(w.entries.begin() + 2, _vars_prevs_offs[id + 1] - _vars_prevs_offs[id],
+                        w.prevs.begin() + std::ptrdiff_t(_vars_prevs_offs[id]));
+        w.start = std::max(w.start, ts);
+        w.entries.erase(w.entries.begin(), w.entries.begin() + std::ptrdiff_t(w.length(0)));
+    }
+    if (by_time)
+        w.start = std::max(w.start, start);
 }
 
 // -----------------------------
-void VCDWriter::_write_header()
+void VCDWriter::_dump_window(SinkPtr sink, const TimeStamp *timestamp)
 {
-    for (int i = 0; i < VCDHeader::KW_COUNT_; ++i)
+    if (_registering)
+        _finalize_registration();
+    const VCDWindow &w = *_window;
+
+    // the writer of the same vars with the state at the window start
+    HeadPtr header = makeVCDHeader(_header->timescale_quan, _header->timescale_unit,
+                                   _header->kw_values[VCDHeader::KW_DATE],
+                                   _header->kw_values[VCDHeader::KW_COMMENT],
+                                   _header->kw_values[VCDHeader::KW_VERSION]);
+    VCDWriter writer(std::move(sink), header, VCDOptions{}, w.start);
+    writer._scope_sep = _scope_sep;
+
+    std::unordered_map<const VCDScope*, std::string> paths;
+    std::function<const std::string&(const VCDScope*)> path = [&](const VCDScope *s) -> const std::string&
     {
-        auto kwname = VCDHeader::kw_names[i];
-        auto kwvalue = _header->kw_values[i];
-        if (kwvalue.empty())
-            continue;
-        replace_new_lines(kwvalue, "\n\t");
-        _ofile.print("{:s} {:s} $end\n", kwname, kwvalue.c_str());
+        auto it = paths.find(s);
+        if (it == paths.end())
+        {
+            std::string p = (s->parent->parent) ? path(s->parent) + _scope_sep : std::string{};
+            it = paths.emplace(s, p.append(s->name)).first;
+        }
+        return it->second;
+    };
+    std::vector<VarSpec> specs(_vars_list.size());
+    for (VarId id = 0; id < _vars_list.size(); ++id)
+    {
+        const VCDVariable &var = *_vars_list[id];
+        specs[id] = { path(var._scope), std::string(var._name), var._type, var._size };
     }
+    writer.register_vars(specs);
+    for (const auto &[scope, p] : paths)
+        writer._scopes->find(p, _scope_sep)->type = scope->type;
+    for (VarId id = 0; id < _vars_list.size(); ++id)
+    {
+        writer._vars_list[id]->_code = _vars_list[id]->_code;
+        writer._vars_list[id]->_code_size = _vars_list[id]->_code_size;
+    }
+    writer._vars_prevs = w.prevs;
+    writer._strings_prevs = w.strings;
+    writer._dumping = w.dumping;
 
-    // nested scope
-    size_t n = 0, n_prev = 0;
-    std::string scope_prev = "";
-    for (auto& s : _scopes) // sorted
+    // the kept changes in the same order
+    for (size_t pos = 0; pos < w.entries.size(); pos += w.length(pos))
     {
-        const std::string &scope = s->name;
-        // scope print close
-        if (scope_prev.size())
+        const auto ts = TimeStamp(w.entries[pos]);
+        const auto id = VarId(w.entries[pos] >> 32);
+        if (id == DUMP_OFF)
+            writer.dump_off(ts);
+        else if (id == DUMP_ON)
+            writer.dump_on(ts);
+        else
         {
-            n_prev = 0;
-            n = scope_prev.find(_scope_sep);
-            n = (n == std::string::npos) ? scope_prev.size() : n;
-            // equal prefix
-            while (std::strncmp(scope.c_str(), scope_prev.c_str(), n) == 0)
+            const VCDVariable &var = writer._prepare_change(id, ts);
+            if (var._type == VariableType::string)
             {
-                n_prev = n + _scope_sep.size();
-                n = scope_prev.find(_scope_sep, n_prev);
-                if (n == std::string::npos)
-                    break;
+                w.chars(pos, _commit_value);
+                writer._update_string(id, var, _commit_value);
             }
-            // last
-            if (n_prev != (scope_prev.size() + _scope_sep.size()))
-                _ofile.print("$upscope $end\n");
-            // close
-            n = scope_prev.find(_scope_sep, n_prev);
-            while (n != std::string::npos)
+            else
             {
-                _ofile.print("$upscope $end\n");
-                n = scope_prev.find(_scope_sep, n + _scope_sep.size());
+                std::copy_n(w.entries.begin() + std::ptrdiff_t(pos + 2), uint32_t(w.entries[pos + 1]), writer._packed.data());
+                writer._update_value(id, var);
             }
         }
+    }
+    writer.close(timestamp);
+}
 
-        // scope print open
-        n = scope.find(_scope_sep, n_prev);
-        while (n != std::string::npos)
-        {
-            _scope_declaration(scope, s->type, n_prev, n);
-            n_prev = n + _scope_sep.size();
-            n = scope.find(_scope_sep, n_prev);
-        }
-        // last
-        _scope_declaration(scope, s->type, n_prev);
+// -----------------------------
+// A record is 2 header words: timestamp and id, number of packed words and
+// number of characters (of string value), then the payload words
+struct VCDProducer::Chunk
+{
+    static constexpr size_t WORDS = 8192;
 
-        // dump variable declartion
-        for (const auto& var : s->vars)
-            _ofile.print("{:s}\n", var->declartion().c_str());
+    std::atomic<size_t> size{ 0 };    // published words
+    std::atomic<Chunk*> next{ nullptr };
+    std::vector<uint64_t> data;
+
+    explicit Chunk(size_t words) : data(words) {}
+};
 
-        scope_prev = scope;
+// -----------------------------
+VCDProducer::~VCDProducer()
+{
+    while (_head)
+    {
+        Chunk *next = _head->next.load(std::memory_order_acquire);
+        delete _head;
+        _head = next;
     }
+}
 
-    // scope print close (rest)
-    if (scope_prev.size())
+// -----------------------------
+uint64_t* VCDProducer::_append(VarId id, TimeStamp timestamp, unsigned n_words, unsigned n_chars)
+{
+    const size_t need = 2 + n_words + (n_chars + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+    if (_used + need > _tail->data.size())
     {
-        // last
-        _ofile.print("$upscope $end\n");
-        n = scope_prev.find(_scope_sep);
-        while (n != std::string::npos)
-        {
-            _ofile.print("$upscope $end\n");
-            n = scope_prev.find(_scope_sep, n + _scope_sep.size());
-        }
+        auto *chunk = new Chunk(std::max(need, Chunk::WORDS));
+        _tail->next.store(chunk, std::memory_order_release);
+        _tail = chunk;
+        _used = 0;
     }
+    uint64_t *record = _tail->data.data() + _used;
+    record[0] = uint64_t(timestamp) | (uint64_t(id) << 32);
+    record[1] = uint64_t(n_words) | (uint64_t(n_chars) << 32);
+    _used += need;
+    return record;
+}
+
+// -----------------------------
+const VCDVariable* VCDProducer::_var(VarId id, TimeStamp timestamp) const
+{
+    if (timestamp < _timestamp)
+        throw VCDPhaseException{ format("Out of order value change var '%u'", id) };
+    if (_writer._filtered(id))
+        return nullptr;
+    if (id >= _writer._vars_list.size())
+        throw VCDTypeException{ format("VCDVariable '%u' do not registered", id) };
+    return _writer._vars_list[id];
+}
 
-    _ofile.print("$enddefinitions $end\n");
-    // do not need anymore
-    _header.reset(nullptr);
+// -----------------------------
+void VCDProducer::_push(VarId id, TimeStamp timestamp)
+{
+    const auto n_words = unsigned(_packed.size());
+    uint64_t *record = _append(id, timestamp, n_words, 0u);
+    std::copy_n(_packed.data(), n_words, record + 2);
+    _timestamp = timestamp;
+    _tail->size.store(_used, std::memory_order_release);
 }
 
 // -----------------------------
-void VCDWriter::_finalize_registration()
+void VCDProducer::change(VarId id, TimeStamp timestamp, const VarValue &value)
 {
-    assert(_registering);
-    _write_header();
-    if (_vars_prevs.size())
+    const VCDVariable *var = _var(id, timestamp);
+    if (!var)
+        return;
+    if (var->_type == VariableType::string)
     {
-        _ofile.print("#{:d}\n", _timestamp);
-        _dump_values("$dumpvars");
-        if (!_dumping)
-            _dump_off(_timestamp);
+        var->pack(value, nullptr); // validate
+        uint64_t *record = _append(id, timestamp, 0u, unsigned(value.size()));
+        std::memcpy(record + 2, value.data(), value.size());
+        _timestamp = timestamp;
+        _tail->size.store(_used, std::memory_order_release);
+        return;
     }
-    _registering = false;
+    _packed.resize(var->packed_words());
+    var->pack(value, _packed.data());
+    _push(id, timestamp);
+}
+
+// -----------------------------
+void VCDProducer::change(VarId id, TimeStamp timestamp, const uint64_t *words, size_t n_words)
+{
+    const VCDVariable *var = _var(id, timestamp);
+    if (!var)
+        return;
+    _packed.resize(var->packed_words());
+    var->pack(words, n_words, _packed.data());
+    _push(id, timestamp);
 }
 
 // -----------------------------
-VCDVariable::VCDVariable(std::string name, VariableType type, unsigned size, ScopePtr scope, unsigned next_var_id) :
-    _ident(next_var_id), _type(type), _name(std::move(name)), _size(size), _scope(std::move(scope))
+void VCDProducer::_change_signed(VarId id, TimeStamp timestamp, int64_t value)
 {
+    const VCDVariable *var = _var(id, timestamp);
+    if (!var)
+        return;
+    _packed.resize(var->packed_words());
+    var->pack(value, _packed.data());
+    _push(id, timestamp);
 }
 
 // -----------------------------
-std::string VCDVariable::declartion() const
+const uint64_t* VCDProducer::_peek()
 {
-    return format("$var %s %d %x %s $end", VAR_TYPES[int(_type)].c_str(), _size, _ident, _name.c_str());
+    while (true)
+    {
+        if (_read < _head->size.load(std::memory_order_acquire))
+            return _head->data.data() + _read;
+        Chunk *next = _head->next.load(std::memory_order_acquire);
+        if (!next)
+            return nullptr;
+        // the size is final, once the next chunk is published
+        if (_read < _head->size.load(std::memory_order_acquire))
+            continue;
+        delete _head;
+        _head = next;
+        _read = 0;
+    }
 }
 
 // -----------------------------
-//  :Warning: *value* is string where all characters must be one of `VCDValues`.
-//  An empty  *value* is the same as `VCDValues::UNDEF`
-VarValue VCDVectorVariable::change_record(const VarValue &value) const
+void VCDProducer::_pop()
 {
-    if (value.size() > _size)
-        throw VCDTypeException{ format("Invalid binary vector value '%s' size '%d'", value.c_str(), _size) };
+    const uint64_t *record = _head->data.data() + _read;
+    const auto n_words = uint32_t(record[1]);
+    const auto n_chars = uint32_t(record[1] >> 32);
+    _read += 2 + n_words + (n_chars + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+}
+
+// -----------------------------
+VCDProducer& VCDWriter::producer()
+{
+    if (_closed)
+        throw VCDPhaseException{ "Cannot create producer after close()" };
+    if (_registering)
+        _finalize_registration();
+
+    std::unique_ptr<VCDProducer> p{ new VCDProducer(*this) };
+    // the first chunk is allocated before the producer is given to a thread
+    p->_tail = p->_head = new VCDProducer::Chunk(VCDProducer::Chunk::WORDS);
+    _producers.push_back(std::move(p));
+    return *_producers.back();
+}
 
-    static VarValue val; // no thread safe mem-alloc optimization
-    val.reserve(_size + 2);
-    val = ('b' + value + ' ');
+// -----------------------------
+size_t VCDWriter::commit(TimeStamp timestamp)
+{
+    if (_closed)
+        throw VCDPhaseException{ "Cannot commit() after close()" };
 
-    auto val_sz = value.size();
-    for (auto i = 1u; i < (val_sz - 1); ++i)
+    // k-way merge by (timestamp, producer) keeps the order of each producer
+    using Head = std::pair<TimeStamp, size_t>;
+    std::priority_queue<Head, std::vector<Head>, std::greater<>> heads;
+    for (size_t i = 0; i < _producers.size(); ++i)
+    {
+        const uint64_t *record = _producers[i]->_peek();
+        if (record && TimeStamp(record[0]) <= timestamp)
+            heads.emplace(TimeStamp(record[0]), i);
+    }
+    // the timestamps of producers do not decrease: the earliest record
+    // is checked before anything is consumed or written
+    if (!heads.empty() && heads.top().first < _timestamp)
+        throw VCDPhaseException{ format("Out of order value change var '%u' of producer at %u",
+                                        VarId(_producers[heads.top().second]->_peek()[0] >> 32), heads.top().first) };
+
+    size_t n_merged = 0;
+    while (!heads.empty())
     {
-        val[i] = static_cast<char>(tolower(static_cast<unsigned char>(val[i])));
-        switch(val[i])
+        const size_t i = heads.top().second;
+        heads.pop();
+        VCDProducer &p = *_producers[i];
+        // all the records of the producer with this timestamp
+        const uint64_t *record = p._peek();
+        const TimeStamp ts = TimeStamp(record[0]);
+        do
         {
-        case VCDValues::ONE:
-        case VCDValues::ZERO:
-        case VCDValues::UNDEF:
-        case VCDValues::HIGHV:
-            break;
-        default:
-            throw VCDTypeException{ format("Invalid binary vector value '%s' size '%d'", val.c_str(), _size) };
-        }
+            const VarId id = VarId(record[0] >> 32);
+            const auto n_words = uint32_t(record[1]);
+            const auto n_chars = uint32_t(record[1] >> 32);
+            const VCDVariable &var = _prepare_change(id, ts);
+            // the record stays in memory until the next peek
+            p._pop();
+            if (var._type == VariableType::string)
+            {
+                _commit_value.assign(reinterpret_cast<const char*>(record + 2), n_chars);
+                _update_string(id, var, _commit_value);
+            }
+            else
+            {
+                std::copy_n(record + 2, n_words, _packed.data());
+                _update_value(id, var);
+            }
+            ++n_merged;
+            record = p._peek();
+        } while (record && TimeStamp(record[0]) == ts);
+
+        if (record && TimeStamp(record[0]) <= timestamp)
+            heads.emplace(TimeStamp(record[0]), i);
     }
+    return n_merged;
+}
+
+// -----------------------------
+size_t VCDWriter::dropped_bytes() const
+{
+    return _ofile->dropped_bytes();
+}
+
+// -----------------------------
+VCDWriter::StatsMark VCDWriter::_stats_mark() const
+{
+    if constexpr (!VCDStats::enabled)
+        return {};
+    return { _ofile->bytes(), clock_ns(), _ofile->io_ns() };
+}
+
+// -----------------------------
+VCDWriter::StatsMark VCDWriter::_stats_record_mark() const
+{
+    if constexpr (!VCDStats::enabled)
+        return {};
+    return { _ofile->bytes(), (_stats.records % STATS_SAMPLE) ? 0u : clock_ns(), _ofile->io_ns() };
+}
 
-    if (!val_sz)
-        val = ('b' + std::string(_size, VCDValues::UNDEF) + ' ');
-    else if (val_sz < _size) // align
-    {
-        /***
-         * Example: _size = 4, a 4 bit vector
-         * value is 'xx' => val_sz = 2
-         * then val is 'bxx ' when entering here, but this is not yet alligned
-         * end result should look like 'b00xx '
-         * so 'xx' needs to be aligned to the right
-         * 'b|x|x| |'       val
-         * 'b|0|0|x|x| |'   val desired
-         * |0|1|2|3|4|5|    index positions
-         */
-
-        val.resize(_size + 2); // to allow full bit chars + 'b' in beginning and a space ' ' at the end
-        auto k = _size - val_sz;
-        /***
-        * k: amount that original 'value' input in val (here 'xx') need to shifted
-        * or in other words: number of zeros that need to be filled in before 'xx'
-        * k is then size(4) - val_sz (2) = 2,
-        * as seen in example first 'x' need to be moved from pos 1 -> 3, second from 2 -> 4
-        * reverse through the 'xx' string, as otherwise chars might be moved to positions that need to be moved aswell
-        * start at val_sz(2) and go back, ending before hitting the 'b'
-        */
-        for (auto i = val_sz ; i >= 1; --i)
-            val[k + i] = val[i];
-        // set remaining values zero
-        for (auto i = 1u; i <= k; ++i)
-            val[i] = VCDValues::ZERO;
-        // set last char to a space
-        val[_size+1] = ' ';
-    }
-    return val;
+// -----------------------------
+void VCDWriter::_stats_add(size_t &bytes, uint64_t &ns, const StatsMark &mark) const
+{
+    if constexpr (!VCDStats::enabled)
+        return;
+    bytes += _ofile->bytes() - mark.bytes;
+    // a full buffer may be written in the middle
+    ns += (clock_ns() - mark.ns) - (_ofile->io_ns() - mark.io_ns);
+}
+
+// -----------------------------
+void VCDWriter::_stats_record(VarId id, const StatsMark &mark)
+{
+    if constexpr (!VCDStats::enabled)
+        return;
+    static constexpr std::array<size_t VCDStats::*, 4> KIND_BYTES{
+        &VCDStats::scalar_bytes, &VCDStats::vector_bytes, &VCDStats::real_bytes, &VCDStats::string_bytes };
+    ++_stats.records;
+    _stats.*KIND_BYTES[int(_vars_list[id]->_kind)] += _ofile->bytes() - mark.bytes;
+    if (mark.ns)
+        _stats.format_ns += STATS_SAMPLE * ((clock_ns() - mark.ns) - (_ofile->io_ns() - mark.io_ns));
+}
+
+// -----------------------------
+void VCDWriter::_stats_output()
+{
+    if constexpr (!VCDStats::enabled)
+        return;
+    _stats_bytes += _ofile->bytes();
+    _stats.flush_ns += _ofile->io_ns();
+    _stats.peak_buffered_bytes = std::max(_stats.peak_buffered_bytes, _ofile->peak_bytes());
+}
+
+// -----------------------------
+VCDStats VCDWriter::stats() const
+{
+    VCDStats stats = _stats;
+    if constexpr (!VCDStats::enabled)
+        return stats;
+    stats.var_changes.resize(_vars_list.size());
+    const size_t changed = std::accumulate(stats.var_changes.begin(), stats.var_changes.end(), size_t(0));
+    stats.unchanged = stats.changes - changed;
+    stats.suppressed = changed - stats.records;
+    stats.flush_ns += _ofile->io_ns();
+    stats.peak_buffered_bytes = std::max(stats.peak_buffered_bytes, _ofile->peak_bytes());
+    stats.other_bytes = _stats_bytes + _ofile->bytes() - stats.scalar_bytes - stats.vector_bytes - stats.real_bytes -
+                        stats.string_bytes - stats.header_bytes - stats.dump_bytes;
+    return stats;
+}
+
+// -----------------------------
+// JSON string of the name (the escaped identifiers of Verilog begin with '\')
+static void json_string(std::string &json, std::string_view str)
+{
+    json += '"';
+    for (char c : str)
+    {
+        if (c == '"' || c == '\\')
+            json += '\\';
+        json += c;
+    }
+    json += '"';
+}
+
+// -----------------------------
+void VCDWriter::_write_stats() const
+{
+    const VCDStats s = stats();
+    std::string json;
+    fmt::format_to(std::back_inserter(json),
+                   "{{\n  \"enabled\": {},\n  \"changes\": {},\n  \"unchanged\": {},\n  \"suppressed\": {},\n  \"records\": {},\n"
+                   "  \"bytes\": {{ \"scalar\": {}, \"vector\": {}, \"real\": {}, \"string\": {}, \"header\": {}, \"dump\": {}, \"other\": {} }},\n"
+                   "  \"peak_buffered_bytes\": {},\n  \"ns\": {{ \"header\": {}, \"format\": {}, \"flush\": {} }},\n  \"vars\": {{",
+                   VCDStats::enabled, s.changes, s.unchanged, s.suppressed, s.records,
+                   s.scalar_bytes, s.vector_bytes, s.real_bytes, s.string_bytes, s.header_bytes, s.dump_bytes, s.other_bytes,
+                   s.peak_buffered_bytes, s.header_ns, s.format_ns, s.flush_ns);
+    // "scope.name": changes
+    std::vector<std::string_view> path;
+    for (VarId id = 0; id < s.var_changes.size(); ++id)
+    {
+        const VCDVariable &var = *_vars_list[id];
+        path.clear();
+        for (const VCDScope *scope = var._scope; scope && scope->parent; scope = scope->parent)
+            path.push_back(scope->name);
+        std::string name;
+        for (auto it = path.rbegin(); it != path.rend(); ++it)
+            name.append(*it).append(_scope_sep);
+        json += id ? ",\n    " : "\n    ";
+        json_string(json, name.append(var._name));
+        fmt::format_to(std::back_inserter(json), ": {}", s.var_changes[id]);
+    }
+    json += s.var_changes.empty() ? "}\n}\n" : "\n  }\n}\n";
+
+    const std::string &filename = _options.stats_file;
+    std::FILE *file = std::fopen(filename.c_str(), "wb");
+    if (!file)
+        throw VCDException{ format("Cannot open file '%s': %s", filename.c_str(), std::strerror(errno)) };
+    const size_t written = std::fwrite(json.data(), 1u, json.size(), file);
+    if (std::fclose(file) != 0 || written != json.size())
+        throw VCDException{ format("Cannot write file '%s': %s", filename.c_str(), std::strerror(errno)) };
+}
+
+// -----------------------------
+// Initial value of a var: the default `VCDValues::UNDEF` is zero of the reals
+// and all the bits undefined of the wires and regs, only those are made in *buf*
+static const VarValue& initial_value(VariableType type, unsigned size, const VarValue &init, VarValue &buf)
+{
+    if (init.size() != 1 || init[0] != VCDValues::UNDEF)
+        return init;
+    switch (type)
+    {
+        case VariableType::integer:
+        case VariableType::realtime:
+        case VariableType::string:
+        case VariableType::event:
+            return init;
+        case VariableType::real:
+            buf = "0.0";
+            return buf;
+        default:
+            buf.assign(size, VCDValues::UNDEF);
+            return buf;
+    }
+}
+
+// -----------------------------
+VCDVariable* VCDWriter::_make_var(std::string_view name, VariableType type, unsigned size,
+                                  const VCDScope *scope, unsigned id)
+{
+    auto sz = [&size](unsigned def) { return (size ? size : def);  };
+    // the var and its name are kept by the arena (a failed registration leaves them unused)
+    VCDArena &arena = *_arena;
+
+    VCDVariable *pvar = nullptr;
+    switch (type)
+    {
+        case VariableType::integer:   
+        case VariableType::realtime:
+            if (sz(64) == 1)
+                pvar = arena.make<VCDScalarVariable>(arena.copy(name), type, 1, scope, id);
+            else
+                pvar = arena.make<VCDVectorVariable>(arena.copy(name), type, sz(64), scope, id);
+            break;
+
+        case VariableType::real:
+            pvar = arena.make<VCDRealVariable>(arena.copy(name), type, sz(64), scope, id);
+            break;
+
+        case VariableType::string:
+            pvar = arena.make<VCDStringVariable>(arena.copy(name), type, sz(1), scope, id);
+            break;
+
+        case VariableType::event:
+            pvar = arena.make<VCDScalarVariable>(arena.copy(name), type, 1, scope, id);
+            break;
+
+        default:
+            if (!size)
+                throw VCDTypeException{ format("Must supply size for type '%s' of var '%s'",
+                                               VCDVariable::VAR_TYPES[(int)type].c_str(), std::string(name).c_str()) };
+
+            pvar = arena.make<VCDVectorVariable>(arena.copy(name), type, size, scope, id);
+            break;
+    }     
+    return pvar;
+}
+
+// -----------------------------
+void VCDWriter::_index_vars() const
+{
+    if (_vars_indexed == _vars_list.size())
+        return;
+    _vars.reserve(_vars_list.size());
+    for (; _vars_indexed < _vars_list.size(); ++_vars_indexed)
+    {
+        const VCDVariable &var = *_vars_list[_vars_indexed];
+        _vars.emplace(VarKey{ var._scope, var._name }, VarId(_vars_indexed));
+    }
+}
+
+// -----------------------------
+VarPtr VCDWriter::register_var(const std::string &scope, const std::string &name, VariableType type,
+                               unsigned size, const VarValue &init, bool duplicate_names_check)
+{
+    if (_closed)
+        throw VCDPhaseException{ "Cannot register after close()" };
+    if (!_registering)
+        throw VCDPhaseException{ format("Cannot register new var '%s', registering finished", name.c_str()) };
+
+    if (scope.size() == 0 || name.size() == 0)
+        throw VCDTypeException{ format("Empty scope '%s' or name '%s'", scope.c_str(), name.c_str()) };
+
+    if (_filter && !_filter->dumped(scope, name, _scope_sep))
+    {
+        VCDVariable *pvar = _make_filtered(scope, name, type, size, init, unsigned(_filtered_vars.size()));
+        _index_vars();
+        if (duplicate_names_check && _vars.find(VarKey{ pvar->_scope, name }) != _vars.end())
+            throw VCDTypeException{ format("Duplicate var '%s' in scope '%s'", name.c_str(), scope.c_str()) };
+        _vars.emplace(VarKey{ pvar->_scope, pvar->_name }, pvar->_ident);
+        _filtered_vars.push_back(pvar);
+        return VarPtr(pvar);
+    }
+
+    VCDScope *cur_scope = _scopes->get(scope, _scope_sep, _scope_def_type);
+
+    _index_vars();
+    if (duplicate_names_check && _vars.find(VarKey{ cur_scope, name }) != _vars.end())
+        throw VCDTypeException{ format("Duplicate var '%s' in scope '%s'", name.c_str(), scope.c_str()) };
+
+    VCDVariable *pvar = _make_var(name, type, size, cur_scope, _next_var_id);
+    VarValue buf;
+    const VarValue &init_value = initial_value(type, size, init, buf);
+    // validate initial value before any state alteration
+    const unsigned n_words = (type != VariableType::event) ? pvar->packed_words() : 0u;
+    if (_packed.size() < n_words)
+        _packed.resize(n_words);
+    if (n_words)
+        pvar->pack(init_value, _packed.data());
+
+    _vars.emplace(VarKey{ cur_scope, pvar->_name }, pvar->_ident);
+    _vars_indexed++;
+    cur_scope->add_var(pvar);
+    _vars_list.push_back(pvar);
+    if (type == VariableType::string)
+    {
+        _packed[0] = _strings_prevs.size();
+        _strings_prevs.push_back(init_value);
+    }
+    _vars_prevs.insert(_vars_prevs.end(), _packed.data(), _packed.data() + n_words);
+    _vars_prevs_offs.push_back(_vars_prevs.size());
+    // Only alter state after change_record() succeeds
+    _next_var_id++;
+    return VarPtr(pvar);
+}
+
+// -----------------------------
+VCDVariable* VCDWriter::_make_filtered(const std::string &scope, const std::string &name, VariableType type,
+                                       unsigned size, const VarValue &init, unsigned index)
+{
+    // the scope is declared only if it gets the vars to dump
+    const VCDScope *cur_scope = _scopes->get(scope, _scope_sep, _scope_def_type);
+    VCDVariable *pvar = _make_var(name, type, size, cur_scope, FILTERED_ID | index);
+    // the same validation as of the dumped vars
+    std::vector<uint64_t> value((type != VariableType::event) ? pvar->packed_words() : 0u);
+    VarValue buf;
+    if (!value.empty())
+        pvar->pack(initial_value(type, size, init, buf), value.data());
+    return pvar;
+}
+
+// -----------------------------
+// Run *f(beg, end)* on the parts of [0, n) by the hardware threads,
+// rethrow the exception of the first failed part
+template <typename F>
+static void parallel_for(size_t n, F &&f)
+{
+    constexpr size_t MIN_PART = 1u << 14;
+    const size_t n_threads = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()),
+                                              (n + MIN_PART - 1) / MIN_PART);
+    if (n_threads <= 1)
+    {
+        f(size_t(0), n);
+        return;
+    }
+    std::vector<std::exception_ptr> errors(n_threads);
+    std::vector<std::thread> threads;
+    const size_t part = (n + n_threads - 1) / n_threads;
+    for (size_t t = 0; t < n_threads; ++t)
+        threads.emplace_back([&, t] {
+            try
+            { f(t * part, std::min(n, (t + 1) * part)); }
+            catch (...)
+            { errors[t] = std::current_exception(); }
+        });
+    for (auto &th : threads)
+        th.join();
+    for (auto &e : errors)
+        if (e)
+            std::rethrow_exception(e);
+}
+
+// -----------------------------
+// Sort by parts in parallel, then merge the sorted parts
+template <typename It, typename Cmp>
+static void parallel_sort(It beg, It end, Cmp cmp)
+{
+    const size_t n = size_t(end - beg);
+    std::vector<size_t> bounds;
+    std::mutex mutex;
+    parallel_for(n, [&](size_t b, size_t e) {
+        std::sort(beg + b, beg + e, cmp);
+        std::lock_guard<std::mutex> lock(mutex);
+        bounds.push_back(e);
+    });
+    std::sort(bounds.begin(), bounds.end());
+    for (size_t i = 1; i < bounds.size(); ++i)
+        std::inplace_merge(beg, beg + bounds[i - 1], beg + bounds[i], cmp);
+}
+
+// -----------------------------
+std::vector<VarId> VCDWriter::register_vars(const std::vector<VarSpec> &specs, bool duplicate_names_check)
+{
+    if (_closed)
+        throw VCDPhaseException{ "Cannot register after close()" };
+    if (!_registering)
+        throw VCDPhaseException{ "Cannot register new vars, registering finished" };
+
+    for (const auto &spec : specs)
+        if (spec.scope.size() == 0 || spec.name.size() == 0)
+            throw VCDTypeException{ format("Empty scope '%s' or name '%s'", spec.scope.c_str(), spec.name.c_str()) };
+    if (_filter)
+        return _register_filtered(specs, duplicate_names_check);
+    return _register_vars(specs, duplicate_names_check);
+}
+
+// -----------------------------
+std::vector<VarId> VCDWriter::_register_filtered(const std::vector<VarSpec> &specs, bool duplicate_names_check)
+{
+    // the dropped vars are made and validated first,
+    // they are indexed after the rest are registered
+    std::vector<VarSpec> kept;
+    std::vector<size_t> kept_pos;
+    std::vector<std::pair<size_t, VCDVariable*>> dropped;
+    std::unordered_set<VarKey, VarKeyHash> keys;
+    _index_vars();
+    for (size_t i = 0; i < specs.size(); ++i)
+    {
+        const VarSpec &spec = specs[i];
+        if (_filter->dumped(spec.scope, spec.name, _scope_sep))
+        {
+            kept.push_back(spec);
+            kept_pos.push_back(i);
+            continue;
+        }
+        VCDVariable *pvar = _make_filtered(spec.scope, spec.name, spec.type, spec.size, spec.init,
+                                           unsigned(_filtered_vars.size() + dropped.size()));
+        const VarKey key{ pvar->_scope, pvar->_name };
+        if (duplicate_names_check && (_vars.count(key) || !keys.insert(key).second))
+            throw VCDTypeException{ format("Duplicate var '%s' in scope '%s'", spec.name.c_str(), spec.scope.c_str()) };
+        dropped.emplace_back(i, pvar);
+    }
+
+    const std::vector<VarId> kept_ids = _register_vars(kept, duplicate_names_check);
+    std::vector<VarId> ids(specs.size());
+    for (size_t k = 0; k < kept.size(); ++k)
+        ids[kept_pos[k]] = kept_ids[k];
+    for (const auto &[i, pvar] : dropped)
+    {
+        _vars.emplace(VarKey{ pvar->_scope, pvar->_name }, pvar->_ident);
+        _filtered_vars.push_back(pvar);
+        ids[i] = pvar->_ident;
+    }
+    return ids;
+}
+
+// -----------------------------
+std::vector<VarId> VCDWriter::_register_vars(const std::vector<VarSpec> &specs, bool duplicate_names_check)
+{
+    const size_t n = specs.size();
+    // scopes are looked up in the trie once per distinct path, the new ones
+    // have no vars until the commit and are not declared in header
+    std::vector<VCDScope*> scopes(n);
+    std::unordered_map<std::string_view, VCDScope*> paths;
+    for (size_t i = 0; i < n; ++i)
+    {
+        const std::string &scope = specs[i].scope;
+        if (i > 0 && scope == specs[i - 1].scope)
+        {
+            scopes[i] = scopes[i - 1];
+            continue;
+        }
+        auto [it, added] = paths.try_emplace(scope, nullptr);
+        if (added)
+            it->second = _scopes->get(scope, _scope_sep, _scope_def_type);
+        scopes[i] = it->second;
+    }
+    if (duplicate_names_check)
+    {
+        // the duplicates are neighbours after the sort by (scope node, name)
+        struct Key
+        {
+            const VCDScope *scope;
+            std::string_view name;
+            uint32_t index;
+        };
+        std::vector<Key> keys(n);
+        for (size_t i = 0; i < n; ++i)
+            keys[i] = { scopes[i], specs[i].name, uint32_t(i) };
+        parallel_sort(keys.begin(), keys.end(), [](const Key &a, const Key &b) {
+            return (a.scope < b.scope) || (a.scope == b.scope && a.name < b.name);
+        });
+        for (size_t i = 1; i < n; ++i)
+            if (keys[i].scope == keys[i - 1].scope && keys[i].name == keys[i - 1].name)
+            {
+                const VarSpec &spec = specs[keys[i].index];
+                throw VCDTypeException{ format("Duplicate var '%s' in scope '%s'", spec.name.c_str(), spec.scope.c_str()) };
+            }
+        if (!_vars_list.empty())
+        {
+            _index_vars();
+            for (size_t i = 0; i < n; ++i)
+                if (_vars.find(VarKey{ scopes[i], specs[i].name }) != _vars.end())
+                    throw VCDTypeException{ format("Duplicate var '%s' in scope '%s'", specs[i].name.c_str(), specs[i].scope.c_str()) };
+        }
+    }
+
+    // make the vars in the arena, then validate and pack
+    // the initial values in parallel right into their places
+    std::vector<VCDVariable*> vars(n);
+    std::vector<size_t> offs(n + 1, 0u);
+    size_t max_words = 0;
+    const unsigned first_id = _next_var_id;
+    for (size_t i = 0; i < n; ++i)
+    {
+        const auto &spec = specs[i];
+        vars[i] = _make_var(spec.name, spec.type, spec.size, scopes[i], first_id + unsigned(i));
+        const unsigned n_words = (spec.type != VariableType::event) ? vars[i]->packed_words() : 0u;
+        offs[i + 1] = offs[i] + n_words;
+        max_words = std::max<size_t>(max_words, n_words);
+    }
+    const size_t prevs_beg = _vars_prevs.size();
+    _vars_prevs.resize(prevs_beg + offs[n]);
+    try
+    {
+        parallel_for(n, [&](size_t beg, size_t end) {
+            VarValue buf;
+            for (size_t i = beg; i < end; ++i)
+                if (offs[i + 1] != offs[i])
+                {
+                    const VarSpec &spec = specs[i];
+                    vars[i]->pack(initial_value(spec.type, spec.size, spec.init, buf),
+                                  _vars_prevs.data() + prevs_beg + offs[i]);
+                }
+        });
+    }
+    catch (...)
+    {
+        _vars_prevs.resize(prevs_beg);
+        throw;
+    }
+
+    // no errors, alter the state
+    _vars_prevs_offs.reserve(_vars_prevs_offs.size() + n);
+    for (size_t i = 0; i < n; ++i)
+        _vars_prevs_offs.push_back(prevs_beg + offs[i + 1]);
+    std::vector<VarId> ids(n);
+    _vars_list.reserve(_vars_list.size() + n);
+    for (size_t i = 0; i < n; ++i)
+    {
+        if (specs[i].type == VariableType::string)
+        {
+            _vars_prevs[prevs_beg + offs[i]] = _strings_prevs.size();
+            _strings_prevs.push_back(specs[i].init);
+        }
+        scopes[i]->add_var(vars[i]);
+        _vars_list.push_back(vars[i]);
+        ids[i] = first_id + VarId(i);
+    }
+    _next_var_id += unsigned(n);
+    if (_packed.size() < max_words)
+        _packed.resize(max_words);
+    return ids;
+}
+
+// -----------------------------
+const VCDVariable& VCDWriter::_prepare_change(VarId id, TimeStamp timestamp)
+{
+    if (_closed)
+        throw VCDPhaseException{ "Cannot change value after close()" };
+    if (id >= _vars_list.size())
+        throw VCDTypeException{ format("VCDVariable '%u' do not registered", id) };
+
+    const VCDVariable &var = *_vars_list[id];
+    if (timestamp < _timestamp)
+        throw VCDPhaseException{ format("Out of order value change var '%s'", var._name.data()) };
+    _set_timestamp(timestamp);
+    if constexpr (VCDStats::enabled)
+        ++_stats.changes;
+    return var;
+}
+
+// -----------------------------
+void VCDWriter::_set_timestamp(TimeStamp timestamp)
+{
+    if (timestamp > _timestamp)
+    {
+        if (_registering)
+            _finalize_registration();
+        else
+        {
+            _resync();
+            if (_segmented() && ((_options.segment_bytes && _ofile->bytes() >= _options.segment_bytes) ||
+                                 (_options.segment_span && timestamp - _segment_start >= _options.segment_span)))
+            {
+                _rotate(timestamp);
+                return;
+            }
+            if (_index && _dumping && ((_options.index_bytes && _ofile->bytes() - _index_offset >= _options.index_bytes) ||
+                                       (_options.index_span && timestamp - _index_timestamp >= _options.index_span)))
+            {
+                _write_checkpoint(timestamp);
+                return;
+            }
+        }
+        if (_dumping && !_window)
+            _ofile->timestamp(timestamp);
+        _timestamp = timestamp;
+    }
+}
+
+// -----------------------------
+void VCDWriter::_resync()
+{
+    // the changes of a dropped buffer are lost, the values are dumped again
+    // after the last timestamp (the output writes it again)
+    if (_ofile->resync() && _dumping && !_window)
+        _dump_values("$dumpall");
+}
+
+// -----------------------------
+void VCDWriter::_rotate(TimeStamp timestamp)
+{
+    _close_segment();
+    _stats_output();
+    // the segments are written the same way
+    _ofile.reset(new VCDOutput(makeVCDSink(segment_name(_filename, ++_segment), _options), _options));
+    _segment_start = _timestamp = timestamp;
+    _write_start();
+}
+
+// -----------------------------
+void VCDWriter::_write_checkpoint(TimeStamp timestamp)
+{
+    // "<timestamp> <offset>" of the line "#timestamp"
+    _index_offset = _ofile->bytes();
+    _index_timestamp = _timestamp = timestamp;
+    std::array<char, 48> entry{};
+    const int n = std::snprintf(entry.data(), entry.size(), "%u %zu\n", timestamp, _index_offset);
+    _index->write(entry.data(), size_t(n));
+    _ofile->timestamp(timestamp);
+    _dump_values("$dumpall");
+}
+
+// -----------------------------
+void VCDWriter::_close_segment()
+{
+    _ofile->close();
+    // "<first timestamp> <last timestamp> <file>" of the closed segment
+    const std::string manifest = segment_name(_filename, "manifest", true);
+    std::string name = segment_name(_filename, _segment);
+    name.erase(0, name.find_last_of("/\\") + 1);
+    std::FILE *file = std::fopen(manifest.c_str(), "ab");
+    if (!file)
+        throw VCDException{ format("Cannot open file '%s': %s", manifest.c_str(), std::strerror(errno)) };
+    std::fprintf(file, "%u %u %s\n", _segment_start, _timestamp, name.c_str());
+    if (std::fclose(file) != 0)
+        throw VCDException{ format("Cannot write file '%s': %s", manifest.c_str(), std::strerror(errno)) };
+}
+
+// -----------------------------
+const VCDVariable& VCDWriter::_batch_var(VarId id) const
+{
+    if (id >= _vars_list.size() && !_filtered(id))
+        throw VCDTypeException{ format("VCDVariable '%u' do not registered", id) };
+    const VCDVariable &var = *_variable(id);
+    if (var._type == VariableType::event || var._kind == VCDVariable::Kind::real || var._kind == VCDVariable::Kind::string)
+        throw VCDTypeException{ format("Var '%s' has no 4-state value to change in batch", var._name.data()) };
+    return var;
+}
+
+// -----------------------------
+bool VCDWriter::_batch_change(VarId id, const uint64_t *value)
+{
+    if (_filtered(id))
+        return false;
+    if constexpr (VCDStats::enabled)
+        ++_stats.changes;
+    uint64_t *prev = _vars_prevs.data() + _vars_prevs_offs[id];
+    const size_t n_words = _vars_prevs_offs[id + 1] - _vars_prevs_offs[id];
+    if (std::equal(prev, prev + n_words, value))
+        return false;
+    std::copy_n(value, n_words, prev);
+    if (!_dump_change(id, value))
+        return true;
+
+    // the same records as `change_record()` of scalar and vector, in place
+    const StatsMark mark = _stats_record_mark();
+    const VCDVariable &var = *_vars_list[id];
+    char *p = _ofile->reserve(var._size + var._code_size + 3u);
+    if (var._kind == VCDVariable::Kind::scalar)
+        *p++ = packed::STATES[value[0] & 3u];
+    else
+    {
+        *p++ = 'b';
+        packed::kernels().render(value, var._size, p);
+        p += var._size;
+        *p++ = ' ';
+    }
+    p = std::copy_n(var._code.data(), var._code_size, p);
+    *p++ = '\n';
+    _ofile->commit(p);
+    _stats_record(id, mark);
+    return true;
+}
+
+// -----------------------------
+size_t VCDWriter::change_batch(TimeStamp timestamp, const VarId *ids, const uint64_t *values, size_t n)
+{
+    // validate all the changes before any state alteration
+    for (size_t i = 0; i < n; ++i)
+    {
+        const VCDVariable &var = _batch_var(ids[i]);
+        if (var._size > 64)
+            throw VCDTypeException{ format("Var '%s' is wider than 64 bits, use packed values", var._name.data()) };
+        if (var._size < 64 && (values[i] >> var._size))
+            _throw_not_fits(ids[i], var._size);
+    }
+    if (!_check_batch(timestamp, n))
+        return 0;
+
+    size_t n_changed = 0;
+    for (size_t i = 0; i < n; ++i)
+    {
+        const uint64_t value[2] = { packed::spread(uint32_t(values[i])), packed::spread(uint32_t(values[i] >> 32)) };
+        n_changed += _batch_change(ids[i], value);
+    }
+    return n_changed;
+}
+
+// -----------------------------
+// Two's complement of *value* in *bits* (the bits above 64 are the sign),
+// `false` if the value with its sign does not fit them
+static bool twos_complement(int64_t value, unsigned bits, uint64_t &word)
+{
+    word = uint64_t(value);
+    if (bits >= 64)
+        return true;
+    if (value >= 0)
+        return !(word >> bits);
+    word &= (uint64_t(1) << bits) - 1;
+    return value >= -(int64_t(1) << (bits - 1));
+}
+
+// -----------------------------
+size_t VCDWriter::change_batch(TimeStamp timestamp, const VarId *ids, const int64_t *values, size_t n)
+{
+    uint64_t word = 0;
+    for (size_t i = 0; i < n; ++i)
+    {
+        const VCDVariable &var = _batch_var(ids[i]);
+        if (var._size > 64)
+            throw VCDTypeException{ format("Var '%s' is wider than 64 bits, use packed values", var._name.data()) };
+        if (!twos_complement(values[i], var._size, word))
+            _throw_not_fits(ids[i], var._size);
+    }
+    if (!_check_batch(timestamp, n))
+        return 0;
+
+    size_t n_changed = 0;
+    for (size_t i = 0; i < n; ++i)
+    {
+        twos_complement(values[i], _variable(ids[i])->_size, word);
+        const uint64_t value[2] = { packed::spread(uint32_t(word)), packed::spread(uint32_t(word >> 32)) };
+        n_changed += _batch_change(ids[i], value);
+    }
+    return n_changed;
+}
+
+// -----------------------------
+size_t VCDWriter::change_batch_packed(TimeStamp timestamp, const VarId *ids, const uint64_t *values, size_t n)
+{
+    const uint64_t *value = values;
+    for (size_t i = 0; i < n; ++i)
+    {
+        const VCDVariable &var = _batch_var(ids[i]);
+        const unsigned n_words = var.packed_words();
+        // codes of the bits above the size are zeros
+        const unsigned rest = var._size % packed::BITS_PER_WORD;
+        if (rest && (value[n_words - 1] >> (2 * rest)))
+            _throw_not_fits(ids[i], var._size);
+        value += n_words;
+    }
+    if (!_check_batch(timestamp, n))
+        return 0;
+
+    size_t n_changed = 0;
+    for (size_t i = 0; i < n; ++i)
+    {
+        n_changed += _batch_change(ids[i], values);
+        values += _filtered(ids[i]) ? _variable(ids[i])->packed_words() : _vars_prevs_offs[ids[i] + 1] - _vars_prevs_offs[ids[i]];
+    }
+    return n_changed;
+}
+
+// -----------------------------
+bool VCDWriter::_check_batch(TimeStamp timestamp, size_t n)
+{
+    if (_closed)
+        throw VCDPhaseException{ "Cannot change value after close()" };
+    if (timestamp < _timestamp)
+        throw VCDPhaseException{ format("Out of order batch of value changes at '%u'", timestamp) };
+    if (!n)
+        return false;
+    _set_timestamp(timestamp);
+    return true;
+}
+
+// -----------------------------
+bool VCDWriter::_update_value(VarId id, const VCDVariable &var)
+{
+    // if value changed (events are always dumped)
+    if (var._type != VariableType::event)
+    {
+        uint64_t *prev = _vars_prevs.data() + _vars_prevs_offs[id];
+        const auto n_words = _vars_prevs_offs[id + 1] - _vars_prevs_offs[id];
+        if (std::equal(prev, prev + n_words, _packed.data()))
+            return false;
+        std::copy_n(_packed.data(), n_words, prev);
+    }
+    // dump it into file
+    if (_dump_change(id, _packed.data()))
+    {
+        const StatsMark mark = _stats_record_mark();
+        var.change_record(_packed.data(), _record);
+        _ofile->record(_record, var.code());
+        _stats_record(id, mark);
+    }
+    return true;
+}
+
+// -----------------------------
+bool VCDWriter::_change(VarId id, TimeStamp timestamp, const VarValue &value)
+{
+    if (_filtered(id))
+        return false;
+    const VCDVariable &var = _prepare_change(id, timestamp);
+    if (var._type == VariableType::string)
+    {
+        var.pack(value, nullptr); // validate
+        return _update_string(id, var, value);
+    }
+    var.pack(value, _packed.data());
+    return _update_value(id, var);
+}
+
+// -----------------------------
+bool VCDWriter::_update_string(VarId id, const VCDVariable &var, std::string_view value)
+{
+    VarValue &prev = _strings_prevs[_vars_prevs[_vars_prevs_offs[id]]];
+    if (prev == value)
+        return false;
+    prev.assign(value);
+    // the same as `VCDStringVariable::change_record()`
+    if (_dump_change(id, nullptr))
+    {
+        const StatsMark mark = _stats_record_mark();
+        _ofile->string_record(value, var.code());
+        _stats_record(id, mark);
+    }
+    return true;
+}
+
+// -----------------------------
+bool VCDWriter::_change(VarId id, TimeStamp timestamp, const uint64_t *words, size_t n_words)
+{
+    if (_filtered(id))
+        return false;
+    const VCDVariable &var = _prepare_change(id, timestamp);
+    var.pack(words, n_words, _packed.data());
+    return _update_value(id, var);
+}
+
+// -----------------------------
+bool VCDWriter::_change(VarId id, TimeStamp timestamp, int64_t value)
+{
+    if (_filtered(id))
+        return false;
+    const VCDVariable &var = _prepare_change(id, timestamp);
+    var.pack(value, _packed.data());
+    return _update_value(id, var);
+}
+
+// -----------------------------
+uint64_t* VCDWriter::_prepare_typed(VarId id, TimeStamp timestamp, size_t n_words)
+{
+    // a handle of another writer
+    if (id < _vars_list.size() && _vars_prevs_offs[id + 1] - _vars_prevs_offs[id] != n_words)
+        throw VCDTypeException{ format("Invalid handle of var '%s'", _vars_list[id]->_name.data()) };
+    _prepare_change(id, timestamp);
+    return _vars_prevs.data() + _vars_prevs_offs[id];
+}
+
+// -----------------------------
+void VCDWriter::_emit(VarId id, std::string_view record)
+{
+    // plain copies, no formatting
+    const StatsMark mark = _stats_record_mark();
+    _ofile->record(record, _vars_list[id]->code());
+    _stats_record(id, mark);
+}
+
+// -----------------------------
+void VCDWriter::_throw_not_fits(VarId id, unsigned bits) const
+{
+    const char *name = (id < _vars_list.size()) ? _vars_list[id]->_name.data() : "";
+    throw VCDTypeException{ format("Integer value does not fit var '%s' size '%d'", name, bits) };
+}
+
+// -----------------------------
+bool VCDWriter::change(ScalarHandle var, TimeStamp timestamp, char value)
+{
+    const int code = packed::code(value);
+    if (code < 0)
+        throw VCDTypeException{ format("Invalid scalar value '%c'", value) };
+    return _change_scalar(var, timestamp, unsigned(code));
+}
+
+// -----------------------------
+bool VCDWriter::_change_scalar(ScalarHandle var, TimeStamp timestamp, unsigned code)
+{
+    if (_filtered(var._id))
+        return false;
+    uint64_t *prev = _prepare_typed(var._id, timestamp, 1u);
+    if (*prev == code)
+        return false;
+    *prev = code;
+    if (_dump_change(var._id, prev))
+    {
+        const std::array<char, 3> record{ 'b', packed::STATES[code], ' ' };
+        if (var._vector)
+            _emit(var._id, std::string_view(record.data(), 3u));
+        else
+            _emit(var._id, std::string_view(record.data() + 1, 1u));
+    }
+    return true;
+}
+
+// -----------------------------
+bool VCDWriter::change(RealHandle var, TimeStamp timestamp, double value)
+{
+    if (_filtered(var._id))
+        return false;
+    if (var._id < _vars_list.size() && _vars_list[var._id]->_type != VariableType::real)
+        throw VCDTypeException{ format("Invalid handle of var '%s'", _vars_list[var._id]->_name.data()) };
+    uint64_t *prev = _prepare_typed(var._id, timestamp, 1u);
+    uint64_t bits = 0;
+    std::memcpy(&bits, &value, sizeof(value));
+    if (*prev == bits)
+        return false;
+    *prev = bits;
+    // the same as `VCDRealVariable::change_record()`
+    if (_dump_change(var._id, prev))
+    {
+        const StatsMark mark = _stats_record_mark();
+        _ofile->real_record(value, _vars_list[var._id]->code());
+        _stats_record(var._id, mark);
+    }
+    return true;
+}
+
+// -----------------------------
+bool VCDWriter::change(StringHandle var, TimeStamp timestamp, std::string_view value)
+{
+    if (_filtered(var._id))
+        return false;
+    if (var._id < _vars_list.size() && _vars_list[var._id]->_type != VariableType::string)
+        throw VCDTypeException{ format("Invalid handle of var '%s'", _vars_list[var._id]->_name.data()) };
+    if (value.find(' ') != std::string_view::npos)
+        throw VCDTypeException{ format("Invalid string value '%s'", std::string(value).c_str()) };
+    _prepare_typed(var._id, timestamp, 1u);
+    return _update_string(var._id, *_vars_list[var._id], value);
+}
+
+// -----------------------------
+void VCDWriter::_value_record(VarId id, VarValue &record) const
+{
+    const VCDVariable &var = *_vars_list[id];
+    const uint64_t *value = _vars_prevs.data() + _vars_prevs_offs[id];
+    if (var._type == VariableType::string)
+        VCDStringVariable::change_record(_strings_prevs[*value], record);
+    else
+        var.change_record(value, record);
+}
+
+// -----------------------------
+bool VCDWriter::change(const std::string &scope, const std::string &name, TimeStamp timestamp, const VarValue &value)
+{
+    return _change(var(scope, name)->_ident, timestamp, value);
+}
+
+// -----------------------------
+VarId VCDWriter::var_id(VarPtr var) const
+{
+    if (!var)
+        throw VCDTypeException{ "Invalid VCDVariable" };
+    if ((var->_ident >= _vars_list.size() && !_filtered(var->_ident)) || _variable(var->_ident) != var.get())
+        throw VCDTypeException{ format("VCDVariable '%s' do not registered", var->_name.data()) };
+    return var->_ident;
+}
+
+// -----------------------------
+ScalarHandle VCDWriter::scalar_handle(VarPtr var) const
+{
+    const VarId id = var_id(var);
+    const bool vector = (var->_kind == VCDVariable::Kind::vector);
+    if (var->_size != 1 || var->_type == VariableType::event || !(vector || var->_kind == VCDVariable::Kind::scalar))
+        throw VCDTypeException{ format("Var '%s' is not a scalar", var->_name.data()) };
+    return ScalarHandle(id, vector);
+}
+
+// -----------------------------
+VarId VCDWriter::_vector_id(VarPtr var, unsigned size) const
+{
+    const VarId id = var_id(var);
+    if (var->_kind != VCDVariable::Kind::vector || var->_size != size)
+        throw VCDTypeException{ format("Var '%s' is not a vector of size '%u'", var->_name.data(), size) };
+    return id;
+}
+
+// -----------------------------
+RealHandle VCDWriter::real_handle(VarPtr var) const
+{
+    const VarId id = var_id(var);
+    if (var->_type != VariableType::real)
+        throw VCDTypeException{ format("Var '%s' is not a real", var->_name.data()) };
+    return RealHandle(id);
+}
+
+// -----------------------------
+StringHandle VCDWriter::string_handle(VarPtr var) const
+{
+    const VarId id = var_id(var);
+    if (var->_type != VariableType::string)
+        throw VCDTypeException{ format("Var '%s' is not a string", var->_name.data()) };
+    return StringHandle(id);
+}
+
+// -----------------------------
+void VCDWriter::set_var_frequency(VarPtr var, unsigned frequency)
+{
+    const VarId id = var_id(var);
+    if (!_registering)
+        throw VCDPhaseException{ format("Cannot hint var '%s', registering finished", var->_name.data()) };
+    if (_filtered(id))
+        return;
+    if (_vars_freqs.size() <= id)
+        _vars_freqs.resize(_vars_list.size());
+    _vars_freqs[id] = frequency;
+}
+
+// -----------------------------
+VarPtr VCDWriter::var(const std::string &scope, const std::string &name) const
+{
+    const VCDScope *s = _scopes->find(scope, _scope_sep);
+    if (s)
+    {
+        _index_vars();
+        auto it = _vars.find(VarKey{ s, name });
+        if (it != _vars.end())
+            return VarPtr(_variable(it->second));
+    }
+    throw VCDPhaseException{ format("The var '%s' in scope '%s' does not exist", name.c_str(), scope.c_str()) };
+}
+
+// -----------------------------
+void VCDWriter::set_scope_type(std::string &scope, ScopeType scope_type)
+{
+    VCDScope *s = _scopes->find(scope, _scope_sep);
+    if (!s || !s->has_vars)
+        throw VCDPhaseException{ format("Such scope '%s' does not exist", scope.c_str()) };
+    s->type = scope_type;
+}
+
+
+// -----------------------------
+void VCDWriter::_dump_off(TimeStamp timestamp)
+{
+    _ofile->timestamp(timestamp);
+    const StatsMark mark = _stats_mark();
+    _ofile->print("$dumpoff\n");
+    _write_values(true);
+    _ofile->print("$end\n");
+    _stats_add(_stats.dump_bytes, _stats.format_ns, mark);
+}
+
+// -----------------------------
+void VCDWriter::_dump_values(const char *keyword)
+{
+    const StatsMark mark = _stats_mark();
+    _ofile->print("{:s}\n", keyword);
+    if(!_dumping)
+    {
+        _stats_add(_stats.dump_bytes, _stats.format_ns, mark);
+        return;
+    }
+    _write_values(false);
+    _ofile->print("$end\n");
+    _stats_add(_stats.dump_bytes, _stats.format_ns, mark);
+}
+
+// -----------------------------
+// The longest real of "%.16g": "-1.234567890123456e-308"
+static constexpr size_t MAX_REAL = 24;
+
+// -----------------------------
+void VCDWriter::_write_values(bool undef)
+{
+    // the records are formatted in place, the output is reserved once for a chunk
+    // of them (the output buffer has 1/8 of its size spare, it does not grow)
+    const size_t chunk = _options.buffer_size / 8;
+    char *p = nullptr;
+    char *end = nullptr;
+    for (VarId id = 0; id < _dump_slots.size(); ++id)
+    {
+        const DumpSlot &slot = _dump_slots[id];
+        const size_t n_bytes = _value_bytes(id, slot);
+        if (size_t(end - p) < n_bytes)
+        {
+            if (p)
+                _ofile->commit(p);
+            p = _ofile->reserve(std::max(chunk, n_bytes));
+            end = p + std::max(chunk, n_bytes);
+        }
+        p = _format_value(id, slot, undef || (!_vars_modes.empty() && (_vars_modes[id] & VAR_OFF)), p);
+    }
+    if (p)
+        _ofile->commit(p);
+}
+
+// -----------------------------
+size_t VCDWriter::_value_bytes(VarId id, const DumpSlot &slot) const
+{
+    // the type of record (or the scalar state), the code and '\n', "bx " fits any vector
+    size_t n_bytes = slot.code_size + 2u;
+    switch (VCDVariable::Kind(slot.kind))
+    {
+    case VCDVariable::Kind::vector: n_bytes += slot.size + 1u; break;
+    case VCDVariable::Kind::real:   n_bytes += MAX_REAL + 1u; break;
+    case VCDVariable::Kind::string: n_bytes += _strings_prevs[_vars_prevs[_vars_prevs_offs[id]]].size() + 1u; break;
+    default: break;
+    }
+    return n_bytes;
+}
+
+// -----------------------------
+char* VCDWriter::_format_value(VarId id, const DumpSlot &slot, bool undef, char *p) const
+{
+    const uint64_t *value = _vars_prevs.data() + _vars_prevs_offs[id];
+    switch (VCDVariable::Kind(slot.kind))
+    {
+    case VCDVariable::Kind::scalar:
+        *p++ = undef ? char(VCDValues::UNDEF) : packed::STATES[value[0] & 3u];
+        break;
+    case VCDVariable::Kind::vector:
+        // the same as `change_record()` and `undef_record()`
+        *p++ = 'b';
+        if (undef)
+            *p++ = VCDValues::UNDEF;
+        else
+        {
+            packed::kernels().render(value, slot.size, p);
+            p += slot.size;
+        }
+        *p++ = ' ';
+        break;
+    case VCDVariable::Kind::real:
+        // reals have no unknown state, the same as "r%.16g "
+        if (undef)
+            return p;
+        {
+            double real = 0.;
+            std::memcpy(&real, value, sizeof(real));
+            *p++ = 'r';
+            p = std::to_chars(p, p + MAX_REAL, real, std::chars_format::general, 16).ptr;
+            *p++ = ' ';
+        }
+        break;
+    case VCDVariable::Kind::string:
+        if (undef)
+            *p++ = VCDValues::UNDEF;
+        else
+        {
+            const VarValue &str = _strings_prevs[value[0]];
+            *p++ = 's';
+            p = std::copy(str.begin(), str.end(), p);
+            *p++ = ' ';
+        }
+        break;
+    default:
+        // events have no value to dump
+        return p;
+    }
+    p = std::copy_n(slot.code.data(), slot.code_size, p);
+    *p++ = '\n';
+    return p;
+}
+
+// -----------------------------
+void VCDWriter::_scope_declaration(std::string_view scope_name, ScopeType type)
+{
+    static constexpr std::array<const char*, 5> SCOPE_TYPES = { "begin", "fork", "function", "module", "task" };
+    _ofile->print("$scope {:s} {:s} $end\n", SCOPE_TYPES[int(type)], scope_name);
+}
+
+// -----------------------------
+// Nested scopes to declare in header: sorted by name, the scopes
+// without vars (left by failed registrations) are skipped
+static std::vector<VCDScope*> sorted_children(const VCDScope &scope)
+{
+    std::vector<VCDScope*> children;
+    for (VCDScope *s = scope.children; s; s = s->next)
+        if (s->has_vars)
+            children.push_back(s);
+    std::sort(children.begin(), children.end(),
+              [](const VCDScope *a, const VCDScope *b) { return a->name < b->name; });
+    return children;
+}
+
+// -----------------------------
+void VCDWriter::_write_header()
+{
+    const StatsMark mark = _stats_mark();
+    for (int i = 0; i < VCDHeader::KW_COUNT_; ++i)
+    {
+        auto kwname = VCDHeader::kw_names[i];
+        auto kwvalue = _header->kw_values[i];
+        if (kwvalue.empty())
+            continue;
+        replace_new_lines(kwvalue, "\n\t");
+        _ofile->print("{:s} {:s} $end\n", kwname, kwvalue.c_str());
+    }
+
+    for (VCDScope *s : sorted_children(_scopes->root()))
+        _write_scope(*s);
+
+    _ofile->print("$enddefinitions $end\n");
+    _stats_add(_stats.header_bytes, _stats.header_ns, mark);
+    // do not need anymore (but by the next segments)
+    if (!_segmented())
+        _header.reset(nullptr);
+}
+
+// -----------------------------
+void VCDWriter::_write_scope(VCDScope &scope)
+{
+    _scope_declaration(scope.name, scope.type);
+    // dump variable declartion (the same as `declartion()`)
+    for (const VCDVariable *var = scope.vars; var; var = var->_next)
+        _ofile->print("$var {:s} {:d} {:s} {:s} $end\n", VCDVariable::VAR_TYPES[int(var->_type)],
+                      var->_size, var->code(), var->_name);
+    for (VCDScope *s : sorted_children(scope))
+        _write_scope(*s);
+    _ofile->print("$upscope $end\n");
+}
+
+// -----------------------------
+void VCDWriter::_assign_codes()
+{
+    _vars_freqs.resize(_vars_list.size());
+    std::vector<VarId> order(_vars_list.size());
+    std::iota(order.begin(), order.end(), VarId(0));
+    std::stable_sort(order.begin(), order.end(),
+                     [this](VarId a, VarId b) { return _vars_freqs[a] > _vars_freqs[b]; });
+    for (size_t i = 0; i < order.size(); ++i)
+        _vars_list[order[i]]->set_code(unsigned(i));
+    _vars_freqs = {};
+}
+
+// -----------------------------
+void VCDWriter::_finalize_registration()
+{
+    assert(_registering);
+    if (!_vars_freqs.empty())
+        _assign_codes();
+    if (!_vars_modes.empty())
+        _vars_modes.resize(_vars_list.size());
+    _dump_slots.resize(_vars_list.size());
+    for (VarId id = 0; id < _vars_list.size(); ++id)
+    {
+        const VCDVariable &var = *_vars_list[id];
+        const uint8_t kind = (var._type == VariableType::event) ? DumpSlot::EVENT : uint8_t(var._kind);
+        _dump_slots[id] = DumpSlot{ var._code, var._code_size, kind, var._size };
+    }
+    if (_window)
+    {
+        // nothing is written until the window is dumped
+        _window->start = _timestamp;
+        _window->dumping = _dumping;
+        _window->prevs = _vars_prevs;
+        _window->strings = _strings_prevs;
+        _registering = false;
+        return;
+    }
+    _write_start();
+    _registering = false;
+}
+
+// -----------------------------
+void VCDWriter::_write_start()
+{
+    _write_header();
+    if (_vars_list.size())
+    {
+        if (_index && _dumping)
+        {
+            // the first checkpoint is `$dumpvars`
+            _index_offset = _ofile->bytes();
+            _index_timestamp = _timestamp;
+            std::array<char, 48> entry{};
+            const int n = std::snprintf(entry.data(), entry.size(), "%u %zu\n", _timestamp, _index_offset);
+            _index->write(entry.data(), size_t(n));
+        }
+        _ofile->timestamp(_timestamp);
+        _dump_values("$dumpvars");
+        if (!_dumping)
+            _dump_off(_timestamp);
+    }
+}
+
+// -----------------------------
+VCDVariable::VCDVariable(std::string_view name, VariableType type, unsigned size, const VCDScope *scope, unsigned next_var_id, Kind kind) :
+    _ident(next_var_id), _code{}, _code_size{}, _type(type), _kind(kind), _name(name), _size(size), _scope(scope)
+{
+    set_code(next_var_id);
+}
+
+// -----------------------------
+void VCDVariable::set_code(unsigned id)
+{
+    const std::string code = ident_code(id);  // short string, no allocations
+    _code_size = uint8_t(code.size());
+    _code.fill('\0');
+    std::copy(code.begin(), code.end(), _code.begin());
+}
+
+// -----------------------------
+void VCDVariable::check_fits(const uint64_t *words, size_t n_words, unsigned bits) const
+{
+    for (size_t w = bits / 64; w < n_words; ++w)
+    {
+        const uint64_t extra = (w == bits / 64) ? (words[w] >> (bits % 64)) : words[w];
+        if (extra)
+            throw VCDTypeException{ format("Integer value does not fit var '%s' size '%d'", _name.data(), bits) };
+    }
+}
+
+// -----------------------------
+void VCDVariable::pack(int64_t value, uint64_t *packed) const
+{
+    uint64_t word = 0;
+    if (!twos_complement(value, _size, word))
+        throw VCDTypeException{ format("Integer value does not fit var '%s' size '%d'", _name.data(), _size) };
+    pack(&word, 1u, packed);
+}
+
+// -----------------------------
+std::string VCDVariable::declartion() const
+{
+    return format("$var %s %d %s %s $end", VAR_TYPES[int(_type)].c_str(), _size, _code.data(), _name.data());
+}
+
+// -----------------------------
+//  :Warning: *value* is string where all characters must be one of `VCDValues`.
+//  An empty  *value* is the same as `VCDValues::UNDEF`, a shorter one is
+//  aligned to the right and padded with `VCDValues::ZERO`
+void VCDVectorVariable::pack(const VarValue &value, uint64_t *packed) const
+{
+    if (value.size() > _size)
+        throw VCDTypeException{ format("Invalid binary vector value '%s' size '%d'", value.c_str(), _size) };
+
+    const auto n_words = packed_words();
+    if (value.empty())
+    {
+        std::fill(packed, packed + n_words, packed::ALL_UNDEF);
+        if (_size % packed::BITS_PER_WORD)
+            packed[n_words - 1] &= (uint64_t(1) << (2 * (_size % packed::BITS_PER_WORD))) - 1u;
+        return;
+    }
+
+    std::fill(packed, packed + n_words, 0u);
+    // value[0] is the most significant bit
+    if (!packed::kernels().pack(value.data(), value.size(), packed))
+        throw VCDTypeException{ format("Invalid binary vector value '%s' size '%d'", value.c_str(), _size) };
+}
+
+// -----------------------------
+void VCDVectorVariable::pack(const uint64_t *words, size_t n_words, uint64_t *packed) const
+{
+    check_fits(words, n_words, _size);
+
+    const auto n_packed = packed_words();
+    for (auto j = 0u; j < n_packed; ++j)
+    {
+        const size_t w = j / 2;
+        const auto half = (w < n_words) ? uint32_t(words[w] >> (32 * (j % 2))) : 0u;
+        packed[j] = packed::spread(half);
+    }
+}
+
+// -----------------------------
+void VCDVectorVariable::pack(int64_t value, uint64_t *packed) const
+{
+    VCDVariable::pack(value, packed);
+    if (value >= 0)
+        return;
+    // the sign extends to the bits above 64
+    for (auto j = 2u; j < packed_words(); ++j)
+    {
+        const unsigned bits = std::min(_size - j * packed::BITS_PER_WORD, packed::BITS_PER_WORD);
+        packed[j] = packed::spread((bits < 32) ? (1u << bits) - 1u : ~0u);
+    }
+}
+
+// -----------------------------
+void VCDVectorVariable::change_record(const uint64_t *packed, VarValue &record) const
+{
+    record.resize(_size + 2);
+    record[0] = 'b';
+    // the most significant bit goes first
+    packed::kernels().render(packed, _size, &record[1]);
+    record[_size + 1] = ' ';
 }
 
 // -----------------------------
@@ -14,8 +14,8 @@ int main()
     {
         const int c_val = 10 + timestamp * 2;
         const int v_val = 11 + timestamp * 2;
-        writer.change(counter_var, timestamp, std::bitset<8>(c_val).to_string());
-        writer.change(var_var, timestamp, std::bitset<8>(v_val).to_string());
+        writer.change(counter_var, timestamp, c_val);
+        writer.change(var_var, timestamp, std::bitset<8>(v_val));
     }
     return 0;
 }
@@ -0,0 +1,106 @@
+// Micro-benchmark of the 4-state vector kernels against the
+// character by character loop of the former `change_record()`
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+#include "vcd_packed.h"
+
+using namespace vcd;
+using Clock = std::chrono::steady_clock;
+
+// -----------------------------
+// The former validation, lowercasing and aligning of vector value
+static std::string legacy_record(const std::string &value, unsigned size)
+{
+    std::string val = ('b' + value + ' ');
+    for (auto i = 1u; i <= value.size(); ++i)
+    {
+        val[i] = static_cast<char>(tolower(static_cast<unsigned char>(val[i])));
+        switch (val[i])
+        {
+        case VCDValues::ONE:
+        case VCDValues::ZERO:
+        case VCDValues::UNDEF:
+        case VCDValues::HIGHV:
+            break;
+        default:
+            throw VCDTypeException{ "Invalid binary vector value" };
+        }
+    }
+    if (value.size() < size)
+        val.insert(1, size - value.size(), VCDValues::ZERO);
+    return val;
+}
+
+// -----------------------------
+template <typename F>
+static double ns_per_call(size_t iters, F &&f)
+{
+    const auto beg = Clock::now();
+    for (size_t i = 0; i < iters; ++i)
+        f(i);
+    const std::chrono::duration<double, std::nano> dt = Clock::now() - beg;
+    return dt.count() / double(iters);
+}
+
+// -----------------------------
+int main()
+{
+    const char *ISA_NAMES[] = { "scalar", "sse2", "avx2" };
+    const unsigned sizes[] = { 64, 256, 1024, 4096 };
+    const size_t n_values = 64;
+    std::mt19937 rng(42);
+
+    std::printf("best isa: %s\n", ISA_NAMES[int(packed::best_isa())]);
+    std::printf("%-6s %-7s %12s %12s %12s %9s\n", "bits", "isa", "legacy ns", "pack ns", "render ns", "speedup");
+
+    volatile size_t sink = 0;
+    for (unsigned size : sizes)
+    {
+        std::vector<std::string> values(n_values, std::string(size, VCDValues::ZERO));
+        for (auto &v : values)
+            for (auto &c : v)
+                c = "01xzXZ"[rng() % 6];
+
+        const size_t iters = (size_t(1) << 24) / size;
+        const double legacy = ns_per_call(iters, [&](size_t i) {
+            sink = sink + legacy_record(values[i % n_values], size).size();
+        });
+
+        const unsigned n_words = packed::words(size);
+        std::vector<uint64_t> words(n_words);
+        std::string record(size, ' '), expected;
+        for (int isa = 0; isa <= int(packed::best_isa()); ++isa)
+        {
+            const auto &k = packed::kernels(packed::Isa(isa));
+            // check the kernels agree with the legacy loop
+            for (const auto &v : values)
+            {
+                std::fill(words.begin(), words.end(), 0u);
+                k.pack(v.data(), v.size(), words.data());
+                k.render(words.data(), size, &record[0]);
+                expected = legacy_record(v, size);
+                if (expected.compare(1, size, record) != 0)
+                {
+                    std::printf("MISMATCH: %s kernels, %u bits\n", ISA_NAMES[isa], size);
+                    return 1;
+                }
+            }
+            const double pack = ns_per_call(iters, [&](size_t i) {
+                const auto &v = values[i % n_values];
+                std::fill(words.begin(), words.end(), 0u);
+                sink = sink + k.pack(v.data(), v.size(), words.data());
+            });
+            const double render = ns_per_call(iters, [&](size_t i) {
+                k.render(words.data(), size, &record[0]);
+                sink = sink + size_t(record[i % size]);
+            });
+            std::printf("%-6u %-7s %12.1f %12.1f %12.1f %8.1fx\n",
+                        size, ISA_NAMES[isa], legacy, pack, render, legacy / (pack + render));
+        }
+    }
+    return 0;
+}
@@ -1,15 +1,28 @@
 #include <fstream>
+#include <sstream>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
 #include <vcd_writer.h>
+#include <vcd_reader.h>
+#include <vcd_packed.h>
 #include <gtest/gtest.h>
+#ifdef VCDWRITER_WITH_ZLIB
+#include <zlib.h>
+#endif
+#ifdef VCDWRITER_WITH_FST
+#include <fstapi.h>
+#endif
 
 using namespace vcd;
 
 // -----------------------------
 
 // Read the contents to the output file
-static std::string read_file()
+static std::string read_file(const std::string &filename = "test.vcd")
 {
-    std::ifstream file("test.vcd");
+    std::ifstream file(filename);
     EXPECT_TRUE(file.is_open());
     std::string contents((std::istreambuf_iterator<char>(file)),
                          std::istreambuf_iterator<char>());
@@ -173,6 +186,404 @@ TEST_F(VCDWriterFixture, RegisterVariables)
     EXPECT_THROW(writer->change(scope, next_name, timestamp, value), VCDException);
 }
 
+TEST_F(VCDWriterFixture, VarHandles)
+{
+    EXPECT_FALSE(VarPtr{});
+    VarPtr first = writer->register_var(scope, "v0", VariableType::wire, 4);
+    // the handles stay valid while the arena grows
+    for (unsigned i = 1; i < 20000; ++i)
+        writer->register_var(scope + ".u" + std::to_string(i % 100), "v" + std::to_string(i), VariableType::wire, 4);
+    VarPtr copy = first;
+    EXPECT_TRUE(copy);
+    EXPECT_EQ(copy, first);
+    EXPECT_EQ(writer->var(scope, "v0"), first);
+    EXPECT_NE(writer->var(scope + ".u1", "v1"), first);
+    EXPECT_EQ(writer->var_id(writer->var(scope + ".u99", "v19999")), 19999u);
+    EXPECT_TRUE(writer->change(first, 1, "101"));
+}
+
+TEST_F(VCDWriterFixture, ChangeById)
+{
+    VarPtr var = writer->register_var(scope, name, VariableType::wire, 2);
+    VarPtr next_var = writer->register_var(scope, next_name, VariableType::wire, 2);
+    const VarId id = writer->var_id(next_var);
+    // Identifiers are dense
+    EXPECT_EQ(writer->var_id(var), 0u);
+    EXPECT_EQ(id, 1u);
+
+    EXPECT_TRUE(writer->change(id, 1, "10"));
+    EXPECT_FALSE(writer->change(id, 2, "10"));
+    EXPECT_TRUE(writer->change(var, 2, "01"));
+    // No such an identifier
+    EXPECT_THROW(writer->change(VarId(2), 2, "1"), VCDTypeException);
+    writer->flush();
+
+    const std::string contents = read_file();
+    EXPECT_NE(contents.find("#1\nb10 \"\n#2\nb01 !\n"), std::string::npos);
+}
+
+TEST(VCDUtilsTest, IdentCode)
+{
+    EXPECT_EQ(utils::ident_code(0), "!");
+    EXPECT_EQ(utils::ident_code(93), "~");
+    EXPECT_EQ(utils::ident_code(94), "!!");
+    EXPECT_EQ(utils::ident_code(94 + 94 * 94 - 1), "~~");
+    EXPECT_EQ(utils::ident_code(94 + 94 * 94), "!!!");
+
+    std::unordered_set<std::string> codes;
+    for (unsigned id = 0; id < 20000; ++id)
+        EXPECT_TRUE(codes.insert(utils::ident_code(id)).second);
+    // a million signals need at most 4 characters
+    EXPECT_EQ(utils::ident_code(1000000).size(), 4u);
+}
+
+TEST(VCDPackedTest, KernelsOfAllIsa)
+{
+    const char *ISA_NAMES[] = { "scalar", "sse2", "avx2" };
+    // the tails of vector registers of each width
+    const unsigned sizes[] = { 1, 2, 7, 15, 16, 17, 31, 32, 33, 63, 64, 65, 127, 128, 129, 255, 256, 257, 1000 };
+    for (int isa = 0; isa <= int(packed::best_isa()); ++isa)
+    {
+        const packed::Kernels &k = packed::kernels(packed::Isa(isa));
+        for (unsigned size : sizes)
+        {
+            SCOPED_TRACE(std::string(ISA_NAMES[isa]) + " kernels, " + std::to_string(size) + " bits");
+            std::string value(size, '0'), lower(size, '0');
+            for (unsigned i = 0; i < size; ++i)
+            {
+                value[i] = "01xzXZ"[(i * 7 + size) % 6];
+                lower[i] = char(std::tolower(value[i]));
+            }
+            std::vector<uint64_t> words(packed::words(size));
+            EXPECT_TRUE(k.pack(value.data(), size, words.data()));
+            // the most significant goes first
+            std::string states(size, ' ');
+            for (unsigned i = 0; i < size; ++i)
+                states[i] = packed::state(words.data(), size - 1 - i);
+            EXPECT_EQ(states, lower);
+
+            std::string rendered(size, ' ');
+            k.render(words.data(), size, &rendered[0]);
+            EXPECT_EQ(rendered, lower);
+
+            // an invalid character at the beginning, in the middle and in the tail
+            for (unsigned pos : { 0u, size / 2, size - 1 })
+                for (char c : { '2', 'a', 'Y', ' ', '\0', char(0x80 | '1') })
+                {
+                    std::string invalid = value;
+                    invalid[pos] = c;
+                    std::fill(words.begin(), words.end(), 0u);
+                    EXPECT_FALSE(k.pack(invalid.data(), size, words.data())) << "at " << pos << " '" << int(c) << "'";
+                }
+        }
+    }
+}
+
+TEST_F(VCDWriterFixture, VarFrequency)
+{
+    VarPtr rare = writer->register_var(scope, "rare");
+    VarPtr often = writer->register_var(scope, "often");
+    VarPtr always = writer->register_var(scope, "always");
+    writer->set_var_frequency(often, 10);
+    writer->set_var_frequency(always, 100);
+    writer->change(always, 1, "1");
+    // The codes are assigned at the end of registration
+    EXPECT_THROW(writer->set_var_frequency(rare, 1000), VCDPhaseException);
+    writer->flush();
+
+    const std::string contents = read_file();
+    EXPECT_NE(contents.find("$var integer 64 ! always $end\n"), std::string::npos);
+    EXPECT_NE(contents.find("$var integer 64 \" often $end\n"), std::string::npos);
+    EXPECT_NE(contents.find("$var integer 64 # rare $end\n"), std::string::npos);
+    EXPECT_NE(contents.find("#1\nb" + std::string(63, '0') + "1 !\n"), std::string::npos);
+}
+
+// -----------------------------
+
+static std::vector<VarSpec> signal_table()
+{
+    std::vector<VarSpec> specs;
+    for (int i = 0; i < 50; ++i)
+    {
+        const std::string scope = "top.u" + std::to_string(i % 7) + ((i % 3) ? ".sub" : "");
+        specs.push_back({ scope, "w" + std::to_string(i), VariableType::wire, unsigned(i % 5 + 1) });
+    }
+    specs.push_back({ "top", "clk", VariableType::integer, 1, "0" });
+    specs.push_back({ "top", "r", VariableType::real });
+    specs.push_back({ "top", "s", VariableType::string, 0, "idle" });
+    specs.push_back({ "top", "e", VariableType::event });
+    return specs;
+}
+
+static void write_table(const std::string &filename, bool bulk)
+{
+    HeadPtr header = makeVCDHeader(TimeScale::ONE, TimeScaleUnit::ns, "2024-05-21 22:16:16");
+    VCDWriter writer(filename, header);
+    const auto specs = signal_table();
+    std::vector<VarId> ids;
+    if (bulk)
+        ids = writer.register_vars(specs);
+    else
+        for (const auto &spec : specs)
+            ids.push_back(writer.var_id(writer.register_var(spec.scope, spec.name, spec.type, spec.size, spec.init)));
+    for (size_t i = 0; i < 50; ++i)
+        writer.change(ids[i], 1, unsigned(i % 2));
+    writer.change(ids[52], 2, "busy");
+    writer.change(ids[53], 2, "1");
+}
+
+TEST(VCDWriterTest, RegisterVarsEqualsSingle)
+{
+    write_table("single.vcd", false);
+    write_table("bulk.vcd", true);
+    EXPECT_EQ(read_file("bulk.vcd"), read_file("single.vcd"));
+}
+
+static void write_typed(const std::string &filename, bool typed)
+{
+    HeadPtr header = makeVCDHeader(TimeScale::ONE, TimeScaleUnit::ns, "2024-05-21 22:16:16");
+    VCDWriter writer(filename, header);
+    VarPtr bit = writer.register_var("top", "bit", VariableType::integer, 1);
+    VarPtr wire = writer.register_var("top", "wire", VariableType::wire, 1);
+    VarPtr bus = writer.register_var("top", "bus", VariableType::wire, 12);
+    VarPtr wide = writer.register_var("top", "wide", VariableType::reg, 100);
+    VarPtr real = writer.register_var("top", "real", VariableType::real);
+    VarPtr str = writer.register_var("top", "str", VariableType::string);
+    const std::array<uint64_t, 2> words{ 0x0123456789ABCDEFull, 0xFull };
+    for (TimeStamp t = 0; t < 4; ++t)
+    {
+        if (typed)
+        {
+            writer.change(writer.scalar_handle(bit), t, (t == 2) ? 'z' : char('0' + t % 2));
+            writer.change(writer.scalar_handle(wire), t, t % 2);
+            writer.change(writer.vector_handle<12>(bus), t, 0x800u >> t);
+            writer.change(writer.vector_handle<100>(wide), t, words);
+            writer.change(writer.real_handle(real), t, 0.25 * t);
+            writer.change(writer.string_handle(str), t, (t < 2) ? "idle" : "busy");
+        }
+        else
+        {
+            writer.change(bit, t, (t == 2) ? "z" : std::to_string(t % 2));
+            writer.change(wire, t, t % 2);
+            writer.change(bus, t, 0x800u >> t);
+            writer.change(wide, t, words.data(), words.size());
+            writer.change(real, t, std::to_string(0.25 * t));
+            writer.change(str, t, (t < 2) ? "idle" : "busy");
+        }
+        if (t == 1)
+            writer.dump_off(t);
+        if (t == 2)
+            writer.dump_on(t);
+    }
+}
+
+TEST(VCDWriterTest, TypedHandlesEqualVarPtr)
+{
+    write_typed("varptr.vcd", false);
+    write_typed("typed.vcd", true);
+    EXPECT_EQ(read_file("typed.vcd"), read_file("varptr.vcd"));
+}
+
+TEST_F(VCDWriterFixture, TypedHandlesInvalid)
+{
+    VarPtr bus = writer->register_var(scope, "bus", VariableType::wire, 8);
+    VarPtr real = writer->register_var(scope, "real", VariableType::real);
+    VarPtr event = writer->register_var(scope, "event", VariableType::event);
+    EXPECT_THROW(writer->scalar_handle(bus), VCDTypeException);
+    EXPECT_THROW(writer->scalar_handle(event), VCDTypeException);
+    EXPECT_THROW(writer->vector_handle<4>(bus), VCDTypeException);
+    EXPECT_THROW(writer->vector_handle<64>(real), VCDTypeException);
+    EXPECT_THROW(writer->string_handle(real), VCDTypeException);
+    EXPECT_THROW(writer->real_handle(VarPtr{}), VCDTypeException);
+
+    auto h = writer->vector_handle<8>(bus);
+    EXPECT_TRUE(writer->change(h, 1, 0xA5u));
+    EXPECT_FALSE(writer->change(h, 2, std::bitset<8>(0xA5u)));
+    EXPECT_THROW(writer->change(h, 2, 0x1A5u), VCDTypeException);
+    EXPECT_THROW(writer->change(writer->real_handle(real), 1, 1.), VCDPhaseException);
+    EXPECT_THROW(writer->change(VectorHandle<8>{}, 2, 1u), VCDTypeException);
+    writer->flush();
+    EXPECT_NE(read_file().find("#1\nb10100101 !\n"), std::string::npos);
+}
+
+static void write_batch(const std::string &filename, bool batch)
+{
+    HeadPtr header = makeVCDHeader(TimeScale::ONE, TimeScaleUnit::ns, "2024-05-21 22:16:16");
+    VCDWriter writer(filename, header);
+    std::vector<VarId> ids;
+    ids.push_back(writer.var_id(writer.register_var("top", "bit", VariableType::integer, 1)));
+    ids.push_back(writer.var_id(writer.register_var("top", "wire", VariableType::wire, 1)));
+    ids.push_back(writer.var_id(writer.register_var("top", "bus", VariableType::wire, 12)));
+    ids.push_back(writer.var_id(writer.register_var("top", "word", VariableType::reg, 64)));
+    for (TimeStamp t = 1; t < 5; ++t)
+    {
+        const std::vector<uint64_t> values{ t % 2, 1, 0x800u >> (t / 2), ~uint64_t(0) >> t };
+        if (batch)
+            writer.change_batch(t, ids, values);
+        else
+            for (size_t i = 0; i < ids.size(); ++i)
+                writer.change(ids[i], t, values[i]);
+        if (t == 2)
+            writer.dump_off(t);
+        if (t == 3)
+            writer.dump_on(t);
+    }
+}
+
+TEST(VCDWriterTest, ChangeBatchEqualsSingle)
+{
+    write_batch("single.vcd", false);
+    write_batch("batch.vcd", true);
+    EXPECT_EQ(read_file("batch.vcd"), read_file("single.vcd"));
+}
+
+TEST_F(VCDWriterFixture, ChangeBatchInvalid)
+{
+    const VarId bus = writer->var_id(writer->register_var(scope, "bus", VariableType::wire, 4));
+    const VarId wide = writer->var_id(writer->register_var(scope, "wide", VariableType::wire, 40));
+    const VarId real = writer->var_id(writer->register_var(scope, "real", VariableType::real));
+    const VarId event = writer->var_id(writer->register_var(scope, "event", VariableType::event));
+
+    EXPECT_THROW(writer->change_batch(1, { bus, real }, { 1, 1 }), VCDTypeException);
+    EXPECT_THROW(writer->change_batch(1, { bus, event }, { 1, 1 }), VCDTypeException);
+    EXPECT_THROW(writer->change_batch(1, { bus, 100 }, { 1, 1 }), VCDTypeException);
+    EXPECT_THROW(writer->change_batch(1, { bus, wide }, { 0x10, 1 }), VCDTypeException);
+    EXPECT_THROW(writer->change_batch(1, { bus }, { 1, 1 }), VCDTypeException);
+
+    // "1x0z" as the packed states and 40 ones
+    const uint64_t packed[] = { 0b01'10'00'11, 0x5555555555555555ull, 0x5555 };
+    const VarId ids[] = { bus, wide };
+    EXPECT_EQ(writer->change_batch_packed(2, ids, packed, 2), 2u);
+    EXPECT_EQ(writer->change_batch_packed(2, ids, packed, 2), 0u);
+    const uint64_t extra[] = { 0b01'01'10'00'11 };
+    EXPECT_THROW(writer->change_batch_packed(3, ids, extra, 1), VCDTypeException);
+    EXPECT_THROW(writer->change_batch(1, { bus }, { 1 }), VCDPhaseException);
+    writer->flush();
+    const auto contents = read_file();
+    EXPECT_EQ(contents.find("#1\n"), std::string::npos);  // nothing is changed by the invalid batches
+    EXPECT_NE(contents.find("#2\nb1x0z !\nb" + std::string(40, '1') + " \"\n"), std::string::npos);
+}
+
+// Register the vars one by one or by a table, change them by ids
+static void write_filtered(const std::string &filename, const VCDOptions &options,
+                           const std::vector<VarSpec> &specs, bool bulk)
+{
+    HeadPtr header = makeVCDHeader(TimeScale::ONE, TimeScaleUnit::ns, "2024-05-21 22:16:16");
+    VCDWriter writer(filename, header, options);
+    std::vector<VarId> ids;
+    if (bulk)
+        ids = writer.register_vars(specs);
+    else
+        for (const auto &spec : specs)
+            ids.push_back(writer.var_id(writer.register_var(spec.scope, spec.name, spec.type, spec.size)));
+    for (TimeStamp t = 1; t <= 20; ++t)
+        for (size_t i = 0; i < ids.size(); ++i)
+        {
+            if (specs[i].type == VariableType::string)
+                writer.change(ids[i], t, "s" + std::to_string(t % 3));
+            else
+                writer.change(ids[i], t, (t * (specs[i].size + 1)) & ((1u << specs[i].size) - 1u));
+        }
+}
+
+TEST(VCDWriterTest, FilterVars)
+{
+    const std::vector<VarSpec> specs = {
+        { "top", "clk", VariableType::wire, 1 },
+        { "top", "rst", VariableType::wire, 1 },
+        { "top.cpu", "pc", VariableType::wire, 16 },
+        { "top.cpu.alu", "dbg_a", VariableType::wire, 8 },
+        { "top.cpu.alu", "res", VariableType::wire, 8 },
+        { "top.mem", "addr", VariableType::wire, 16 },
+        { "top.mem", "state", VariableType::string, 1 },
+    };
+    VCDOptions options;
+    // the subtree of "top.cpu" and the clocks, without debug vars
+    options.include_vars = { "top.cpu", "re:.*\\.clk" };
+    options.exclude_vars = { "*.dbg_?" };
+    write_filtered("filtered.vcd", options, specs, false);
+    write_filtered("filtered_bulk.vcd", options, specs, true);
+    write_filtered("kept.vcd", VCDOptions{}, { specs[0], specs[2], specs[4] }, false);
+    const std::string kept = read_file("kept.vcd");
+    EXPECT_EQ(read_file("filtered.vcd"), kept);
+    EXPECT_EQ(read_file("filtered_bulk.vcd"), kept);
+    EXPECT_EQ(kept.find("mem"), std::string::npos);
+
+    HeadPtr header = makeVCDHeader();
+    VCDWriter writer("filtered.vcd", header, options);
+    VarPtr res = writer.register_var("top.cpu.alu", "res", VariableType::wire, 8);
+    VarPtr addr = writer.register_var("top.mem", "addr", VariableType::wire, 16);
+    VarPtr state = writer.register_var("top.mem", "state", VariableType::string, 1);
+    EXPECT_FALSE(writer.filtered(res));
+    EXPECT_TRUE(writer.filtered(addr));
+    EXPECT_EQ(writer.var("top.mem", "addr"), addr);
+    EXPECT_THROW(writer.register_var("top.mem", "addr", VariableType::wire, 16), VCDTypeException);
+    EXPECT_THROW(writer.register_var("top.mem", "size", VariableType::wire), VCDTypeException);
+    EXPECT_THROW(writer.vector_handle<8>(addr), VCDTypeException);
+    // the changes of the dropped vars are not even validated
+    EXPECT_FALSE(writer.change(addr, 1, 0xFFFFFu));
+    EXPECT_FALSE(writer.change(writer.vector_handle<16>(addr), 1, 5u));
+    EXPECT_FALSE(writer.change(writer.string_handle(state), 1, "busy"));
+    const VarId ids[] = { writer.var_id(res), writer.var_id(addr) };
+    const uint64_t values[] = { 3u, 7u };
+    EXPECT_EQ(writer.change_batch(2, ids, values, 2), 1u);
+    writer.producer().change(ids[1], 3, 1u);
+    EXPECT_EQ(writer.commit(3), 0u);
+
+    options.include_vars = { "re:(" };
+    EXPECT_THROW(VCDWriter("filtered.vcd", header, options), VCDTypeException);
+}
+
+TEST_F(VCDWriterFixture, RegisterVarsInvalid)
+{
+    writer->register_var("top.u1.sub", "w1", VariableType::wire, 2);
+    auto specs = signal_table();
+    // registered before
+    EXPECT_THROW(writer->register_vars(specs), VCDTypeException);
+    specs.erase(specs.begin() + 1);
+    specs.push_back(specs[10]);
+    // duplicate in the table
+    EXPECT_THROW(writer->register_vars(specs), VCDTypeException);
+    specs.pop_back();
+    specs.push_back({ "top", "no_size", VariableType::wire });
+    EXPECT_THROW(writer->register_vars(specs), VCDTypeException);
+    specs.back().size = 4;
+    specs.back().init = "12";
+    EXPECT_THROW(writer->register_vars(specs), VCDTypeException);
+    // nothing is registered by failed calls
+    EXPECT_THROW(writer->var("top", "clk"), VCDPhaseException);
+
+    specs.pop_back();
+    const auto ids = writer->register_vars(specs);
+    ASSERT_EQ(ids.size(), specs.size());
+    EXPECT_EQ(ids.front(), 1u);
+    EXPECT_EQ(writer->var_id(writer->var("top", "clk")), ids[specs.size() - 4]);
+    EXPECT_THROW(writer->register_var("top", "clk"), VCDTypeException);
+}
+
+TEST_F(VCDWriterFixture, RegisterVarsInvalidReal)
+{
+    // the packed values of a failed table are rolled back
+    EXPECT_THROW(writer->register_vars({ { "top", "a", VariableType::wire, 4 },
+                                         { "top", "r", VariableType::real, 0, "abc" } }), VCDTypeException);
+    EXPECT_THROW(writer->register_var("top", "r2", VariableType::real, 0, "1e999"), VCDTypeException);
+    VarPtr b = writer->register_var("top", "b", VariableType::wire, 4);
+    EXPECT_TRUE(writer->change(b, 1, 5u));
+    writer->flush();
+    EXPECT_NE(read_file().find("#1\nb0101 !\n"), std::string::npos);
+}
+
+TEST_F(VCDWriterFixture, ChangeForeignVar)
+{
+    HeadPtr other_header = makeVCDHeader();
+    VCDWriter other("other.vcd", other_header);
+    VarPtr foreign = other.register_var(scope, name);
+    writer->register_var(scope, name);
+    // The var is registered by other writer
+    EXPECT_THROW(writer->change(foreign, 1, "1"), VCDTypeException);
+    EXPECT_THROW(writer->change(VarPtr{}, 1, "1"), VCDTypeException);
+}
+
 TEST_F(VCDWriterFixture, ChangeVectorValue)
 {
     // Register a vector variable
@@ -185,6 +596,139 @@ TEST_F(VCDWriterFixture, ChangeVectorValue)
     EXPECT_TRUE(changed);
 }
 
+TEST_F(VCDWriterFixture, ChangeIntegerValue)
+{
+    VarPtr var = writer->register_var("my_scope", "my_vector", VariableType::wire, 4);
+    VarPtr bit = writer->register_var("my_scope", "my_bit", VariableType::wire, 1);
+    VarPtr real = writer->register_var("my_scope", "my_real", VariableType::real);
+    VarPtr str = writer->register_var("my_scope", "my_str", VariableType::string);
+
+    EXPECT_TRUE(writer->change(var, 1, 3));
+    // The same value given by a string
+    EXPECT_FALSE(writer->change(var, 2, "0011"));
+    EXPECT_TRUE(writer->change(var, 2, std::bitset<4>(0b1010)));
+    EXPECT_TRUE(writer->change(bit, 2, true));
+    EXPECT_TRUE(writer->change(real, 3, 7u));
+    // Does not fit
+    EXPECT_THROW(writer->change(var, 3, 16), VCDTypeException);
+    EXPECT_THROW(writer->change(bit, 3, 2), VCDTypeException);
+    EXPECT_THROW(writer->change(str, 3, 1), VCDTypeException);
+    writer->flush();
+
+    const std::string contents = read_file();
+    EXPECT_NE(contents.find("#1\nb0011 !\n#2\nb1010 !\nb1 \"\n#3\nr7 #\n"), std::string::npos);
+}
+
+TEST_F(VCDWriterFixture, ChangeWideValue)
+{
+    VarPtr var = writer->register_var("my_scope", "my_bus", VariableType::wire, 66);
+    const uint64_t words[] = { 1u, 2u };
+    EXPECT_TRUE(writer->change(var, 1, words, 2));
+    EXPECT_FALSE(writer->change(var, 2, std::bitset<66>("10" + std::string(63, '0') + "1")));
+    const uint64_t wider[] = { 0u, 4u };
+    EXPECT_THROW(writer->change(var, 2, wider, 2), VCDTypeException);
+    writer->flush();
+
+    const std::string contents = read_file();
+    EXPECT_NE(contents.find("#1\nb10" + std::string(63, '0') + "1 !\n"), std::string::npos);
+}
+
+TEST_F(VCDWriterFixture, ChangeNegativeValue)
+{
+    VarPtr var = writer->register_var("my_scope", "my_byte", VariableType::integer, 8);
+    VarPtr real = writer->register_var("my_scope", "my_real", VariableType::real);
+    VarPtr wide = writer->register_var("my_scope", "my_wide", VariableType::wire, 70);
+    const VarId id = writer->var_id(var);
+
+    // Two's complement of the size, reals are converted
+    EXPECT_TRUE(writer->change(var, 1, int8_t(-1)));
+    EXPECT_TRUE(writer->change(real, 1, -1));
+    EXPECT_TRUE(writer->change(wide, 1, -2));
+    EXPECT_TRUE(writer->change(var, 2, -128));
+    EXPECT_THROW(writer->change(var, 3, -129), VCDTypeException);
+    EXPECT_TRUE(writer->change(writer->vector_handle<8>(var), 3, -2));
+    EXPECT_THROW(writer->change(writer->vector_handle<8>(var), 3, -129), VCDTypeException);
+    EXPECT_TRUE(writer->change(writer->vector_handle<70>(wide), 3, int64_t(-4)));
+    const int64_t values[] = { -3 };
+    EXPECT_EQ(writer->change_batch(4, &id, values, 1), 1u);
+    const int64_t too_small[] = { -1000 };
+    EXPECT_THROW(writer->change_batch(5, &id, too_small, 1), VCDTypeException);
+    VCDProducer &producer = writer->producer();
+    producer.change(id, 5, -4);
+    EXPECT_THROW(producer.change(id, 5, -129), VCDTypeException);
+    EXPECT_EQ(writer->commit(5), 1u);
+    writer->flush();
+
+    const std::string contents = read_file();
+    EXPECT_NE(contents.find("#1\nb11111111 !\nr-1 \"\nb" + std::string(69, '1') + "0 #\n"
+                            "#2\nb10000000 !\n#3\nb11111110 !\nb" + std::string(68, '1') + "00 #\n"
+                            "#4\nb11111101 !\n#5\nb11111100 !\n"), std::string::npos);
+}
+
+TEST_F(VCDWriterFixture, ChangeFourStateValue)
+{
+    VarPtr var = writer->register_var("my_scope", "my_vector", VariableType::wire, 40);
+    VarPtr str = writer->register_var("my_scope", "my_str", VariableType::string);
+    VarPtr event = writer->register_var("my_scope", "my_event", VariableType::event);
+
+    EXPECT_TRUE(writer->change(var, 1, "1" + std::string(33, '0') + "xz"));
+    // Upper case is the same value
+    EXPECT_FALSE(writer->change(var, 2, "1" + std::string(33, '0') + "XZ"));
+    EXPECT_THROW(writer->change(var, 2, "2"), VCDTypeException);
+    EXPECT_TRUE(writer->change(str, 2, "hello"));
+    EXPECT_FALSE(writer->change(str, 2, "hello"));
+    // Events are always dumped
+    EXPECT_TRUE(writer->change(event, 2, "1"));
+    EXPECT_TRUE(writer->change(event, 3, "1"));
+    writer->flush();
+
+    const std::string contents = read_file();
+    EXPECT_NE(contents.find("$dumpvars\nb" + std::string(40, 'x') + " !\nsx \"\n$end\n"), std::string::npos);
+    EXPECT_NE(contents.find("#1\nb00001" + std::string(33, '0') + "xz !\n#2\nshello \"\n1#\n#3\n1#\n"),
+              std::string::npos);
+}
+
+TEST_F(VCDWriterFixture, ChangeEventOnly)
+{
+    // No var has a stored value: the packing goes on the buffer of a word
+    VarPtr event = writer->register_var("my_scope", "my_event", VariableType::event);
+    VCDProducer &producer = writer->producer();
+
+    EXPECT_TRUE(writer->change(event, 1, "1"));
+    EXPECT_TRUE(writer->change(writer->var_id(event), 2, "1"));
+    producer.change(writer->var_id(event), 3, "1");
+    EXPECT_EQ(writer->commit(3), 1u);
+    writer->flush();
+
+    EXPECT_NE(read_file().find("#1\n1!\n#2\n1!\n#3\n1!\n"), std::string::npos);
+}
+
+TEST_F(VCDWriterFixture, ChangeWideFourStateValue)
+{
+    const unsigned size = 300;
+    VarPtr var = writer->register_var("my_scope", "my_bus", VariableType::wire, size);
+    std::string expected;
+    // every length covers vector blocks and tails
+    for (unsigned len = 1; len <= size; ++len)
+    {
+        std::string value(len, VCDValues::ZERO);
+        for (unsigned i = 0; i < len; ++i)
+            value[i] = "01xzXZ"[(i * 7 + len) % 6];
+        value[0] = 'Z'; // never the same
+        EXPECT_TRUE(writer->change(var, len, value));
+
+        std::string lower(value);
+        for (auto &c : lower)
+            c = char(tolower(c));
+        expected += "#" + std::to_string(len) + "\nb" + std::string(size - len, '0') + lower + " !\n";
+    }
+    EXPECT_THROW(writer->change(var, size + 1, std::string(size - 1, '1') + "2"), VCDTypeException);
+    writer->flush();
+
+    const std::string contents = read_file();
+    EXPECT_NE(contents.find(expected), std::string::npos);
+}
+
 TEST_F(VCDWriterFixture, DumpValues)
 {
     // Register a variable
@@ -204,15 +748,44 @@ TEST_F(VCDWriterFixture, DumpValues)
     EXPECT_EQ(contents, "$timescale 1 ns $end\n"
         "$date 2024-05-21 22:16:16 $end\n"
         "$scope module my_scope $end\n"
-        "$var wire 1 0 my_var $end\n"
+        "$var wire 1 ! my_var $end\n"
         "$upscope $end\n"
         "$enddefinitions $end\n"
         "#0\n"
         "$dumpvars\n"
-        "bx 0\n"
+        "bx !\n"
         "$end\n"
         "#10\n"
-        "b1 0\n");
+        "b1 !\n");
+}
+
+TEST_F(VCDWriterFixture, DumpValuesInOrder)
+{
+    // more records than a chunk of output, in order of ids
+    std::vector<VarSpec> specs;
+    for (unsigned i = 0; i < 5000; ++i)
+        specs.push_back({ "top.regs", "r" + std::to_string(i), VariableType::wire, 16, std::bitset<16>(i).to_string() });
+    writer->register_vars(specs);
+    writer->register_var("top", "clk", VariableType::integer, 1, "1");
+    writer->register_var("top", "ev", VariableType::event);
+    writer->register_var("top", "temp", VariableType::real, 0, "2.5");
+    writer->register_var("top", "state", VariableType::string, 0, "idle");
+    writer->flush();
+    writer->dump_off(1);
+    writer->flush();
+
+    std::string values = "#0\n$dumpvars\n";
+    std::string undefs = "#1\n$dumpoff\n";
+    for (unsigned i = 0; i < 5000; ++i)
+    {
+        values += "b" + std::bitset<16>(i).to_string() + " " + utils::ident_code(i) + "\n";
+        undefs += "bx " + utils::ident_code(i) + "\n";
+    }
+    // events have no value, reals have no unknown state
+    values += "1" + utils::ident_code(5000) + "\nr2.5 " + utils::ident_code(5002) + "\nsidle " + utils::ident_code(5003) + "\n$end\n";
+    undefs += "x" + utils::ident_code(5000) + "\nx" + utils::ident_code(5003) + "\n$end\n";
+    const std::string contents = read_file();
+    EXPECT_EQ(contents.substr(contents.find("#0\n")), values + undefs);
 }
 
 TEST_F(VCDWriterFixture, FlushClose)
@@ -239,15 +812,15 @@ TEST_F(VCDWriterFixture, FlushClose)
     EXPECT_EQ(contents, "$timescale 1 ns $end\n"
         "$date 2024-05-21 22:16:16 $end\n"
         "$scope module my_scope $end\n"
-        "$var wire 1 0 my_var $end\n"
+        "$var wire 1 ! my_var $end\n"
         "$upscope $end\n"
         "$enddefinitions $end\n"
         "#0\n"
         "$dumpvars\n"
-        "bx 0\n"
+        "bx !\n"
         "$end\n"
         "#10\n"
-        "b1 0\n");
+        "b1 !\n");
 }
 
 TEST_F(VCDWriterFixture, SetScopeType)
@@ -268,12 +841,12 @@ TEST_F(VCDWriterFixture, SetScopeType)
     EXPECT_EQ(contents, "$timescale 1 ns $end\n"
         "$date 2024-05-21 22:16:16 $end\n"
         "$scope function my_scope $end\n"
-        "$var wire 1 0 my_var $end\n"
+        "$var wire 1 ! my_var $end\n"
         "$upscope $end\n"
         "$enddefinitions $end\n"
         "#0\n"
         "$dumpvars\n"
-        "bx 0\n"
+        "bx !\n"
         "$end\n");
 }
 
@@ -293,12 +866,12 @@ TEST_F(VCDWriterFixture, SetScopeDefaultType)
     EXPECT_EQ(contents, "$timescale 1 ns $end\n"
         "$date 2024-05-21 22:16:16 $end\n"
         "$scope fork my_scope $end\n"
-        "$var wire 1 0 my_var $end\n"
+        "$var wire 1 ! my_var $end\n"
         "$upscope $end\n"
         "$enddefinitions $end\n"
         "#0\n"
         "$dumpvars\n"
-        "bx 0\n"
+        "bx !\n"
         "$end\n");
 }
 
@@ -319,13 +892,51 @@ TEST_F(VCDWriterFixture, SetScopeSep)
         "$date 2024-05-21 22:16:16 $end\n"
         "$scope module my_scope $end\n"
         "$scope module top $end\n"
-        "$var wire 1 0 my_var $end\n"
+        "$var wire 1 ! my_var $end\n"
         "$upscope $end\n"
         "$upscope $end\n"
         "$enddefinitions $end\n"
         "#0\n"
         "$dumpvars\n"
-        "bx 0\n"
+        "bx !\n"
+        "$end\n");
+}
+
+TEST_F(VCDWriterFixture, ScopeHierarchy)
+{
+    writer->register_var("a.b", "x", VariableType::wire, 1);
+    writer->register_var("a-c", "y", VariableType::wire, 1);
+    writer->register_var("a", "z", VariableType::wire, 1);
+    // the failed registration leaves no scope
+    EXPECT_THROW(writer->register_var("a.d", "w", VariableType::wire, 0), VCDTypeException);
+
+    // a parent scope of the registered ones
+    std::string parent = "a";
+    writer->set_scope_type(parent, ScopeType::task);
+    std::string missing = "a.d";
+    EXPECT_THROW(writer->set_scope_type(missing, ScopeType::task), VCDPhaseException);
+    EXPECT_EQ(writer->var_id(writer->var("a.b", "x")), 0u);
+    EXPECT_THROW(writer->var("a.b.x", "x"), VCDPhaseException);
+    EXPECT_THROW(writer->var("b", "x"), VCDPhaseException);
+    writer->flush();
+
+    EXPECT_EQ(read_file(), "$timescale 1 ns $end\n"
+        "$date 2024-05-21 22:16:16 $end\n"
+        "$scope task a $end\n"
+        "$var wire 1 # z $end\n"
+        "$scope module b $end\n"
+        "$var wire 1 ! x $end\n"
+        "$upscope $end\n"
+        "$upscope $end\n"
+        "$scope module a-c $end\n"
+        "$var wire 1 \" y $end\n"
+        "$upscope $end\n"
+        "$enddefinitions $end\n"
+        "#0\n"
+        "$dumpvars\n"
+        "bx !\n"
+        "bx \"\n"
+        "bx #\n"
         "$end\n");
 }
 
@@ -355,18 +966,18 @@ TEST_F(VCDWriterFixture, DumpOff)
     EXPECT_EQ(contents, "$timescale 1 ns $end\n"
         "$date 2024-05-21 22:16:16 $end\n"
         "$scope module my_scope $end\n"
-        "$var wire 2 0 my_var $end\n"
+        "$var wire 2 ! my_var $end\n"
         "$upscope $end\n"
         "$enddefinitions $end\n"
         "#0\n"
         "$dumpvars\n"
-        "bxx 0\n"
+        "bxx !\n"
         "$end\n"
         "#10\n"
-        "b01 0\n"
+        "b01 !\n"
         "#10\n"
         "$dumpoff\n"
-        "bx 0\n"
+        "bx !\n"
         "$end\n");
 }
 
@@ -407,23 +1018,916 @@ TEST_F(VCDWriterFixture, DumpOn)
     EXPECT_EQ(contents, "$timescale 1 ns $end\n"
         "$date 2024-05-21 22:16:16 $end\n"
         "$scope module my_scope $end\n"
-        "$var wire 3 0 my_var $end\n"
+        "$var wire 3 ! my_var $end\n"
         "$upscope $end\n"
         "$enddefinitions $end\n"
         "#0\n"
         "$dumpvars\n"
-        "bxxx 0\n"
+        "bxxx !\n"
         "$end\n"
         "#10\n"
-        "b000 0\n"
+        "b000 !\n"
         "#10\n"
         "$dumpoff\n"
-        "bx 0\n"
+        "bx !\n"
         "$end\n"
         "#11\n"
         "$dumpon\n"
         "#11\n"
-        "b011 0\n");
+        "b011 !\n");
+}
+
+TEST_F(VCDWriterFixture, DumpScope)
+{
+    VarPtr a = writer->register_var("top.cpu0", "a", VariableType::wire, 4);
+    VarPtr b = writer->register_var("top.cpu0", "b", VariableType::wire, 1);
+    VarPtr c = writer->register_var("top.cpu1", "c", VariableType::wire, 4);
+    VarPtr r = writer->register_var("top", "r", VariableType::real);
+    // off before the first dump
+    writer->dump_off("top.cpu1", 0);
+    EXPECT_TRUE(writer->change(a, 1, 3u));
+    EXPECT_TRUE(writer->change(c, 1, 5u));
+    writer->dump_off(a, 2);
+    writer->dump_off(r, 2);
+    EXPECT_TRUE(writer->change(a, 2, 4u));
+    EXPECT_TRUE(writer->change(r, 2, "1.5"));
+    EXPECT_TRUE(writer->change(b, 2, "1"));
+    // only the vars turned off are written
+    writer->dump_on("top", 3);
+    writer->dump_on("top", 3);
+    EXPECT_THROW(writer->dump_on("top.cpu2", 3), VCDPhaseException);
+    EXPECT_THROW(writer->dump_off(c, 2), VCDPhaseException);
+    writer->flush();
+
+    EXPECT_EQ(read_file(), "$timescale 1 ns $end\n"
+        "$date 2024-05-21 22:16:16 $end\n"
+        "$scope module top $end\n"
+        "$var real 64 $ r $end\n"
+        "$scope module cpu0 $end\n"
+        "$var wire 4 ! a $end\n"
+        "$var wire 1 \" b $end\n"
+        "$upscope $end\n"
+        "$scope module cpu1 $end\n"
+        "$var wire 4 # c $end\n"
+        "$upscope $end\n"
+        "$upscope $end\n"
+        "$enddefinitions $end\n"
+        "#0\n"
+        "$dumpvars\n"
+        "bxxxx !\n"
+        "bx \"\n"
+        "bx #\n"
+        "r0 $\n"
+        "$end\n"
+        "#1\n"
+        "b0011 !\n"
+        "#2\n"
+        "bx !\n"
+        "b1 \"\n"
+        "#3\n"
+        "r1.5 $\n"
+        "b0100 !\n"
+        "b0101 #\n");
+
+    HeadPtr header = makeVCDHeader();
+    VCDOptions options;
+    options.window = 10;
+    VCDWriter recorder("recorder.vcd", header, options);
+    EXPECT_THROW(recorder.dump_off(recorder.register_var("top", "v"), 0), VCDTypeException);
+}
+
+// Timestamps of the written changes of the var of *code* after `$dumpvars`
+static std::vector<TimeStamp> change_times(const std::string &contents, const std::string &code)
+{
+    std::vector<TimeStamp> times;
+    std::istringstream lines(contents.substr(contents.find("$end\n", contents.find("$dumpvars")) + 5));
+    TimeStamp ts = 0;
+    for (std::string line; std::getline(lines, line); )
+    {
+        if (line[0] == '#')
+            ts = TimeStamp(std::stoul(line.substr(1)));
+        else if (line.size() > code.size() && line.compare(line.size() - code.size(), code.size(), code) == 0
+                 && (line[0] != 'b' && line[0] != 'r' ? line.size() == code.size() + 1 : line[line.size() - code.size() - 1] == ' '))
+            times.push_back(ts);
+    }
+    return times;
+}
+
+TEST_F(VCDWriterFixture, Sampling)
+{
+    VarPtr clk = writer->register_var("top", "clk", VariableType::wire, 1);
+    VarPtr cnt = writer->register_var("top", "cnt", VariableType::wire, 8);
+    VarPtr temp = writer->register_var("top", "temp", VariableType::real);
+    VarPtr bus = writer->register_var("top.fast", "bus", VariableType::wire, 8);
+    writer->set_sampling(clk, { 10 });
+    writer->set_sampling(cnt, { 0, 4 });
+    writer->set_sampling(temp, { 0, 0, 1.0 });
+    writer->set_sampling("top.fast", { 0, 2, 1.0 });
+    EXPECT_THROW(writer->set_sampling(cnt, { 0, 0, 1.0 }), VCDTypeException);
+    for (TimeStamp t = 1; t <= 20; ++t)
+    {
+        // the changes are counted even if they are not written
+        EXPECT_TRUE(writer->change(clk, t, t & 1u));
+        EXPECT_TRUE(writer->change(cnt, t, t));
+        EXPECT_TRUE(writer->change(writer->real_handle(temp), t, t * 0.25));
+        EXPECT_TRUE(writer->change(bus, t, 255u - t));
+    }
+    // the sampled vars have the current values
+    writer->dump_off(temp, 21);
+    writer->dump_on(temp, 21);
+    writer->set_sampling(clk, {});
+    EXPECT_TRUE(writer->change(clk, 22, 1u));
+    writer->flush();
+
+    const std::string contents = read_file();
+    EXPECT_EQ(change_times(contents, "!"), std::vector<TimeStamp>({ 1, 11, 22 }));
+    EXPECT_EQ(change_times(contents, "\""), std::vector<TimeStamp>({ 4, 8, 12, 16, 20 }));
+    EXPECT_EQ(change_times(contents, "#"), std::vector<TimeStamp>({ 1, 6, 11, 16, 21 }));
+    EXPECT_EQ(change_times(contents, "$"), std::vector<TimeStamp>({ 2, 4, 6, 8, 10, 12, 14, 16, 18, 20 }));
+    EXPECT_NE(contents.find("#21\nr5 #\n"), std::string::npos);
+}
+
+TEST_F(VCDWriterFixture, SamplingDumpOff)
+{
+    VarPtr cnt = writer->register_var("top", "cnt", VariableType::wire, 8);
+    writer->set_sampling(cnt, { 0, 3 });
+    writer->flush();
+    // the changes of turned off var are not counted
+    writer->dump_off(cnt, 1);
+    for (TimeStamp t = 2; t <= 6; ++t)
+        writer->change(cnt, t, t);
+    writer->dump_on(cnt, 7);
+    for (TimeStamp t = 8; t <= 10; ++t)
+        writer->change(cnt, t, t);
+    // the reset leaves the sampler to be reused
+    for (int i = 0; i < 100; ++i)
+    {
+        writer->set_sampling(cnt, {});
+        writer->set_sampling(cnt, { 0, 3 });
+    }
+    for (TimeStamp t = 11; t <= 13; ++t)
+        writer->change(cnt, t, t);
+    writer->set_sampling(cnt, {});
+    writer->change(cnt, 14, 14u);
+    writer->flush();
+
+    EXPECT_EQ(change_times(read_file(), "!"), std::vector<TimeStamp>({ 1, 7, 10, 13, 14 }));
+}
+
+// -----------------------------
+
+// Write the same changes by differently configured writers
+static void write_counters(const std::string &filename, const VCDOptions &options)
+{
+    HeadPtr header = makeVCDHeader(TimeScale::ONE, TimeScaleUnit::ns, "2024-05-21 22:16:16");
+    VCDWriter writer(filename, header, options);
+    std::vector<VarId> ids;
+    for (int i = 0; i < 16; ++i)
+        ids.push_back(writer.var_id(writer.register_var("top.sub", "cnt" + std::to_string(i), VariableType::wire, 16)));
+    for (TimeStamp t = 0; t < 1000; ++t)
+        for (size_t i = 0; i < ids.size(); ++i)
+            writer.change(ids[i], t, (t * (i + 1)) & 0xFFFFu);
+    writer.close();
+    EXPECT_EQ(writer.dropped_bytes(), 0u);
+}
+
+TEST(VCDOutputTest, AsyncEqualsSync)
+{
+    write_counters("sync.vcd", VCDOptions{});
+
+    VCDOptions options;
+    options.async = true;
+    options.buffer_size = 64;
+    options.buffers = 2;
+    write_counters("async.vcd", options);
+
+    const std::string expected = read_file("sync.vcd");
+    EXPECT_GT(expected.size(), 100000u);
+    EXPECT_EQ(read_file("async.vcd"), expected);
+}
+
+TEST(VCDOutputTest, FileIOEqualsStream)
+{
+    write_counters("stream.vcd", VCDOptions{});
+    const std::string expected = read_file("stream.vcd");
+#if defined(__unix__) || defined(__APPLE__)
+    std::vector<FileIO> modes{ FileIO::mmap };
+#ifdef __linux__
+    modes.push_back(FileIO::direct);
+#endif
+    for (FileIO file_io : modes)
+    {
+        VCDOptions options;
+        options.file_io = file_io;
+        options.buffer_size = 10000;  // not a multiple of blocks
+        write_counters("file_io.vcd", options);
+        EXPECT_EQ(read_file("file_io.vcd"), expected);
+
+        // the file has no padding after flush, the writing goes on
+        HeadPtr header = makeVCDHeader(TimeScale::ONE, TimeScaleUnit::ns, "2024-05-21 22:16:16");
+        VCDWriter writer("file_io.vcd", header, options);
+        VarPtr var = writer.register_var("my_scope", "my_var", VariableType::wire, 1);
+        writer.change(var, 10, "1");
+        writer.flush();
+        std::string contents = read_file("file_io.vcd");
+        EXPECT_EQ(contents.substr(contents.size() - 9), "#10\nb1 !\n");
+        writer.change(var, 11, "0");
+        writer.close();
+        EXPECT_EQ(read_file("file_io.vcd"), contents + "#11\nb0 !\n");
+    }
+#endif
+    VCDOptions options;
+    options.file_io = FileIO::direct;
+    HeadPtr header = makeVCDHeader();
+    EXPECT_THROW(VCDWriter("test.vcd.gz", header, options), VCDTypeException);
+}
+
+TEST(VCDOutputTest, SyncEqualsStream)
+{
+    write_counters("stream.vcd", VCDOptions{});
+    const std::string expected = read_file("stream.vcd");
+    std::vector<FileIO> modes{ FileIO::stream };
+#if defined(__unix__) || defined(__APPLE__)
+    modes.push_back(FileIO::mmap);
+#ifdef __linux__
+    modes.push_back(FileIO::direct);
+#endif
+#endif
+    for (FileIO file_io : modes)
+    {
+        VCDOptions options;
+        options.sync = true;
+        options.file_io = file_io;
+        options.buffer_size = 10000;
+        write_counters("synced.vcd", options);
+        EXPECT_EQ(read_file("synced.vcd"), expected);
+
+        HeadPtr header = makeVCDHeader(TimeScale::ONE, TimeScaleUnit::ns, "2024-05-21 22:16:16");
+        VCDWriter writer("synced.vcd", header, options);
+        VarPtr var = writer.register_var("my_scope", "my_var", VariableType::wire, 1);
+        writer.change(var, 10, "1");
+        writer.flush();
+        const std::string contents = read_file("synced.vcd");
+        EXPECT_EQ(contents.substr(contents.size() - 9), "#10\nb1 !\n");
+    }
+}
+
+// Write the changes of 100 time units, the window is dumped at *dump_at*
+static void write_recorder(const std::string &filename, const VCDOptions &options, TimeStamp dump_at = 0)
+{
+    HeadPtr header = makeVCDHeader(TimeScale::ONE, TimeScaleUnit::ns, "2024-05-21 22:16:16");
+    VCDWriter writer(filename, header, options);
+    VarPtr clk = writer.register_var("top", "clk", VariableType::wire, 1);
+    VarPtr bus = writer.register_var("top.u1", "bus", VariableType::wire, 8);
+    VarPtr str = writer.register_var("top.u1", "str", VariableType::string);
+    VarPtr real = writer.register_var("top", "real", VariableType::real);
+    std::string scope = "top.u1";
+    writer.set_scope_type(scope, ScopeType::task);
+    for (TimeStamp t = 1; t < 100; ++t)
+    {
+        writer.change(clk, t, t % 2);
+        writer.change(bus, t, (t * 7) & 0xFFu);
+        if (t % 3 == 0)
+            writer.change(str, t, "s" + std::to_string(t));
+        if (t % 5 == 0)
+            writer.change(writer.real_handle(real), t, 0.5 * t);
+        if (t == 93)
+            writer.dump_off(t);
+        if (t == 95)
+            writer.dump_on(t);
+        if (t == dump_at)
+            writer.dump_window("window.vcd");
+    }
+    writer.close();
+}
+
+TEST(VCDOutputTest, FlightRecorder)
+{
+    write_recorder("full.vcd", VCDOptions{});
+    VCDOptions options;
+    options.window = 10;
+    write_recorder("recorder.vcd", options, 50);
+    const std::string full = read_file("full.vcd");
+    const std::string recorder = read_file("recorder.vcd");
+
+    // the same header and the changes after the window start
+    EXPECT_EQ(recorder.substr(0, recorder.find("#89\n")), full.substr(0, full.find("#0\n")));
+    EXPECT_EQ(recorder.substr(recorder.find("#90\n")), full.substr(full.find("#90\n")));
+    // the values at the window start
+    EXPECT_NE(recorder.find("#89\n$dumpvars\nb1 !\nb01101111 \"\nss87 #\nr42.5 $\n$end\n"), std::string::npos);
+    EXPECT_EQ(recorder.find("#88\n"), std::string::npos);
+
+    // the window at 50
+    const std::string window = read_file("window.vcd");
+    EXPECT_NE(window.find("$enddefinitions $end\n#40\n$dumpvars\n"), std::string::npos);
+    EXPECT_EQ(window.substr(window.find("#41\n")), full.substr(full.find("#41\n"), full.find("#51\n") - full.find("#41\n")));
+
+    // at most the budget is kept
+    options.window = 0;
+    options.window_bytes = 256;
+    write_recorder("recorder.vcd", options);
+    const std::string budget = read_file("recorder.vcd");
+    EXPECT_LT(budget.size(), full.size() / 4);
+    EXPECT_EQ(budget.substr(budget.find("#99\n")), full.substr(full.find("#99\n")));
+
+    HeadPtr header = makeVCDHeader();
+    VCDWriter writer("test.vcd", header);
+    EXPECT_THROW(writer.dump_window("window.vcd"), VCDPhaseException);
+}
+
+TEST(VCDOutputTest, Segments)
+{
+    write_counters("full.vcd", VCDOptions{});
+    const std::string full = read_file("full.vcd");
+
+    VCDOptions options;
+    options.segment_span = 250;
+    write_counters("seg.vcd", options);
+    EXPECT_EQ(read_file("seg.manifest"), "0 249 seg.0000.vcd\n"
+                                         "250 499 seg.0001.vcd\n"
+                                         "500 749 seg.0002.vcd\n"
+                                         "750 999 seg.0003.vcd\n");
+    EXPECT_EQ(read_file("seg.0000.vcd"), full.substr(0, full.find("#250\n")));
+    for (TimeStamp t : { 250u, 500u, 750u })
+    {
+        // the complete VCD of the values at the segment start and the changes
+        const std::string segment = read_file("seg.000" + std::to_string(t / 250) + ".vcd");
+        const std::string start = "#" + std::to_string(t) + "\n";
+        const size_t changes = segment.find("$end\n", segment.find(start + "$dumpvars\n")) + 5;
+        EXPECT_EQ(segment.substr(0, segment.find(start)), full.substr(0, full.find("#0\n")));
+        const size_t beg = full.find(start) + start.size();
+        const size_t end = (t < 750) ? full.find("#" + std::to_string(t + 250) + "\n") : full.size();
+        EXPECT_EQ(segment.substr(changes), full.substr(beg, end - beg));
+    }
+
+    options.segment_span = 0;
+    options.segment_bytes = 20000;
+    write_counters("seg.vcd", options);
+    const std::string manifest = read_file("seg.manifest");
+    const auto n_segments = std::count(manifest.begin(), manifest.end(), '\n');
+    EXPECT_GT(n_segments, 5);
+    EXPECT_NE(manifest.find(" 999 seg.00" + std::to_string(n_segments - 1) + ".vcd\n"), std::string::npos);
+
+    HeadPtr header = makeVCDHeader();
+    EXPECT_THROW(VCDWriter(makeVCDSink("test.vcd"), header, options), VCDTypeException);
+}
+
+TEST(VCDOutputTest, IndexSeek)
+{
+    VCDOptions options;
+    options.index_span = 100;
+    write_counters("indexed.vcd", options);
+    // the same file without index
+    const std::string contents = read_file("indexed.vcd");
+    std::ofstream("plain.vcd", std::ios::binary) << contents;
+    EXPECT_NE(contents.find("#500\n$dumpall\n"), std::string::npos);
+
+    VCDReader indexed("indexed.vcd");
+    VCDReader plain("plain.vcd");
+    EXPECT_EQ(indexed.index_size(), 10u);
+    EXPECT_EQ(plain.index_size(), 0u);
+    ASSERT_EQ(indexed.vars().size(), 16u);
+    EXPECT_EQ(indexed.vars()[3].scope, "top.sub");
+    EXPECT_EQ(indexed.vars()[3].name, "cnt3");
+    EXPECT_EQ(indexed.var_index("top.sub", "cnt5"), 5);
+
+    for (TimeStamp t : { 0u, 99u, 100u, 567u, 999u, 5000u })
+    {
+        const auto values = indexed.values_at(t);
+        EXPECT_EQ(values, plain.values_at(t));
+        const TimeStamp last = std::min(t, 999u);
+        for (size_t i = 0; i < values.size(); ++i)
+            EXPECT_EQ(values[i], std::bitset<16>((last * (i + 1)) & 0xFFFFu).to_string());
+    }
+
+    options.index_span = 0;
+    options.index_bytes = 1000;
+    write_counters("indexed.vcd", options);
+    VCDReader by_bytes("indexed.vcd");
+    EXPECT_GT(by_bytes.index_size(), 100u);
+    EXPECT_EQ(by_bytes.values_at(777)[15], std::bitset<16>((777 * 16) & 0xFFFFu).to_string());
+
+    HeadPtr header = makeVCDHeader();
+    EXPECT_THROW(VCDWriter("indexed.vcd.gz", header, options), VCDTypeException);
+    EXPECT_THROW(VCDReader("no_such.vcd"), VCDException);
+}
+
+// Writes the value changes back as they were read
+class EchoHandler final : public VCDHandler
+{
+public:
+    std::string changes;
+    size_t n_scopes{}, n_vars{}, n_ends{};
+
+    void scope(ScopeType, std::string_view) override { ++n_scopes; }
+    void var(const VCDVarInfo&) override { ++n_vars; }
+    void enddefinitions() override { ++n_ends; }
+    bool timestamp(TimeStamp timestamp) override { changes += "#" + std::to_string(timestamp) + "\n"; return true; }
+    void command(std::string_view keyword) override { (changes += keyword) += "\n"; }
+    void change(std::string_view code, std::string_view value) override
+    {
+        changes += value;
+        if (value.size() > 1)
+            changes += ' ';
+        (changes += code) += "\n";
+    }
+};
+
+TEST(VCDOutputTest, ReaderParse)
+{
+    HeadPtr header = makeVCDHeader(TimeScale::ONE, TimeScaleUnit::ns, "2024-05-21 22:16:16");
+    {
+        VCDWriter writer{"test.vcd", header};
+        VarPtr bit = writer.register_var("top", "bit", VariableType::wire, 1);
+        VarPtr bus = writer.register_var("top.sub", "bus", VariableType::reg, 8);
+        VarPtr real = writer.register_var("top.sub", "real", VariableType::real, 64);
+        VarPtr str = writer.register_var("top", "state", VariableType::string, 1);
+        for (TimeStamp t = 1; t < 100; ++t)
+        {
+            writer.change(bit, t, (t % 2) ? "1" : "0");
+            writer.change(bus, t, std::bitset<8>(t * 3).to_string());
+            writer.change(real, t, std::to_string(t) + ".5");
+            writer.change(str, t, (t % 3) ? "idle" : "busy");
+        }
+        writer.change(bus, 100, "zzzzzzzz");
+    }
+    const std::string contents = read_file("test.vcd");
+
+    VCDReader reader("test.vcd");
+    EXPECT_EQ(reader.size(), contents.size());
+    ASSERT_EQ(reader.vars().size(), 4u);
+    const int i_bus = reader.var_index("top.sub", "bus");
+    ASSERT_GE(i_bus, 0);
+    EXPECT_EQ(reader.vars()[i_bus].type, VariableType::reg);
+    EXPECT_EQ(reader.vars()[i_bus].size, 8u);
+
+    const size_t body = contents.find("#0\n");
+    ASSERT_NE(body, std::string::npos);
+    size_t n_changes = 0;
+    std::istringstream lines(contents.substr(body));
+    for (std::string line; std::getline(lines, line); )
+        n_changes += (line[0] != '#' && line[0] != '$');
+
+    EchoHandler handler;
+    EXPECT_EQ(reader.parse(handler), n_changes);
+    EXPECT_EQ(handler.n_scopes, 2u);
+    EXPECT_EQ(handler.n_vars, 4u);
+    EXPECT_EQ(handler.n_ends, 1u);
+    EXPECT_EQ(handler.changes, contents.substr(body));
+
+    EXPECT_EQ(reader.values_at(100)[i_bus], "zzzzzzzz");
+    EXPECT_EQ(reader.values_at(99)[reader.var_index("top", "state")], "busy");
+    EXPECT_EQ(reader.values_at(42)[reader.var_index("top.sub", "real")], "42.5");
+}
+
+TEST(VCDOutputTest, AsyncFlush)
+{
+    VCDOptions options;
+    options.async = true;
+    HeadPtr header = makeVCDHeader(TimeScale::ONE, TimeScaleUnit::ns, "2024-05-21 22:16:16");
+    VCDWriter writer("test.vcd", header, options);
+    VarPtr var = writer.register_var("my_scope", "my_var", VariableType::wire, 1);
+    writer.change(var, 10, "1");
+    // All the data is in the file after flush
+    writer.flush();
+    EXPECT_NE(read_file().find("#10\nb1 !\n"), std::string::npos);
+}
+
+TEST(VCDOutputTest, InvalidOptions)
+{
+    VCDOptions options;
+    options.buffer_size = 0;
+    HeadPtr header = makeVCDHeader();
+    EXPECT_THROW(VCDWriter("test.vcd", header, options), VCDTypeException);
+
+    options.buffer_size = 1024;
+    options.async = true;
+    options.buffers = 1;
+    header = makeVCDHeader();
+    EXPECT_THROW(VCDWriter("test.vcd", header, options), VCDTypeException);
+
+    header = makeVCDHeader();
+    EXPECT_THROW(VCDWriter("no_such_dir/test.vcd", header), VCDException);
+}
+
+TEST(VCDOutputTest, Stats)
+{
+    VCDOptions options;
+    options.buffer_size = 64;
+    options.stats_file = "stats.json";
+    HeadPtr header = makeVCDHeader(TimeScale::ONE, TimeScaleUnit::ns, "2024-05-21 22:16:16");
+    VCDWriter writer("stats.vcd", header, options);
+    VarPtr clk = writer.register_var("top", "clk", VariableType::integer, 1);  // scalar
+    VarPtr bus = writer.register_var("top.sub", "bus", VariableType::wire, 8);
+    VarPtr temp = writer.register_var("top", "temp", VariableType::real);
+    VarPtr state = writer.register_var("top", "state", VariableType::string);
+    writer.set_sampling(bus, { 0, 2 });
+    for (TimeStamp t = 1; t <= 10; ++t)
+    {
+        writer.change(clk, t, t & 1u);
+        writer.change(bus, t, t);
+        writer.change(writer.real_handle(temp), t, 1.5);
+    }
+    writer.change(state, 11, "idle");
+    writer.close();
+
+    const VCDStats stats = writer.stats();
+    const std::string json = read_file("stats.json");
+    if (!VCDStats::enabled)
+    {
+        EXPECT_EQ(stats.changes, 0u);
+        EXPECT_TRUE(stats.var_changes.empty());
+        EXPECT_NE(json.find("\"enabled\": false"), std::string::npos);
+        return;
+    }
+    EXPECT_EQ(stats.changes, 31u);
+    EXPECT_EQ(stats.unchanged, 9u);     // of the real
+    EXPECT_EQ(stats.suppressed, 5u);    // sampled out
+    EXPECT_EQ(stats.records, 17u);
+    EXPECT_EQ(stats.var_changes, std::vector<size_t>({ 10, 10, 1, 1 }));
+    // "1!\n", "b00000010 \"\n", "r1.5 #\n", "sidle $\n"
+    EXPECT_EQ(stats.scalar_bytes, 10u * 3u);
+    EXPECT_EQ(stats.vector_bytes, 5u * 12u);
+    EXPECT_EQ(stats.real_bytes, 7u);
+    EXPECT_EQ(stats.string_bytes, 8u);
+
+    const std::string contents = read_file("stats.vcd");
+    EXPECT_EQ(stats.header_bytes, contents.find("$enddefinitions $end\n") + 21);
+    EXPECT_EQ(stats.scalar_bytes + stats.vector_bytes + stats.real_bytes + stats.string_bytes +
+              stats.header_bytes + stats.dump_bytes + stats.other_bytes, contents.size());
+    EXPECT_GE(stats.peak_buffered_bytes, options.buffer_size);
+    EXPECT_NE(json.find("\"records\": 17"), std::string::npos);
+    EXPECT_NE(json.find("\"top.sub.bus\": 10"), std::string::npos);
+}
+
+// -----------------------------
+
+// Sink collecting the output in memory
+class StringSink : public VCDSink
+{
+public:
+    StringSink(std::string &out, bool &closed) : _out(out), _closed(closed) {}
+    void write(const char *data, size_t size) override { _out.append(data, size); }
+    void flush() override { ++flushes; }
+    void close() override { _closed = true; }
+
+    unsigned flushes{};
+
+private:
+    std::string &_out;
+    bool &_closed;
+};
+
+TEST(VCDOutputTest, CustomSink)
+{
+    std::string out;
+    bool closed = false;
+    auto *sink = new StringSink(out, closed);
+
+    VCDOptions options;
+    options.async = true;
+    options.buffer_size = 16;
+    HeadPtr header = makeVCDHeader(TimeScale::ONE, TimeScaleUnit::ns, "2024-05-21 22:16:16");
+    VCDWriter writer(SinkPtr{ sink }, header, options);
+    VarPtr var = writer.register_var("my_scope", "my_var", VariableType::wire, 1);
+    writer.change(var, 10, "1");
+    writer.flush();
+    EXPECT_GE(sink->flushes, 1u);
+    EXPECT_NE(out.find("#10\nb1 !\n"), std::string::npos);
+
+    writer.close();
+    // The sink is closed and released with the writer's output
+    EXPECT_TRUE(closed);
+}
+
+// Sink of blocks, the partial block is written again by the next write
+class BlockSink : public VCDSink
+{
+public:
+    explicit BlockSink(std::string &out) : _out(out) {}
+    size_t alignment() const override { return BLOCK; }
+    void write(const char *data, size_t size) override
+    {
+        EXPECT_EQ(reinterpret_cast<uintptr_t>(data) % BLOCK, 0u);
+        EXPECT_FALSE(_partial);  // only before flush
+        _out.resize(_blocks);
+        _out.append(data, size);
+        _blocks += size - size % BLOCK;
+        _partial = (size % BLOCK != 0);
+    }
+    void flush() override { _partial = false; }
+    void close() override {}
+
+    static constexpr size_t BLOCK = 64;
+
+private:
+    std::string &_out;
+    size_t _blocks{};
+    bool _partial{};
+};
+
+TEST(VCDOutputTest, AlignedSink)
+{
+    write_counters("sync.vcd", VCDOptions{});
+    for (bool async : { false, true })
+    {
+        std::string out;
+        VCDOptions options;
+        options.async = async;
+        options.buffer_size = 100;
+        options.buffers = 2;
+        HeadPtr header = makeVCDHeader(TimeScale::ONE, TimeScaleUnit::ns, "2024-05-21 22:16:16");
+        VCDWriter writer(SinkPtr{ new BlockSink(out) }, header, options);
+        std::vector<VarId> ids;
+        for (int i = 0; i < 16; ++i)
+            ids.push_back(writer.var_id(writer.register_var("top.sub", "cnt" + std::to_string(i), VariableType::wire, 16)));
+        for (TimeStamp t = 0; t < 1000; ++t)
+        {
+            for (size_t i = 0; i < ids.size(); ++i)
+                writer.change(ids[i], t, (t * (i + 1)) & 0xFFFFu);
+            if (t % 100 == 0)
+                writer.flush();
+        }
+        writer.close();
+        EXPECT_EQ(out, read_file("sync.vcd"));
+    }
+}
+
+// Sink slower than the writer, the asynchronous output runs out of buffers
+template <typename Sink>
+class SlowSink : public Sink
+{
+public:
+    using Sink::Sink;
+    void write(const char *data, size_t size) override
+    {
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+        Sink::write(data, size);
+    }
+};
+
+// Check that the values of the var changed to *t* at each timestamp *t* are
+// under their timestamps, return the last value
+static unsigned check_counter(const std::string &contents)
+{
+    std::istringstream lines(contents.substr(contents.find("$enddefinitions $end\n")));
+    TimeStamp ts = 0;
+    unsigned value = 0;
+    for (std::string line; std::getline(lines, line); )
+    {
+        if (line[0] == '#')
+        {
+            const auto next = TimeStamp(std::stoul(line.substr(1)));
+            EXPECT_GE(next, ts);
+            ts = next;
+        }
+        else if (line[0] == 'b')
+        {
+            value = unsigned(std::stoul(line.substr(1, line.find(' ') - 1), nullptr, 2));
+            EXPECT_EQ(value, ts) << line;
+        }
+    }
+    return value;
+}
+
+TEST(VCDOutputTest, DroppedBuffers)
+{
+    for (bool aligned : { false, true })
+    {
+        std::string out;
+        bool closed = false;
+        VCDOptions options;
+        options.async = true;
+        options.buffer_size = 4096;
+        options.buffers = 2;
+        options.backpressure = Backpressure::drop;
+        HeadPtr header = makeVCDHeader(TimeScale::ONE, TimeScaleUnit::ns, "2024-05-21 22:16:16");
+        SinkPtr sink{ aligned ? static_cast<VCDSink*>(new SlowSink<BlockSink>(out))
+                              : static_cast<VCDSink*>(new SlowSink<StringSink>(out, closed)) };
+        VCDWriter writer(std::move(sink), header, options);
+        VarPtr var = writer.register_var("top", "cnt", VariableType::wire, 32);
+        const TimeStamp steps = 100000;
+        for (TimeStamp t = 0; t < steps; ++t)
+            writer.change(var, t, t);
+        writer.close();
+
+        // the records after a dropped buffer are of the last timestamp,
+        // the values of the dropped changes are dumped again
+        EXPECT_GT(writer.dropped_bytes(), 0u);
+        EXPECT_LT(out.size(), steps * 40);
+        EXPECT_NE(out.find("$dumpall\n"), std::string::npos);
+        EXPECT_EQ(check_counter(out), steps - 1);
+    }
+    // the index offsets might point into dropped buffers
+    VCDOptions options;
+    options.async = true;
+    options.backpressure = Backpressure::drop;
+    options.index_bytes = 1000;
+    HeadPtr header = makeVCDHeader();
+    EXPECT_THROW(VCDWriter("test.vcd", header, options), VCDTypeException);
+}
+
+TEST(VCDOutputTest, InvalidCompression)
+{
+    HeadPtr header = makeVCDHeader();
+    EXPECT_THROW(VCDWriter(SinkPtr{}, header), VCDTypeException);
+#ifndef VCDWRITER_WITH_ZSTD
+    header = makeVCDHeader();
+    EXPECT_THROW(VCDWriter("test.vcd.zst", header), VCDTypeException);
+#endif
+#ifndef VCDWRITER_WITH_ZLIB
+    VCDOptions options;
+    options.compression = Compression::gzip;
+    header = makeVCDHeader();
+    EXPECT_THROW(VCDWriter("test.vcd", header, options), VCDTypeException);
+#endif
+#ifndef VCDWRITER_WITH_FST
+    header = makeVCDHeader();
+    EXPECT_THROW(VCDWriter("test.fst", header), VCDTypeException);
+#endif
+}
+
+#ifdef VCDWRITER_WITH_ZLIB
+// Read the decompressed contents of gzip file
+static std::string read_gzip(const std::string &filename)
+{
+    std::string contents;
+    gzFile file = gzopen(filename.c_str(), "rb");
+    EXPECT_NE(file, nullptr);
+    char buf[4096];
+    int n = 0;
+    while (file && (n = gzread(file, buf, sizeof(buf))) > 0)
+        contents.append(buf, size_t(n));
+    if (file)
+        gzclose(file);
+    return contents;
+}
+
+TEST(VCDOutputTest, GzipEqualsPlain)
+{
+    write_counters("plain.vcd", VCDOptions{});
+    write_counters("plain.vcd.gz", VCDOptions{});
+
+    VCDOptions options;
+    options.async = true;
+    options.buffer_size = 256;
+    options.compression = Compression::gzip;
+    options.compression_level = 1;
+    write_counters("async_gzip.vcd", options);
+
+    const std::string expected = read_file("plain.vcd");
+    EXPECT_EQ(read_gzip("plain.vcd.gz"), expected);
+    EXPECT_EQ(read_gzip("async_gzip.vcd"), expected);
+    EXPECT_LT(read_file("plain.vcd.gz").size(), expected.size() / 4);
+}
+#endif
+
+#ifdef VCDWRITER_WITH_FST
+TEST(VCDOutputTest, FstFile)
+{
+    VCDOptions options;
+    options.async = true;
+    write_counters("counters.fst", options);
+
+    void *ctx = fstReaderOpen("counters.fst");
+    ASSERT_NE(ctx, nullptr);
+    EXPECT_EQ(fstReaderGetVarCount(ctx), 16u);
+    EXPECT_EQ(fstReaderGetEndTime(ctx), 999u);
+    EXPECT_EQ(fstReaderGetTimescale(ctx), -9);
+    fstReaderClose(ctx);
+}
+
+TEST(VCDOutputTest, FstValues)
+{
+    {
+        HeadPtr header = makeVCDHeader(TimeScale::ONE, TimeScaleUnit::ns, "2024-05-21 22:16:16");
+        VCDWriter writer("values.fst", header);
+        VarPtr count = writer.register_var("top", "count", VariableType::integer, 8);
+        VarPtr real = writer.register_var("top", "real", VariableType::real);
+        // realtime vars are written as binary vectors, not as reals
+        VarPtr time = writer.register_var("top", "time", VariableType::realtime, 8);
+        writer.change(count, 1, 255u);
+        writer.change(real, 1, "2.5");
+        writer.change(time, 2, 5u);
+        writer.close();
+    }
+    void *ctx = fstReaderOpen("values.fst");
+    ASSERT_NE(ctx, nullptr);
+    char buf[256];
+    EXPECT_STREQ(fstReaderGetValueFromHandleAtTime(ctx, 1, 1, buf), "11111111");
+    EXPECT_STREQ(fstReaderGetValueFromHandleAtTime(ctx, 1, 2, buf), "2.5");
+    EXPECT_STREQ(fstReaderGetValueFromHandleAtTime(ctx, 2, 3, buf), "00000101");
+    fstReaderClose(ctx);
+}
+#endif
+
+// -----------------------------
+
+// Changes of var *i* made by thread *i % n_threads*
+static unsigned counter_value(TimeStamp t, size_t i) { return (t / (i + 1) + i) & 0xFFu; }
+
+static void write_parallel(const std::string &filename, size_t n_threads, bool concurrent_commit)
+{
+    const size_t n_vars = 8;
+    const TimeStamp n_steps = 2000;
+    HeadPtr header = makeVCDHeader(TimeScale::ONE, TimeScaleUnit::ns, "2024-05-21 22:16:16");
+    VCDWriter writer(filename, header);
+    std::vector<VarId> ids;
+    for (size_t i = 0; i < n_vars; ++i)
+        ids.push_back(writer.var_id(writer.register_var("top", "cnt" + std::to_string(i), VariableType::wire, 8)));
+    VarId str = writer.var_id(writer.register_var("top", "state", VariableType::string));
+
+    if (!n_threads)
+    {
+        // the reference: thread by thread within a timestamp
+        for (TimeStamp t = 1; t < n_steps; ++t)
+            for (size_t k = 0; k < 4; ++k)
+            {
+                for (size_t i = k; i < n_vars; i += 4)
+                    writer.change(ids[i], t, counter_value(t, i));
+                if (k == 0 && t % 100 == 0)
+                    writer.change(str, t, "s" + std::to_string(t));
+            }
+        return;
+    }
+
+    std::vector<VCDProducer*> producers;
+    for (size_t k = 0; k < n_threads; ++k)
+        producers.push_back(&writer.producer());
+    // the last timestamp finished by a thread + 1
+    std::vector<std::atomic<TimeStamp>> progress(n_threads);
+    std::vector<std::thread> threads;
+    for (size_t k = 0; k < n_threads; ++k)
+        threads.emplace_back([&, k] {
+            for (TimeStamp t = 1; t < n_steps; ++t)
+            {
+                for (size_t i = k; i < n_vars; i += n_threads)
+                    producers[k]->change(ids[i], t, counter_value(t, i));
+                if (k == 0 && t % 100 == 0)
+                    producers[k]->change(str, t, "s" + std::to_string(t));
+                progress[k].store(t + 1, std::memory_order_release);
+            }
+        });
+
+    if (concurrent_commit)
+    {
+        TimeStamp done = 1;
+        while (done < n_steps)
+        {
+            TimeStamp w = n_steps;
+            for (auto &p : progress)
+                w = std::min(w, p.load(std::memory_order_acquire));
+            if (w > done)
+            {
+                writer.commit(w - 1);
+                done = w;
+            }
+            else
+                std::this_thread::yield();
+        }
+    }
+    for (auto &th : threads)
+        th.join();
+    // close() merges the rest
+    writer.close();
+}
+
+TEST(VCDProducerTest, MergeInTimeOrder)
+{
+    write_parallel("serial.vcd", 0, false);
+    write_parallel("parallel.vcd", 4, false);
+    write_parallel("concurrent.vcd", 4, true);
+
+    const std::string expected = read_file("serial.vcd");
+    EXPECT_EQ(read_file("parallel.vcd"), expected);
+    EXPECT_EQ(read_file("concurrent.vcd"), expected);
+}
+
+TEST_F(VCDWriterFixture, ProducerOrder)
+{
+    VarPtr var = writer->register_var(scope, name, VariableType::wire, 4);
+    VCDProducer &producer = writer->producer();
+    // Registration is finished
+    EXPECT_THROW(writer->register_var(scope, next_name), VCDPhaseException);
+
+    producer.change(writer->var_id(var), 5, 1);
+    EXPECT_THROW(producer.change(writer->var_id(var), 4, 2), VCDPhaseException);
+    EXPECT_THROW(producer.change(VarId(1), 5, 2), VCDTypeException);
+    EXPECT_THROW(producer.change(writer->var_id(var), 5, "12"), VCDTypeException);
+    EXPECT_EQ(writer->commit(4), 0u);
+    EXPECT_EQ(writer->commit(5), 1u);
+
+    // Merged timestamps are past, nothing is merged then
+    VCDProducer &other = writer->producer();
+    other.change(writer->var_id(var), 6, 4);
+    producer.change(writer->var_id(var), 5, 3);
+    writer->change(var, 6, 2);
+    EXPECT_THROW(writer->commit(6), VCDPhaseException);
+    EXPECT_THROW(writer->commit(6), VCDPhaseException);
+    writer->flush();
+    const std::string contents = read_file();
+    EXPECT_NE(contents.find("#6\nb0010 !\n"), std::string::npos);
+    EXPECT_EQ(contents.find("b0100 !"), std::string::npos);
 }
 
 // -----------------------------
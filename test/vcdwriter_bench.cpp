@@ -0,0 +1,375 @@
+// Benchmarks of the writer hot paths on synthetic workloads:
+// registration and header, value changes, dump_off/dump_on,
+// and the reading back by `VCDReader::parse()`.
+// Usage: vcdwriter_bench [scale] [output.vcd] [stream|direct|mmap]
+//   *scale* multiplies the sizes of workloads (1 by default),
+//   the output is counted and dropped unless a file is given,
+//   the file is written by the given `FileIO` (stream by default).
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <random>
+#include <string>
+#include <vector>
+#include "vcd_writer.h"
+#include "vcd_reader.h"
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+using namespace vcd;
+using Clock = std::chrono::steady_clock;
+
+// -----------------------------
+// Sink dropping the output, only the bytes are counted
+class CountingSink : public VCDSink
+{
+public:
+    explicit CountingSink(size_t &bytes) : _bytes(bytes) {}
+    void write(const char*, size_t size) override { _bytes += size; }
+    void flush() override {}
+    void close() override {}
+
+private:
+    size_t &_bytes;
+};
+
+// -----------------------------
+static double peak_rss_mb()
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS pmc{};
+    GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc));
+    return double(pmc.PeakWorkingSetSize) / (1024. * 1024.);
+#else
+    struct rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return double(usage.ru_maxrss) / (1024. * 1024.);  // bytes
+#else
+    return double(usage.ru_maxrss) / 1024.;  // kilobytes
+#endif
+#endif
+}
+
+// -----------------------------
+static double seconds_since(Clock::time_point beg)
+{
+    return std::chrono::duration<double>(Clock::now() - beg).count();
+}
+
+// -----------------------------
+struct Workload
+{
+    const char *name;
+    //! register the variables, return their ids
+    std::function<std::vector<VarId>(VCDWriter&)> setup;
+    //! make the changes of step *t*, return the number of changes
+    std::function<size_t(VCDWriter&, const std::vector<VarId>&, TimeStamp)> step;
+    TimeStamp steps;
+};
+
+static std::string g_filename;
+static VCDOptions g_options;
+
+// -----------------------------
+static void run(const Workload &w)
+{
+    size_t bytes = 0;
+    HeadPtr header = makeVCDHeader(TimeScale::ONE, TimeScaleUnit::ns, "2024-05-21 22:16:16");
+    SinkPtr sink = g_filename.empty() ? SinkPtr{ new CountingSink(bytes) } : makeVCDSink(g_filename, g_options);
+    VCDWriter writer(std::move(sink), header);
+
+    auto beg = Clock::now();
+    const std::vector<VarId> ids = w.setup(writer);
+    const double t_register = seconds_since(beg);
+
+    beg = Clock::now();
+    writer.flush(); // header and initial values
+    const double t_header = seconds_since(beg);
+    const size_t header_bytes = bytes;
+
+    beg = Clock::now();
+    size_t changes = 0;
+    for (TimeStamp t = 1; t <= w.steps; ++t)
+        changes += w.step(writer, ids, t);
+    writer.close();
+    const double t_changes = seconds_since(beg);
+
+    std::printf("%-14s %9zu %10.1f %10.1f %12.3g %10.1f %10.1f\n", w.name, ids.size(),
+                t_register * 1e3, t_header * 1e3, double(changes) / t_changes,
+                double(bytes - header_bytes) / t_changes / (1024. * 1024.), peak_rss_mb());
+}
+
+// -----------------------------
+// Registration and header of *n* signals one by one or by a table
+static void run_startup(size_t n, bool bulk)
+{
+    std::vector<VarSpec> specs(n);
+    for (size_t i = 0; i < n; ++i)
+    {
+        specs[i].scope = "top.soc.cpu" + std::to_string(i % 4) + ".u" + std::to_string(i / 4 % 256);
+        specs[i].name = "sig" + std::to_string(i);
+        specs[i].type = VariableType::wire;
+        specs[i].size = 1 + unsigned(i % 8);
+    }
+
+    size_t bytes = 0;
+    HeadPtr header = makeVCDHeader(TimeScale::ONE, TimeScaleUnit::ns, "2024-05-21 22:16:16");
+    VCDWriter writer(SinkPtr{ new CountingSink(bytes) }, header);
+
+    auto beg = Clock::now();
+    if (bulk)
+        writer.register_vars(specs);
+    else
+        for (const auto &spec : specs)
+            writer.register_var(spec.scope, spec.name, spec.type, spec.size);
+    const double t_register = seconds_since(beg);
+
+    beg = Clock::now();
+    writer.flush();
+    const double t_header = seconds_since(beg);
+
+    std::printf("%-14s %9zu %10.1f %10.1f %12s %10.1f %10.1f\n", bulk ? "startup_bulk" : "startup_single", n,
+                t_register * 1e3, t_header * 1e3, "-", double(bytes) / t_header / (1024. * 1024.), peak_rss_mb());
+}
+
+// -----------------------------
+// Value changes are only counted
+class CountingHandler : public VCDHandler
+{
+public:
+    size_t chars{};
+    void change(std::string_view code, std::string_view value) override { chars += code.size() + value.size(); }
+};
+
+// -----------------------------
+// Parse a file of *n* 16-bit buses changed every step
+static void run_reader(size_t n)
+{
+    const std::string filename = "vcdwriter_bench_read.vcd";
+    {
+        HeadPtr header = makeVCDHeader(TimeScale::ONE, TimeScaleUnit::ns, "2024-05-21 22:16:16");
+        VCDWriter writer(filename, header);
+        std::vector<VarId> ids;
+        for (size_t i = 0; i < n; ++i)
+            ids.push_back(writer.var_id(writer.register_var("top.bus", "d" + std::to_string(i), VariableType::wire, 16)));
+        for (TimeStamp t = 1; t <= 200; ++t)
+            for (VarId id : ids)
+                writer.change(id, t, unsigned(t * (id + 1)) & 0xFFFFu);
+    }
+
+    auto beg = Clock::now();
+    VCDReader reader(filename);
+    const double t_header = seconds_since(beg);
+
+    beg = Clock::now();
+    CountingHandler handler;
+    const size_t changes = reader.parse(handler);
+    const double t_parse = seconds_since(beg);
+
+    std::printf("%-14s %9zu %10s %10.1f %12.3g %10.1f %10.1f\n", "reader", reader.vars().size(), "-",
+                t_header * 1e3, double(changes) / t_parse, double(reader.size()) / t_parse / (1024. * 1024.), peak_rss_mb());
+    std::remove(filename.c_str());
+}
+
+// -----------------------------
+int main(int argc, char **argv)
+{
+    const double scale = (argc > 1) ? std::atof(argv[1]) : 1.;
+    if (argc > 2)
+        g_filename = argv[2];
+    if (argc > 3)
+    {
+        const std::string file_io = argv[3];
+        g_options.file_io = (file_io == "direct") ? FileIO::direct : (file_io == "mmap") ? FileIO::mmap : FileIO::stream;
+        g_options.buffer_size = 16u << 20;
+    }
+    auto n = [scale](size_t base) { return std::max<size_t>(1u, size_t(double(base) * scale)); };
+
+    std::vector<Workload> workloads;
+    // all the 1-bit signals toggle every step
+    workloads.push_back({ "toggles",
+        [&](VCDWriter &writer) {
+            std::vector<VarId> ids;
+            for (size_t i = 0; i < n(10000); ++i)
+                ids.push_back(writer.var_id(writer.register_var("top.bits", "b" + std::to_string(i), VariableType::wire, 1)));
+            return ids;
+        },
+        [](VCDWriter &writer, const std::vector<VarId> &ids, TimeStamp t) {
+            for (VarId id : ids)
+                writer.change(id, t, (t + id) & 1u);
+            return ids.size();
+        }, 200 });
+    // the same toggles by typed handles
+    std::vector<ScalarHandle> scalars;
+    workloads.push_back({ "toggles_typed",
+        [&](VCDWriter &writer) {
+            std::vector<VarId> ids;
+            scalars.clear();
+            for (size_t i = 0; i < n(10000); ++i)
+            {
+                VarPtr var = writer.register_var("top.bits", "b" + std::to_string(i), VariableType::wire, 1);
+                scalars.push_back(writer.scalar_handle(var));
+                ids.push_back(writer.var_id(var));
+            }
+            return ids;
+        },
+        [&scalars](VCDWriter &writer, const std::vector<VarId>&, TimeStamp t) {
+            for (const auto &h : scalars)
+                writer.change(h, t, (t + h.id()) & 1u);
+            return scalars.size();
+        }, 200 });
+    // 16-bit buses by ids and by typed handles
+    workloads.push_back({ "buses16",
+        [&](VCDWriter &writer) {
+            std::vector<VarId> ids;
+            for (size_t i = 0; i < n(10000); ++i)
+                ids.push_back(writer.var_id(writer.register_var("top.bus", "d" + std::to_string(i), VariableType::wire, 16)));
+            return ids;
+        },
+        [](VCDWriter &writer, const std::vector<VarId> &ids, TimeStamp t) {
+            for (VarId id : ids)
+                writer.change(id, t, unsigned(t * (id + 1)) & 0xFFFFu);
+            return ids.size();
+        }, 200 });
+    std::vector<VectorHandle<16>> buses;
+    workloads.push_back({ "buses16_typed",
+        [&](VCDWriter &writer) {
+            std::vector<VarId> ids;
+            buses.clear();
+            for (size_t i = 0; i < n(10000); ++i)
+            {
+                VarPtr var = writer.register_var("top.bus", "d" + std::to_string(i), VariableType::wire, 16);
+                buses.push_back(writer.vector_handle<16>(var));
+                ids.push_back(writer.var_id(var));
+            }
+            return ids;
+        },
+        [&buses](VCDWriter &writer, const std::vector<VarId>&, TimeStamp t) {
+            for (const auto &h : buses)
+                writer.change(h, t, unsigned(t * (h.id() + 1)) & 0xFFFFu);
+            return buses.size();
+        }, 200 });
+    // the same buses by one batch per step
+    std::vector<uint64_t> values;
+    workloads.push_back({ "buses16_batch",
+        [&](VCDWriter &writer) {
+            std::vector<VarId> ids;
+            for (size_t i = 0; i < n(10000); ++i)
+                ids.push_back(writer.var_id(writer.register_var("top.bus", "d" + std::to_string(i), VariableType::wire, 16)));
+            return ids;
+        },
+        [&values](VCDWriter &writer, const std::vector<VarId> &ids, TimeStamp t) {
+            values.resize(ids.size());
+            for (size_t i = 0; i < ids.size(); ++i)
+                values[i] = unsigned(t * (ids[i] + 1)) & 0xFFFFu;
+            writer.change_batch(t, ids, values);
+            return ids.size();
+        }, 200 });
+    // wide buses by 64-bit words
+    workloads.push_back({ "wide_buses",
+        [&](VCDWriter &writer) {
+            std::vector<VarId> ids;
+            for (size_t i = 0; i < n(256); ++i)
+                ids.push_back(writer.var_id(writer.register_var("top.bus", "d" + std::to_string(i), VariableType::wire, 512)));
+            return ids;
+        },
+        [](VCDWriter &writer, const std::vector<VarId> &ids, TimeStamp t) {
+            uint64_t words[8];
+            for (VarId id : ids)
+            {
+                for (unsigned w = 0; w < 8; ++w)
+                    words[w] = (uint64_t(t) * 0x9E3779B97F4A7C15ull) ^ (uint64_t(id) << w);
+                writer.change(id, t, words, 8);
+            }
+            return ids.size();
+        }, 200 });
+    // a few random changes over a million signals
+    std::mt19937 rng(42);
+    workloads.push_back({ "sparse_1M",
+        [&](VCDWriter &writer) {
+            std::vector<VarId> ids;
+            for (size_t i = 0; i < n(1000000); ++i)
+                ids.push_back(writer.var_id(writer.register_var("top.s" + std::to_string(i % 1000), "v" + std::to_string(i),
+                                                                VariableType::wire, 8)));
+            return ids;
+        },
+        [&rng](VCDWriter &writer, const std::vector<VarId> &ids, TimeStamp t) {
+            for (unsigned i = 0; i < 1000; ++i)
+                writer.change(ids[rng() % ids.size()], t, unsigned(t + i) & 0xFFu);
+            return size_t(1000);
+        }, 200 });
+    // 32 levels of nested scopes
+    workloads.push_back({ "deep_scopes",
+        [&](VCDWriter &writer) {
+            std::vector<VarId> ids;
+            std::string scope = "top";
+            for (size_t i = 0; i < n(10000); ++i)
+            {
+                if (i % 32 == 0)
+                    scope = "top";
+                scope += ".l" + std::to_string(i % 32);
+                ids.push_back(writer.var_id(writer.register_var(scope, "v" + std::to_string(i), VariableType::wire, 4)));
+            }
+            return ids;
+        },
+        [](VCDWriter &writer, const std::vector<VarId> &ids, TimeStamp t) {
+            for (VarId id : ids)
+                writer.change(id, t, unsigned(t + id) & 0xFu);
+            return ids.size();
+        }, 100 });
+    // real and string variables
+    workloads.push_back({ "real_string",
+        [&](VCDWriter &writer) {
+            std::vector<VarId> ids;
+            for (size_t i = 0; i < n(1000); ++i)
+            {
+                ids.push_back(writer.var_id(writer.register_var("top.r", "r" + std::to_string(i), VariableType::real)));
+                ids.push_back(writer.var_id(writer.register_var("top.s", "s" + std::to_string(i), VariableType::string)));
+            }
+            return ids;
+        },
+        [](VCDWriter &writer, const std::vector<VarId> &ids, TimeStamp t) {
+            const std::string states[] = { "idle", "fetch", "decode", "execute" };
+            for (size_t i = 0; i < ids.size(); i += 2)
+            {
+                writer.change(ids[i], t, std::to_string(double(t) * 0.5 + double(i)));
+                writer.change(ids[i + 1], t, states[(t + i) % 4]);
+            }
+            return ids.size();
+        }, 200 });
+    // dump_off/dump_on every step
+    workloads.push_back({ "dump_storm",
+        [&](VCDWriter &writer) {
+            std::vector<VarId> ids;
+            for (size_t i = 0; i < n(1000); ++i)
+                ids.push_back(writer.var_id(writer.register_var("top.d", "v" + std::to_string(i), VariableType::wire, 16)));
+            return ids;
+        },
+        [](VCDWriter &writer, const std::vector<VarId> &ids, TimeStamp t) {
+            for (VarId id : ids)
+                writer.change(id, t, unsigned(t * (id + 1)) & 0xFFFFu);
+            if (t % 2)
+                writer.dump_off(t);
+            else
+                writer.dump_on(t);
+            return ids.size();
+        }, 200 });
+
+    std::printf("%-14s %9s %10s %10s %12s %10s %10s\n",
+                "workload", "vars", "reg ms", "header ms", "changes/s", "MB/s", "peak MB");
+    for (const auto &w : workloads)
+        run(w);
+    for (size_t size : { n(1000000), n(4000000) })
+    {
+        run_startup(size, false);
+        run_startup(size, true);
+    }
+    run_reader(n(10000));
+    return 0;
+}